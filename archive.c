@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "archive.h"
+#include "xxh64.h"
+
+#ifdef HAVE_ZSTD
+
+#define IDX_HEADER (sizeof ARCHIVE_MAGIC - 1)
+
+static void
+rec_swap(struct archive_rec *r, bool to_disk)
+{
+    if (to_disk) {
+        r->offset = htole64(r->offset);
+        r->csize = htole32(r->csize);
+        r->dsize = htole32(r->dsize);
+        r->fileno = htole32(r->fileno);
+        r->dict_id = htole32(r->dict_id);
+        r->hash = htole64(r->hash);
+    } else {
+        r->offset = le64toh(r->offset);
+        r->csize = le32toh(r->csize);
+        r->dsize = le32toh(r->dsize);
+        r->fileno = le32toh(r->fileno);
+        r->dict_id = le32toh(r->dict_id);
+        r->hash = le64toh(r->hash);
+    }
+}
+
+static int
+load_dict(ARCHIVE *a, const char *dict_path)
+{
+    FILE *f = fopen(dict_path, "re");
+    void *buf = NULL;
+    long len;
+
+    if (!f || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0
+        || !(buf = malloc(len)) || fread(buf, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "Could not read dictionary %s: %s (%d)\n", dict_path, strerror(errno), errno);
+        goto fail;
+    }
+    a->cdict = ZSTD_createCDict(buf, len, ARCHIVE_LEVEL);
+    a->ddict = ZSTD_createDDict(buf, len);
+    a->dict_id = ZSTD_getDictID_fromDict(buf, len);
+    if (!a->cdict || !a->ddict) {
+        fprintf(stderr, "Could not load dictionary %s.\n", dict_path);
+        goto fail;
+    }
+    free(buf);
+    fclose(f);
+    return 0;
+
+fail:
+    free(buf);
+    if (f)
+        fclose(f);
+    return -1;
+}
+
+/* Opens the archive at path (and its index, path.idx), creating both if
+ * they don't exist yet and write is set. */
+ARCHIVE *
+archive_open(const char *path, const char *dict_path, bool write)
+{
+    ARCHIVE *a = calloc(1, sizeof *a);
+    char *idx_path = NULL;
+    struct stat st;
+    int flags = write ? O_RDWR|O_CREAT|O_CLOEXEC : O_RDONLY|O_CLOEXEC;
+
+    if (!a)
+        return NULL;
+    a->fd = a->idx_fd = -1;
+    if (!(a->path = strdup(path)) || asprintf(&idx_path, "%s.idx", path) < 0) {
+        idx_path = NULL;
+        goto fail;
+    }
+
+    if ((a->fd = open(path, flags, 0666)) < 0 || (a->idx_fd = open(idx_path, flags, 0666)) < 0
+        || fstat(a->idx_fd, &st) < 0) {
+        fprintf(stderr, "Could not open archive %s: %s (%d)\n", a->fd < 0 ? path : idx_path, strerror(errno), errno);
+        goto fail;
+    }
+
+    // a new index starts with the magic
+    char magic[IDX_HEADER];
+    if (st.st_size == 0 && write) {
+        if (pwrite(a->idx_fd, ARCHIVE_MAGIC, IDX_HEADER, 0) != IDX_HEADER || fdatasync(a->idx_fd) < 0) {
+            fprintf(stderr, "Could not write %s: %s (%d)\n", idx_path, strerror(errno), errno);
+            goto fail;
+        }
+        st.st_size = IDX_HEADER;
+    } else if (pread(a->idx_fd, magic, IDX_HEADER, 0) != IDX_HEADER || memcmp(magic, ARCHIVE_MAGIC, IDX_HEADER)) {
+        fprintf(stderr, "Not an activity archive index: %s\n", idx_path);
+        goto fail;
+    }
+
+    // a partly written index record is as good as none
+    a->n = (st.st_size - IDX_HEADER) / sizeof(struct archive_rec);
+    a->max = a->n + 16;
+    if (!(a->rec = malloc(a->max * sizeof *a->rec)))
+        goto fail;
+    if (a->n && pread(a->idx_fd, a->rec, a->n * sizeof *a->rec, IDX_HEADER) != (ssize_t)(a->n * sizeof *a->rec)) {
+        fprintf(stderr, "Could not read %s: %s (%d)\n", idx_path, strerror(errno), errno);
+        goto fail;
+    }
+    for (int ii=0; ii<a->n; ii++) {
+        rec_swap(&a->rec[ii], false);
+        a->rec[ii].name[sizeof a->rec[ii].name - 1] = 0;
+    }
+    if (a->n)
+        a->end = a->rec[a->n-1].offset + a->rec[a->n-1].csize;
+
+    if (fstat(a->fd, &st) < 0 || st.st_size < a->end) {
+        fprintf(stderr, "Archive %s is shorter than its index says.\n", path);
+        goto fail;
+    }
+    if (write && (ftruncate(a->idx_fd, IDX_HEADER + a->n * sizeof *a->rec) < 0
+                  || (st.st_size > a->end && ftruncate(a->fd, a->end) < 0))) {
+        fprintf(stderr, "Could not cut off unindexed data from %s: %s (%d)\n", path, strerror(errno), errno);
+        goto fail;
+    }
+
+    if (!(a->cctx = ZSTD_createCCtx()) || !(a->dctx = ZSTD_createDCtx()))
+        goto fail;
+    if (dict_path && load_dict(a, dict_path) < 0)
+        goto fail;
+
+    free(idx_path);
+    return a;
+
+fail:
+    free(idx_path);
+    archive_close(a);
+    return NULL;
+}
+
+void
+archive_close(ARCHIVE *a)
+{
+    if (a) {
+        if (a->fd >= 0)
+            close(a->fd);
+        if (a->idx_fd >= 0)
+            close(a->idx_fd);
+        ZSTD_freeCCtx(a->cctx);
+        ZSTD_freeDCtx(a->dctx);
+        ZSTD_freeCDict(a->cdict);
+        ZSTD_freeDDict(a->ddict);
+        free(a->rec);
+        free(a->path);
+        free(a);
+    }
+}
+
+/* Compresses buf onto the end of the archive, to be indexed at the next
+ * archive_commit. Returns its compressed size, or -1 on failure. */
+int
+archive_append(ARCHIVE *a, uint32_t fileno, const char *name, const void *buf, int length, uint64_t hash)
+{
+    size_t bound = ZSTD_compressBound(length), csize;
+    uint8_t *out;
+    struct timespec start, stop;    // CPU time, since other threads may be compressing too
+
+    if (strlen(name) >= sizeof a->rec->name) {
+        fprintf(stderr, "Name too long for archive: %s\n", name);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (a->n + a->pending == a->max) {
+        struct archive_rec *rec = realloc(a->rec, 2 * a->max * sizeof *rec);
+        if (!rec)
+            return -1;
+        a->rec = rec;
+        a->max *= 2;
+    }
+    if (!(out = malloc(bound)))
+        return -1;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    if (a->cdict)
+        csize = ZSTD_compress_usingCDict(a->cctx, out, bound, buf, length, a->cdict);
+    else
+        csize = ZSTD_compressCCtx(a->cctx, out, bound, buf, length, ARCHIVE_LEVEL);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+    a->secs += (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec)/1e9;
+    if (ZSTD_isError(csize)) {
+        fprintf(stderr, "Could not compress %s: %s\n", name, ZSTD_getErrorName(csize));
+        free(out);
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct archive_rec *last = a->n + a->pending ? &a->rec[a->n + a->pending - 1] : NULL;
+    struct archive_rec *r = &a->rec[a->n + a->pending];
+    *r = (struct archive_rec){ .offset = last ? last->offset + last->csize : 0, .csize = csize, .dsize = length,
+                               .fileno = fileno, .dict_id = a->cdict ? a->dict_id : 0, .hash = hash };
+    strcpy(r->name, name);
+
+    for (size_t done = 0; done < csize; ) {
+        ssize_t w = pwrite(a->fd, out + done, csize - done, r->offset + done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        else if (w < 0) {
+            int err = errno;
+            fprintf(stderr, "Could not write to archive %s: %s (%d)\n", a->path, strerror(errno), errno);
+            free(out);
+            errno = err;
+            return -1;
+        }
+        done += w;
+    }
+    free(out);
+
+    a->pending++;
+    a->in_bytes += length;
+    a->out_bytes += csize;
+    return csize;
+}
+
+/* Syncs the frames appended since the last commit, and then indexes them.
+ * Returns the number of files committed, or -1 on failure. */
+int
+archive_commit(ARCHIVE *a)
+{
+    if (!a->pending)
+        return 0;
+
+    if (fdatasync(a->fd) < 0) {
+        fprintf(stderr, "Could not flush %s: %s (%d)\n", a->path, strerror(errno), errno);
+        return -1;
+    }
+
+    size_t len = a->pending * sizeof *a->rec;
+    struct archive_rec disk[a->pending];
+    memcpy(disk, &a->rec[a->n], len);
+    for (int ii=0; ii<a->pending; ii++)
+        rec_swap(&disk[ii], true);
+    if (pwrite(a->idx_fd, disk, len, IDX_HEADER + a->n * sizeof *a->rec) != (ssize_t)len || fdatasync(a->idx_fd) < 0) {
+        fprintf(stderr, "Could not update index of %s: %s (%d)\n", a->path, strerror(errno), errno);
+        return -1;
+    }
+
+    int n = a->pending;
+    a->n += a->pending;
+    a->pending = 0;
+    a->end = a->rec[a->n-1].offset + a->rec[a->n-1].csize;
+    return n;
+}
+
+/* Forgets the frames appended since the last commit */
+void
+archive_abort(ARCHIVE *a)
+{
+    if (a->pending) {
+        a->pending = 0;
+        if (ftruncate(a->fd, a->end) < 0)
+            fprintf(stderr, "Could not cut off unindexed data from %s: %s (%d)\n", a->path, strerror(errno), errno);
+    }
+}
+
+/* Returns the index of the (last) committed file called name, or -1 */
+int
+archive_find(const ARCHIVE *a, const char *name)
+{
+    for (int ii=a->n-1; ii>=0; ii--)
+        if (!strcmp(a->rec[ii].name, name))
+            return ii;
+    return -1;
+}
+
+/* Reads back the ii-th file, checking it against its hash. Returns its length, with
+ * the contents in *buf (to be freed by the caller), or -1 on failure. */
+int
+archive_read(ARCHIVE *a, int ii, uint8_t **buf)
+{
+    const struct archive_rec *r = &a->rec[ii];
+    uint8_t *in = NULL, *out = NULL;
+    size_t len;
+
+    if (r->dict_id && r->dict_id != a->dict_id) {
+        fprintf(stderr, "%s needs dictionary %u.\n", r->name, r->dict_id);
+        return -1;
+    }
+    if (!(in = malloc(r->csize)) || !(out = malloc(r->dsize ? r->dsize : 1)))
+        goto fail;
+    if (pread(a->fd, in, r->csize, r->offset) != r->csize) {
+        fprintf(stderr, "Could not read %s from %s: %s (%d)\n", r->name, a->path, strerror(errno), errno);
+        goto fail;
+    }
+
+    if (r->dict_id)
+        len = ZSTD_decompress_usingDDict(a->dctx, out, r->dsize, in, r->csize, a->ddict);
+    else
+        len = ZSTD_decompressDCtx(a->dctx, out, r->dsize, in, r->csize);
+    if (ZSTD_isError(len) || len != r->dsize || xxh64(out, len, 0) != r->hash) {
+        fprintf(stderr, "%s is corrupt in %s%s%s\n", r->name, a->path,
+                ZSTD_isError(len) ? ": " : ".", ZSTD_isError(len) ? ZSTD_getErrorName(len) : "");
+        goto fail;
+    }
+    free(in);
+    *buf = out;
+    return len;
+
+fail:
+    free(in);
+    free(out);
+    return -1;
+}
+
+void
+archive_list(const ARCHIVE *a, FILE *f)
+{
+    uint64_t in = 0, out = 0;
+    for (int ii=0; ii<a->n; ii++) {
+        const struct archive_rec *r = &a->rec[ii];
+        fprintf(f, "%-32s 0x%08x %9u -> %9u bytes%s\n", r->name, r->fileno, r->dsize, r->csize,
+                r->dict_id ? " (dictionary)" : "");
+        in += r->dsize;
+        out += r->csize;
+    }
+    fprintf(f, "%d files, %llu bytes compressed to %llu (%.2f:1)\n", a->n,
+            (unsigned long long)in, (unsigned long long)out, out ? (double)in/out : 0);
+}
+
+/* Reports the compression done since the archive was opened */
+void
+archive_report(const ARCHIVE *a, FILE *f, const char *indent)
+{
+    fprintf(f, "%sarchive: %llu bytes compressed to %llu (%.2f:1), at %.1f MB/s per core%s\n", indent,
+            (unsigned long long)a->in_bytes, (unsigned long long)a->out_bytes,
+            a->out_bytes ? (double)a->in_bytes/a->out_bytes : 0,
+            a->secs > 0 ? a->in_bytes/a->secs/1e6 : 0, a->cdict ? ", with dictionary" : "");
+}
+
+#else /* !HAVE_ZSTD */
+
+ARCHIVE *
+archive_open(const char *path, const char *dict_path, bool write)
+{
+    fprintf(stderr, "Could not open archive %s: ttblue was built without zstd.\n", path);
+    return NULL;
+}
+
+void archive_close(ARCHIVE *a) {}
+int archive_append(ARCHIVE *a, uint32_t fileno, const char *name, const void *buf, int length, uint64_t hash) { return -1; }
+int archive_commit(ARCHIVE *a) { return -1; }
+void archive_abort(ARCHIVE *a) {}
+int archive_find(const ARCHIVE *a, const char *name) { return -1; }
+int archive_read(ARCHIVE *a, int ii, uint8_t **buf) { return -1; }
+void archive_list(const ARCHIVE *a, FILE *f) {}
+void archive_report(const ARCHIVE *a, FILE *f, const char *indent) {}
+
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,62 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Compressed activity archive: each file is compressed into a zstd frame of
+ * its own, appended to the archive as it's saved (so that "zstd -dc" gives
+ * back all the files, one after the other), and the index next to it
+ * (ARCHIVE.idx) has a fixed-size record for each file with its name, offset
+ * and sizes, so that any one file can be read back (or streamed) without
+ * decompressing the others. Small files compress much better with a
+ * dictionary trained on earlier ones ("zstd --train *.ttbin"), whose ID is
+ * kept in the index, since it's needed to read them back.
+ *
+ * Frames are synced before the index records which point to them, so a
+ * crash can only leave frames beyond the end of the index, which are cut
+ * off when the archive is next opened for writing.
+ *
+ * Needs libzstd (HAVE_ZSTD); without it, archive_open always fails.
+ */
+
+#define ARCHIVE_MAGIC "TTBLUEZ1"
+#define ARCHIVE_LEVEL 9         // most of what 19 gets, an order of magnitude faster
+
+struct archive_rec {            // in the index, little-endian
+    uint64_t offset;            // of the frame in the archive
+    uint32_t csize, dsize;      // compressed and original sizes
+    uint32_t fileno;
+    uint32_t dict_id;           // 0 if compressed without a dictionary
+    uint64_t hash;              // XXH64 of the original file
+    char name[32];
+} __attribute__((packed));
+
+typedef struct archive {
+    int fd, idx_fd;
+    char *path;
+    uint64_t end;               // of the last committed frame
+    struct archive_rec *rec;    // committed, then appended but not yet committed
+    int n, pending, max;
+
+    void *cctx, *dctx, *cdict, *ddict; // zstd's
+    uint32_t dict_id;
+
+    // compression so far, since opening
+    uint64_t in_bytes, out_bytes;
+    double secs;                // of CPU time
+} ARCHIVE;
+
+ARCHIVE *archive_open(const char *path, const char *dict_path, bool write);
+void archive_close(ARCHIVE *a);
+int archive_append(ARCHIVE *a, uint32_t fileno, const char *name, const void *buf, int length, uint64_t hash);
+int archive_commit(ARCHIVE *a);
+void archive_abort(ARCHIVE *a);
+int archive_find(const ARCHIVE *a, const char *name);
+int archive_read(ARCHIVE *a, int i, uint8_t **buf);
+void archive_list(const ARCHIVE *a, FILE *f);
+void archive_report(const ARCHIVE *a, FILE *f, const char *indent);
+
+#endif /* __ARCHIVE_H__ */
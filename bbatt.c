@@ -5,28 +5,214 @@
  *   att_write and att_wrreq: send BT_ADD_OP_WRITE_CMD,
  *                         or send BT_ADD_OP_WRITE_REQ and await BT_ADD_OP_WRITE_RSP
  *   att_read_not: await BT_ATT_OP_HANDLE_VAL_NOT)
+ *
+ * Outgoing PDUs are sent with sendmsg(), with the 3-byte ATT header and the
+ * payload in separate iovecs, so the payload is never copied. att_write_batch
+ * sends a run of write commands with a single sendmmsg() call.
+ *
+ * Incoming PDUs are normally read with one recv() each. With att_rx_batched,
+ * they are instead read with recvmmsg() into a small queue of preallocated
+ * slots, kept in the socket's struct att_sock, so that a burst of notifications (as during a file
+ * read) costs one syscall rather than one per PDU.
+ *
+ * With att_trace_start, every PDU sent or received on a socket is also
+ * recorded, with its time, for replay.c to play back later.
  */
 
+#define _GNU_SOURCE
+
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
 #include "bbatt.h"
 
+struct att_rxq {
+    int head, n;
+    struct att_rx_stats stats;
+    struct { uint8_t buf[ATT_RX_SLOT]; int len; } slot[ATT_RX_QUEUE];
+};
+
+struct att_trace {
+    FILE *out;
+    struct timespec start;
+};
+
+/* Wraps fd, with neither batching nor tracing */
+void
+att_sock_init(struct att_sock *s, int fd)
+{
+    s->fd = fd;
+    s->rxq = NULL;
+    s->trace = NULL;
+}
+
+/* Drops the receive queue and stops tracing; the caller still owns (and
+ * closes) the socket itself */
+void
+att_sock_done(struct att_sock *s)
+{
+    att_rx_batched(s, false);
+    att_trace_stop(s);
+}
+
+/* Starts recording the PDUs on the socket to out (see struct att_trace_rec) */
+int
+att_trace_start(struct att_sock *s, FILE *out)
+{
+    if (s->trace)
+        return -1;
+    if (!(s->trace = calloc(1, sizeof(struct att_trace))))
+        return -1;
+
+    struct att_trace_hdr hdr = { ATT_TRACE_MAGIC, htobl(ATT_TRACE_VERSION) };
+    if (fwrite(&hdr, sizeof hdr, 1, out) != 1) {
+        free(s->trace);
+        s->trace = NULL;
+        return -1;
+    }
+    s->trace->out = out;
+    clock_gettime(CLOCK_MONOTONIC, &s->trace->start);
+    return 0;
+}
+
+/* Stops recording; the caller still owns (and closes) the FILE */
+int
+att_trace_stop(struct att_sock *s)
+{
+    if (!s->trace)
+        return -1;
+    int result = fflush(s->trace->out);
+    free(s->trace);
+    s->trace = NULL;
+    return result;
+}
+
+static void
+trace_pdu(struct att_sock *s, int dir, const struct iovec *iov, int iovcnt)
+{
+    struct att_trace *t = s->trace;
+    if (!t)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct att_trace_rec rec = {
+        .ns = htobll((now.tv_sec - t->start.tv_sec)*1000000000LL + (now.tv_nsec - t->start.tv_nsec)),
+        .dir = dir,
+    };
+    int length = 0;
+    for (int ii=0; ii<iovcnt; ii++)
+        length += iov[ii].iov_len;
+    rec.len = htobs(length);
+
+    fwrite(&rec, sizeof rec, 1, t->out);
+    for (int ii=0; ii<iovcnt; ii++)
+        fwrite(iov[ii].iov_base, 1, iov[ii].iov_len, t->out);
+}
+
+static inline void
+trace_buf(struct att_sock *s, int dir, const void *buf, int length)
+{
+    struct iovec iov = { (void *)buf, length };
+    trace_pdu(s, dir, &iov, 1);
+}
+
+/* Switches the socket between one recv() per PDU, and batched recvmmsg() */
+int
+att_rx_batched(struct att_sock *s, bool on)
+{
+    if (on && !s->rxq) {
+        if (!(s->rxq = calloc(1, sizeof(struct att_rxq))))
+            return -1;
+    } else if (!on) {
+        free(s->rxq);
+        s->rxq = NULL;
+    }
+    return 0;
+}
+
+/* PDUs and syscalls so far, if the socket is batched */
 int
-att_read(int fd, uint16_t handle, void *buf)
+att_rx_stats(struct att_sock *s, struct att_rx_stats *stats)
+{
+    if (!s->rxq)
+        return -1;
+    *stats = s->rxq->stats;
+    return 0;
+}
+
+static int
+att_recv(struct att_sock *s, void *buf, int length)
+{
+    struct att_rxq *q = s->rxq;
+    if (!q) {
+        int result = recv(s->fd, buf, length, 0);
+        if (result == 0) {
+            // no PDU is empty: the other end hung up
+            errno = ECONNRESET;
+            return -1;
+        } else if (result > 0)
+            trace_buf(s, ATT_TRACE_RX, buf, result);
+        return result;
+    }
+
+    if (q->head == q->n) {
+        struct iovec v[ATT_RX_QUEUE];
+        struct mmsghdr msgs[ATT_RX_QUEUE];
+        for (int ii=0; ii<ATT_RX_QUEUE; ii++) {
+            v[ii] = (struct iovec){ q->slot[ii].buf, ATT_RX_SLOT };
+            msgs[ii] = (struct mmsghdr){ .msg_hdr = { .msg_iov = &v[ii], .msg_iovlen = 1 } };
+        }
+
+        // blocks (subject to SO_RCVTIMEO) for the first PDU only
+        int result = recvmmsg(s->fd, msgs, ATT_RX_QUEUE, MSG_WAITFORONE, NULL);
+        if (result < 0)
+            return result;
+        for (int ii=0; ii<result; ii++) {
+            q->slot[ii].len = msgs[ii].msg_len;
+            trace_buf(s, ATT_TRACE_RX, q->slot[ii].buf, q->slot[ii].len);
+        }
+        q->head = 0;
+        q->n = result;
+        q->stats.calls++;
+        q->stats.pdus += result;
+    }
+
+    if (q->slot[q->head].len == 0) {
+        q->head = q->n;
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    // truncate, like recv() on a SOCK_SEQPACKET socket would
+    int len = q->slot[q->head].len < length ? q->slot[q->head].len : length;
+    memcpy(buf, q->slot[q->head++].buf, len);
+    return len;
+}
+
+int
+att_read(struct att_sock *s, uint16_t handle, void *buf)
 {
     int result;
 
     struct { uint8_t opcode; uint16_t handle; } __attribute__((packed)) pkt = { BT_ATT_OP_READ_REQ, htobs(handle) };
-    result = send(fd, &pkt, sizeof(pkt), 0);
+    result = send(s->fd, &pkt, sizeof(pkt), 0);
     if (result<0)
         return result;
+    trace_buf(s, ATT_TRACE_TX, &pkt, sizeof pkt);
 
     struct { uint8_t opcode; uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; } __attribute__((packed)) rpkt = {0};
     while (rpkt.opcode != BT_ATT_OP_READ_RSP) {
-        result = recv(fd, &rpkt, sizeof rpkt, 0);
+        result = att_recv(s, &rpkt, sizeof rpkt);
         if (result<0)
             return result;
         else if (rpkt.opcode == BT_ATT_OP_ERROR_RSP && result==1+sizeof(struct bt_att_pdu_error_rsp)) {
@@ -45,41 +231,87 @@ att_read(int fd, uint16_t handle, void *buf)
     return -2;
 }
 
-int
-att_write(int fd, uint16_t handle, const void *buf, int length)
+struct att_hdr { uint8_t opcode; uint16_t handle; } __attribute__((packed));
+
+static int
+att_sendv(struct att_sock *s, uint8_t opcode, uint16_t handle, const struct iovec *iov, int iovcnt)
 {
-    struct { uint8_t opcode; uint16_t handle; uint8_t buf[length]; } __attribute__((packed)) pkt;
-    pkt.opcode = BT_ATT_OP_WRITE_CMD;
-    pkt.handle = htobs(handle);
+    struct att_hdr hdr = { opcode, htobs(handle) };
+    struct iovec v[1+ATT_MAX_IOV] = { { &hdr, sizeof hdr } };
+    int length = 0;
 
-    if (sizeof pkt > BT_ATT_DEFAULT_LE_MTU)
+    if (iovcnt > ATT_MAX_IOV)
+        return -1;
+    for (int ii=0; ii<iovcnt; ii++) {
+        v[ii+1] = iov[ii];
+        length += iov[ii].iov_len;
+    }
+    if (sizeof hdr + length > BT_ATT_DEFAULT_LE_MTU)
         return -1;
-    memcpy(pkt.buf, buf, length);
 
-    int result = send(fd, &pkt, sizeof(pkt), 0);
+    struct msghdr msg = { .msg_iov = v, .msg_iovlen = iovcnt+1 };
+    int result = sendmsg(s->fd, &msg, 0);
     if (result<0)
         return result;
+    trace_pdu(s, ATT_TRACE_TX, v, iovcnt+1);
 
     return length;
 }
 
 int
-att_wrreq(int fd, uint16_t handle, const void *buf, int length)
+att_writev(struct att_sock *s, uint16_t handle, const struct iovec *iov, int iovcnt)
 {
-    struct { uint8_t opcode; uint16_t handle; uint8_t buf[length]; } __attribute__((packed)) pkt;
-    pkt.opcode = BT_ATT_OP_WRITE_REQ;
-    pkt.handle = htobs(handle);
+    return att_sendv(s, BT_ATT_OP_WRITE_CMD, handle, iov, iovcnt);
+}
 
-    if (sizeof pkt > BT_ATT_DEFAULT_LE_MTU)
-        return -1;
-    memcpy(pkt.buf, buf, length);
+int
+att_write(struct att_sock *s, uint16_t handle, const void *buf, int length)
+{
+    struct iovec iov = { (void *)buf, length };
+    return att_sendv(s, BT_ATT_OP_WRITE_CMD, handle, &iov, 1);
+}
+
+/* Sends n write commands to the same handle; returns the number sent */
+int
+att_write_batch(struct att_sock *s, uint16_t handle, const struct att_pkt *pkts, int n)
+{
+    struct att_hdr hdr = { BT_ATT_OP_WRITE_CMD, htobs(handle) };
+    int sent = 0;
+
+    while (sent < n) {
+        int chunk = (n-sent > ATT_MAX_BATCH) ? ATT_MAX_BATCH : n-sent;
+        struct iovec v[ATT_MAX_BATCH][1+ATT_MAX_IOV];
+        struct mmsghdr msgs[ATT_MAX_BATCH];
+
+        for (int ii=0; ii<chunk; ii++) {
+            const struct att_pkt *p = &pkts[sent+ii];
+            if (p->iovcnt > ATT_MAX_IOV)
+                return -1;
+            v[ii][0] = (struct iovec){ &hdr, sizeof hdr };
+            memcpy(&v[ii][1], p->iov, p->iovcnt * sizeof(struct iovec));
+            msgs[ii] = (struct mmsghdr){ .msg_hdr = { .msg_iov = v[ii], .msg_iovlen = p->iovcnt+1 } };
+        }
+
+        int result = sendmmsg(s->fd, msgs, chunk, 0);
+        if (result < 0)
+            return result;
+        for (int ii=0; ii<result; ii++)
+            trace_pdu(s, ATT_TRACE_TX, v[ii], pkts[sent+ii].iovcnt+1);
+        sent += result;
+    }
+    return sent;
+}
 
-    int result = send(fd, &pkt, sizeof(pkt), 0);
+int
+att_wrreq(struct att_sock *s, uint16_t handle, const void *buf, int length)
+{
+    struct iovec iov = { (void *)buf, length };
+    int result = att_sendv(s, BT_ATT_OP_WRITE_REQ, handle, &iov, 1);
     if (result<0)
         return result;
 
     struct { uint8_t opcode; uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; } __attribute__((packed)) rpkt = {0};
-    result = recv(fd, &rpkt, sizeof rpkt, 0);
+    result = att_recv(s, &rpkt, sizeof rpkt);
     if (result < 0)
         return result;
     else if (rpkt.opcode == BT_ATT_OP_ERROR_RSP && result==1+sizeof(struct bt_att_pdu_error_rsp)) {
@@ -95,10 +327,10 @@ att_wrreq(int fd, uint16_t handle, const void *buf, int length)
 }
 
 int
-att_read_not(int fd, uint16_t *handle, void *buf)
+att_read_not(struct att_sock *s, uint16_t *handle, void *buf)
 {
     struct { uint8_t opcode; uint16_t handle; uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; } __attribute__((packed)) rpkt;
-    int result = recv(fd, &rpkt, sizeof rpkt, 0);
+    int result = att_recv(s, &rpkt, sizeof rpkt);
 
     if (result<0)
         return result;
@@ -117,6 +349,70 @@ att_read_not(int fd, uint16_t *handle, void *buf)
     }
 }
 
+/* Opens an L2CAP connection on the ATT channel. Returns the socket, -1 if it
+ * could not be set up, or -2 if the connection itself failed (errno is set). */
+int
+l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type, int sec, int verbose)
+{
+    int sock;
+    struct sockaddr_l2 srcaddr, dstaddr;
+    struct bt_security btsec;
+
+    if (verbose) {
+        char srcaddr_str[18], dstaddr_str[18];
+
+        ba2str(src, srcaddr_str);
+        ba2str(dst, dstaddr_str);
+
+        fprintf(stderr, "Opening L2CAP LE connection on ATT "
+                        "channel:\n\t src: %s\n\tdest: %s (%s)\n",
+                srcaddr_str, dstaddr_str, addr_type_name(dst_type));
+    }
+
+    sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    if (sock < 0) {
+        fprintf(stderr, "Failed to create L2CAP socket: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    /* Set up source address */
+    memset(&srcaddr, 0, sizeof(srcaddr));
+    srcaddr.l2_family = AF_BLUETOOTH;
+    srcaddr.l2_cid = htobs(ATT_CID);
+    srcaddr.l2_bdaddr_type = 0;
+    bacpy(&srcaddr.l2_bdaddr, src);
+
+    if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
+        fprintf(stderr, "Failed to bind L2CAP socket: %s (%d)\n", strerror(errno), errno);
+        close(sock);
+        return -1;
+    }
+
+    /* Set the security level */
+    memset(&btsec, 0, sizeof(btsec));
+    btsec.level = sec;
+    if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
+                            sizeof(btsec)) != 0) {
+        fprintf(stderr, "Failed to set L2CAP security level: %s (%d)\n", strerror(errno), errno);
+        close(sock);
+        return -1;
+    }
+
+    /* Set up destination address */
+    memset(&dstaddr, 0, sizeof(dstaddr));
+    dstaddr.l2_family = AF_BLUETOOTH;
+    dstaddr.l2_cid = htobs(ATT_CID);
+    dstaddr.l2_bdaddr_type = dst_type;
+    bacpy(&dstaddr.l2_bdaddr, dst);
+
+    if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
+        close(sock);
+        return -2;
+    }
+
+    return sock;
+}
+
 const char *
 addr_type_name(int dst_type) {
     switch (dst_type) {
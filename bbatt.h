@@ -1,10 +1,58 @@
+#ifndef __BBATT_H__
+#define __BBATT_H__
+
 /* use ATT protocol opcodes from bluez/src/shared/att-types.h */
 #include "att-types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <bluetooth/bluetooth.h>
+
+#define ATT_MAX_IOV 2       /* payload pieces per PDU, e.g. data + CRC trailer */
+#define ATT_MAX_BATCH 64    /* PDUs per sendmmsg() */
+#define ATT_RX_QUEUE 16     /* PDUs per recvmmsg() */
+#define ATT_RX_SLOT (3+BT_ATT_DEFAULT_LE_MTU)
+#define ATT_CID 4
+
+/* A trace file is a header followed by one record per PDU, each followed
+ * by the PDU itself; all little-endian. ns counts from att_trace_start. */
+#define ATT_TRACE_MAGIC "TTBTRACE"
+#define ATT_TRACE_VERSION 1
+#define ATT_TRACE_TX 0  /* to the watch */
+#define ATT_TRACE_RX 1  /* from the watch */
+struct att_trace_hdr { char magic[8]; uint32_t version; } __attribute__((packed));
+struct att_trace_rec { uint64_t ns; uint8_t dir; uint16_t len; } __attribute__((packed));
+
+struct att_pkt { struct iovec iov[ATT_MAX_IOV]; int iovcnt; };
+struct att_rx_stats { unsigned long pdus, calls; };
 
-int att_read(int fd, uint16_t handle, void *buf);
-int att_write(int fd, uint16_t handle, const void *buf, int length);
-int att_wrreq(int fd, uint16_t handle, const void *buf, int length);
-int att_read_not(int fd, uint16_t *handle, void *buf);
+/* One ATT socket, with its receive queue (if batched) and trace (if
+ * recording). Only ever used by one thread at a time. */
+struct att_rxq;
+struct att_trace;
+struct att_sock {
+    int fd;
+    struct att_rxq *rxq;
+    struct att_trace *trace;
+};
+
+int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type, int sec, int verbose);
+
+void att_sock_init(struct att_sock *s, int fd);
+void att_sock_done(struct att_sock *s);
+int att_rx_batched(struct att_sock *s, bool on);
+int att_rx_stats(struct att_sock *s, struct att_rx_stats *stats);
+int att_trace_start(struct att_sock *s, FILE *out);
+int att_trace_stop(struct att_sock *s);
+
+int att_read(struct att_sock *s, uint16_t handle, void *buf);
+int att_write(struct att_sock *s, uint16_t handle, const void *buf, int length);
+int att_writev(struct att_sock *s, uint16_t handle, const struct iovec *iov, int iovcnt);
+int att_write_batch(struct att_sock *s, uint16_t handle, const struct att_pkt *pkts, int n);
+int att_wrreq(struct att_sock *s, uint16_t handle, const void *buf, int length);
+int att_read_not(struct att_sock *s, uint16_t *handle, void *buf);
 
 const char *addr_type_name(int dst_type);
 const char *att_ecode2str(uint8_t status); /* copied from bluez/attrib/att.c */
+
+#endif /* __BBATT_H__ */
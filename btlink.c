@@ -0,0 +1,408 @@
+/**
+ * The session's link to the watch through a Bluetooth adapter (see btlink.h)
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+
+#include "bbatt.h"
+#include "ttops.h"
+#include "hcilink.h"
+#include "session.h"
+#include "btlink.h"
+
+/****************************************************************************/
+/* A real adapter, through BlueZ */
+
+static int
+bluez_open_dev(void *arg, int devid)
+{
+    return hci_open_dev(devid);
+}
+
+static int
+bluez_close_dev(void *arg, int dd)
+{
+    return hci_close_dev(dd);
+}
+
+static int
+bluez_devba(void *arg, int devid, bdaddr_t *ba)
+{
+    return hci_devba(devid, ba);
+}
+
+static int
+bluez_read_local_ext_features(void *arg, int dd, uint8_t page, uint8_t *max_page, uint8_t *features, int to)
+{
+    return hci_read_local_ext_features(dd, page, max_page, features, to);
+}
+
+static int
+bluez_le_set_scan_parameters(void *arg, int dd, uint8_t type, uint16_t interval, uint16_t window,
+                             uint8_t own_type, uint8_t filter, int to)
+{
+    return hci_le_set_scan_parameters(dd, type, interval, window, own_type, filter, to);
+}
+
+static int
+bluez_le_set_scan_enable(void *arg, int dd, uint8_t enable, uint8_t filter_dup, int to)
+{
+    return hci_le_set_scan_enable(dd, enable, filter_dup, to);
+}
+
+static int
+bluez_get_filter(void *arg, int dd, struct hci_filter *f)
+{
+    socklen_t olen = sizeof(*f);
+    return getsockopt(dd, SOL_HCI, HCI_FILTER, f, &olen);
+}
+
+static int
+bluez_set_filter(void *arg, int dd, const struct hci_filter *f)
+{
+    return setsockopt(dd, SOL_HCI, HCI_FILTER, f, sizeof(*f));
+}
+
+static ssize_t
+bluez_read_event(void *arg, int dd, void *buf, size_t len)
+{
+    return read(dd, buf, len);
+}
+
+static int
+bluez_att_connect(void *arg, bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type, int sec, int verbose)
+{
+    return l2cap_le_att_connect(src, dst, dst_type, sec, verbose);
+}
+
+static int
+bluez_conn_handle(void *arg, int fd, uint16_t *handle)
+{
+    struct l2cap_conninfo l2cci;
+    socklen_t sl = sizeof l2cci;
+
+    if (getsockopt(fd, SOL_L2CAP, L2CAP_CONNINFO, &l2cci, &sl) < 0)
+        return -1;
+    *handle = l2cci.hci_handle;
+    return 0;
+}
+
+static int
+bluez_conn_update(void *arg, int dd, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+                  uint16_t latency, uint16_t supervision_timeout, struct le_link *link)
+{
+    return le_link_conn_update(dd, handle, min_interval, max_interval, latency, supervision_timeout, link);
+}
+
+static int
+bluez_optimize(void *arg, int dd, uint16_t handle, struct le_link *link, int verbose)
+{
+    return le_link_optimize(dd, handle, link, verbose);
+}
+
+const struct hci_ops hci_bluez = {
+    bluez_open_dev, bluez_close_dev, bluez_devba, bluez_read_local_ext_features,
+    bluez_le_set_scan_parameters, bluez_le_set_scan_enable, bluez_get_filter, bluez_set_filter,
+    bluez_read_event, bluez_att_connect, bluez_conn_handle, bluez_conn_update, bluez_optimize
+};
+
+/****************************************************************************/
+
+/**
+ * based on bluez/tools/hcitool.c
+ *
+ * If dst is set to all zeros (BDADDRY_ANY), then it returns the
+ * first TomTom device address seen, otherwise it waits for the
+ * exact matching address.
+ *
+ */
+
+static void
+nullhandler(int signal) {}
+
+static int
+hci_tt_scan_start(struct hci_link *hl)
+{
+    const struct hci_ops *ops = hl->ops;
+    int dd = hl->dd;
+    struct hci_filter nf;
+
+    ops->le_set_scan_enable(hl->arg, dd, 0, 0, 10000); // disable in case already enabled
+    if (ops->le_set_scan_parameters(hl->arg, dd, /* passive */ 0x00, htobs(0x10), htobs(0x10), LE_PUBLIC_ADDRESS, 0x00, 10000) < 0) {
+        fprintf(stderr, "Failed to set BLE scan parameters: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    if (ops->le_set_scan_enable(hl->arg, dd, 0x01, /* include dupes */ 0x00, 10000) < 0) {
+        fprintf(stderr, "Failed to enable BLE scan: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    // save HCI filter and set it to capture all LE events
+    if (ops->get_filter(hl->arg, dd, &hl->of) < 0)
+        return -1;
+
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+
+    if (ops->set_filter(hl->arg, dd, &nf) < 0)
+        return -1;
+    return 0;
+}
+
+static int
+hci_tt_scan_stop(struct hci_link *hl)
+{
+    if (hl->ops->set_filter(hl->arg, hl->dd, &hl->of) < 0)
+        return -1;
+    if (hl->ops->le_set_scan_enable(hl->arg, hl->dd, 0x00, 1, 10000) < 0)
+        return -1;
+    return 0;
+}
+
+/* reads one HCI event: returns 1 if it's an advertisement from the device we want, 0 if not, -1 on error */
+static int
+hci_tt_scan_match(struct hci_link *hl, int verbose)
+{
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+    char addr_str[18];
+    le_advertising_info *info;
+    bdaddr_t *dst = &hl->dst;
+
+    if (hl->ops->read_event(hl->arg, hl->dd, buf, sizeof(buf)) < 0)
+        return (errno == EAGAIN) ? 0 : -1;
+
+    evt_le_meta_event *meta = (void *)(buf + HCI_EVENT_HDR_SIZE + 1);
+    if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+        return 0;
+
+    info = (void *)(meta->data + 1);
+    ba2str(&info->bdaddr, addr_str);
+    if (!strncmp(addr_str, "E4:04:39", 8)) {
+        fprintf(stderr, "Saw a TomTom device (%s)    \r", addr_str);
+        if (!bacmp(dst, BDADDR_ANY))
+            goto gotcha;
+    } else if (verbose)
+        fprintf(stderr, "Saw a non-TomTom device (%s)\r", addr_str);
+    if (!bacmp(dst, &info->bdaddr))
+        goto gotcha;
+    return 0;
+
+gotcha:
+    /**
+     * confusion alert: Bluez defines these constants as
+     * BDADDR_LE_RANDOM=0x02 and BDADDR_LE_PUBLIC=0x01,
+     * ... but in the le_advertising_info wire packets:
+     * 0 means _PUBLIC and non-0 means _RANDOM
+     * (see bluez/emulator/bthost.c
+     *
+     */
+    hl->dst_type = (info->bdaddr_type==0 ? BDADDR_LE_PUBLIC : BDADDR_LE_RANDOM);
+    bacpy(dst, &info->bdaddr);
+    return 1;
+}
+
+static int
+hci_tt_scan(struct hci_link *hl, int verbose)
+{
+    int res;
+
+    if (hci_tt_scan_start(hl) < 0)
+        return -1;
+
+    struct sigaction sa = { .sa_handler = nullhandler };
+    sigaction(SIGINT, &sa, NULL);
+
+    while ((res = hci_tt_scan_match(hl, verbose)) == 0)
+        ;
+
+    fputc('\n', stderr);
+    signal(SIGINT, NULL);
+    if (hci_tt_scan_stop(hl) < 0 || res < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+hci_link_open(void *arg, bool first)
+{
+    struct hci_link *hl = arg;
+
+    if (hl->dd < 0 && (hl->dd = hl->ops->open_dev(hl->arg, hl->devid)) < 0) {
+        fprintf(stderr, "Can't open hci%d: %s (%d)\n", hl->devid, strerror(errno), errno);
+        return -1;
+    }
+
+    // check for BLE support (see hciconfig.c cmd_features from Bluez)
+    if (first) {
+        uint8_t features[8];
+        if (hl->ops->read_local_ext_features(hl->arg, hl->dd, 0, NULL, features, 1000) < 0) {
+            fprintf(stderr, "Could not read hci%d features: %s (%d)", hl->devid, strerror(errno), errno);
+            return -1;
+        } else if ((features[4] & LMP_LE) == 0) {
+            // LE-only controllers are fine, since the watch is LE-only too
+            fprintf(stderr, "Bluetooth interface hci%d doesn't support 4.0 (Bluetooth LE)", hl->devid);
+            return -1;
+        }
+    }
+
+    // get host Bluetooth address
+    if (hl->ops->devba(hl->arg, hl->devid, &hl->src) < 0) {
+        fprintf(stderr, "Can't get hci%d info: %s (%d)\n", hl->devid, strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+hci_link_scan_start(void *arg)
+{
+    struct hci_link *hl = arg;
+
+    if ((hl->dd >= 0 || (hl->dd = hl->ops->open_dev(hl->arg, hl->devid)) >= 0) && hci_tt_scan_start(hl) == 0)
+        return hl->dd;
+    return -1;
+}
+
+static int
+hci_link_scan_match(void *arg)
+{
+    struct hci_link *hl = arg;
+    return hci_tt_scan_match(hl, hl->debug>1);
+}
+
+static void
+hci_link_scan_stop(void *arg)
+{
+    struct hci_link *hl = arg;
+    hci_tt_scan_stop(hl);
+}
+
+static int
+hci_link_scan(void *arg)
+{
+    struct hci_link *hl = arg;
+    return hci_tt_scan(hl, hl->debug);
+}
+
+static int
+hci_link_connect(void *arg, int *protocol_version, char addr[18], int verbose)
+{
+    struct hci_link *hl = arg;
+
+    *protocol_version = hl->dst_type==BDADDR_LE_RANDOM ? 1 : 2;
+    ba2str(&hl->dst, addr);
+    return hl->ops->att_connect(hl->arg, &hl->src, &hl->dst, hl->dst_type, BT_SECURITY_MEDIUM, verbose);
+}
+
+/* Asks for the shortest connection interval, and works out how fast the
+ * watch can then take packets. Returns the delay between packets (in us),
+ * -1 if the session should give up, or -2 if ttblue should. */
+static int
+hci_link_tune(void *arg, TTDEV *ttd, struct le_link *link, bool first)
+{
+    struct hci_link *hl = arg;
+    int write_delay = 0, debug = hl->debug;
+
+    // we need the hci_handle too
+    int result = hl->ops->conn_handle(hl->arg, ttd->att.fd, &hl->handle);
+    if (result < 0) {
+        perror("getsockopt");
+        return -1;
+    }
+
+    if (ttd->h->ppcp != 0) {
+        // request minimum connection interval; a timeout means that
+        // nothing was pending any more, so it's safe to ask again
+        int tries = 0;
+        do {
+            result = hl->ops->conn_update(hl->arg, hl->dd, hl->handle,
+                                         0x0006 /* min_interval */,
+                                         0x0006 /* max_interval */,
+                                         0 /* latency */,
+                                         200 /* supervision_timeout */,
+                                         link);
+        } while (result < 0 && errno==ETIMEDOUT && ++tries < 3);
+        if (result < 0) {
+            if (errno==EPERM && first) {
+                fputs(PLEASE_SETCAP_ME, stderr);
+                write_delay = 0; // we couldn't speed up the connection, so no write_delay
+            } else {
+                perror("hci_le_conn_update");
+                return -1;
+            }
+        } else {
+            // we successfully decreased the connection interval, but the device can't
+            // actually handle packets being written to it this quickly, so we
+            // figure out the maximum safe speed at which we can send packets to the device from
+            // the Preferred Peripheral Connection Parameters
+            struct { uint16_t min_interval, max_interval, slave_latency, timeout_mult; } __attribute__((packed)) ppcp;
+            if (att_read(&ttd->att, ttd->h->ppcp, &ppcp) < 0) {
+                fprintf(stderr, "Could not read device PPCP (handle 0x%04x): %s (%d)", ttd->h->ppcp, strerror(errno), errno);
+                return first ? -2 : -1;
+            } else {
+                ppcp.min_interval = btohs(ppcp.min_interval);
+                ppcp.max_interval = btohs(ppcp.max_interval);
+                ppcp.slave_latency = btohs(ppcp.slave_latency);
+                ppcp.timeout_mult = btohs(ppcp.timeout_mult);
+                write_delay = 1250 * ppcp.min_interval; // (microseconds)
+                if (debug > 1) {
+                    fprintf(stderr, "Throttling file write to 1 packet every %d microseconds.\n", write_delay);
+                    fprintf(stderr, "min_interval=%d, max_interval=%d, slave_latency=%d, timeout_mult=%d\n", ppcp.max_interval, ppcp.min_interval, ppcp.slave_latency, ppcp.timeout_mult);
+                }
+            }
+        }
+    } else {
+        // v2 devices have no PPCP to tell us how fast they can take packets, so ask
+        // for a shorter interval and send no more than one packet per connection
+        // event at whatever interval we get; if it's refused, the link stays at
+        // the device's own interval, which it was paced for already
+        if (hl->ops->conn_update(hl->arg, hl->dd, hl->handle, 0x0006, 0x0006, 0, 200, link) < 0) {
+            if (debug > 1)
+                fprintf(stderr, "Could not update connection parameters: %s (%d)\n", strerror(errno), errno);
+        } else {
+            write_delay = 1250 * link->interval; // (microseconds)
+            if (debug > 1)
+                fprintf(stderr, "Throttling file write to 1 packet every %d microseconds.\n", write_delay);
+        }
+    }
+
+    // longer LL packets and the 2M PHY, where both ends support them
+    hl->ops->optimize(hl->arg, hl->dd, hl->handle, link, debug>1);
+    return write_delay;
+}
+
+void
+hci_link_reset(void *arg)
+{
+    struct hci_link *hl = arg;
+    if (hl->dd >= 0)
+        hl->ops->close_dev(hl->arg, hl->dd);
+    hl->dd = -1;
+}
+
+void
+hci_session_link(struct hci_link *hl, struct session_link *link)
+{
+    *link = (struct session_link){
+        hl, hci_link_open, hci_link_scan_start, hci_link_scan_match, hci_link_scan_stop, hci_link_scan,
+        hci_link_connect, hci_link_tune, hci_link_reset
+    };
+}
+
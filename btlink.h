@@ -0,0 +1,58 @@
+#ifndef __BTLINK_H__
+#define __BTLINK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hcilink.h"
+#include "session.h"
+
+/**
+ * The session's way to the watch through a Bluetooth adapter: scanning for
+ * its advertisements, the L2CAP connection, and the link parameters (see
+ * struct session_link).
+ *
+ * Everything that reaches the adapter goes through a struct hci_ops:
+ * hci_bluez for a real one, or the emulated controller in fakehci.c, which
+ * the simulator uses to run this same code without a dongle.
+ */
+
+struct hci_ops {
+    int (*open_dev)(void *arg, int devid);
+    int (*close_dev)(void *arg, int dd);
+    int (*devba)(void *arg, int devid, bdaddr_t *ba);
+    int (*read_local_ext_features)(void *arg, int dd, uint8_t page, uint8_t *max_page, uint8_t *features, int to);
+    int (*le_set_scan_parameters)(void *arg, int dd, uint8_t type, uint16_t interval, uint16_t window,
+                                  uint8_t own_type, uint8_t filter, int to);
+    int (*le_set_scan_enable)(void *arg, int dd, uint8_t enable, uint8_t filter_dup, int to);
+    int (*get_filter)(void *arg, int dd, struct hci_filter *f);
+    int (*set_filter)(void *arg, int dd, const struct hci_filter *f);
+    ssize_t (*read_event)(void *arg, int dd, void *buf, size_t len); // one HCI event packet
+    int (*att_connect)(void *arg, bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type, int sec, int verbose);
+    int (*conn_handle)(void *arg, int fd, uint16_t *handle); // of the connection under an ATT socket
+    int (*conn_update)(void *arg, int dd, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+                       uint16_t latency, uint16_t supervision_timeout, struct le_link *link);
+    int (*optimize)(void *arg, int dd, uint16_t handle, struct le_link *link, int verbose);
+};
+
+extern const struct hci_ops hci_bluez;
+
+struct hci_link {
+    const struct hci_ops *ops;
+    void *arg;                  // for the ops
+    int devid, dd;              // the adapter, which stays open between sessions
+    int debug;
+    bdaddr_t src, dst;          // dst is BDADDR_ANY until a TomTom device is seen
+    uint8_t dst_type;
+    struct hci_filter of;       // while scanning
+    uint16_t handle;            // of the connection
+};
+
+void hci_session_link(struct hci_link *hl, struct session_link *link);
+void hci_link_reset(void *arg);
+
+#endif /* __BTLINK_H__ */
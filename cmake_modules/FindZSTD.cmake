@@ -0,0 +1,39 @@
+# - Try to find the Zstandard compression library
+# The module will set the following variables
+#
+#  ZSTD_FOUND - System has libzstd
+#  ZSTD_INCLUDE_DIR - The zstd include directory
+#  ZSTD_LIBRARY - The libraries needed to use libzstd
+
+# use pkg-config to get the directories and then use these values
+# in the FIND_PATH() and FIND_LIBRARY() calls
+
+find_package(PkgConfig QUIET)
+if (PKG_CONFIG_FOUND)
+  pkg_search_module(PC_ZSTD QUIET libzstd)
+endif ()
+
+# Find the include directories
+FIND_PATH(ZSTD_INCLUDE_DIR
+    NAMES zstd.h
+    HINTS
+          ${PC_ZSTD_INCLUDEDIR}
+          ${PC_ZSTD_INCLUDE_DIRS}
+    DOC "Path containing the zstd.h include file"
+    )
+
+FIND_LIBRARY(ZSTD_LIBRARY
+    NAMES zstd
+    HINTS
+          ${PC_ZSTD_LIBRARYDIR}
+          ${PC_ZSTD_LIBRARY_DIRS}
+    DOC "zstd library path"
+    )
+
+include(FindPackageHandleStandardArgs)
+
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(ZSTD
+  REQUIRED_VARS ZSTD_INCLUDE_DIR ZSTD_LIBRARY
+  VERSION_VAR PC_ZSTD_VERSION)
+
+MARK_AS_ADVANCED(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
@@ -0,0 +1,553 @@
+/**
+ *
+ * Control socket for --daemon mode: other programs can connect to the
+ * Unix-domain socket and send one JSON request per line, e.g.
+ *   {"cmd":"sync"}                   start a sync right now
+ *   {"cmd":"status"}                 current state, queue and progress
+ *   {"cmd":"metrics"}                counters accumulated since startup
+ *   {"cmd":"schedule","wait_success":3600,"wait_fail":10}
+ * Each request gets exactly one JSON response line.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "daemon.h"
+#include "util.h"
+
+static int
+epoll_watch(struct daemon_state *ds, int op, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    return epoll_ctl(ds->epoll_fd, op, fd, &ev);
+}
+
+/**
+ * The daemon sleeps in epoll_wait() until one of these happens:
+ *  - the timerfd expires (CLOCK_BOOTTIME keeps counting during suspend,
+ *    so an overdue sync starts right after resume without waking the host)
+ *  - a request arrives on the control socket
+ *  - the watch advertises (HCI scanner fd, see daemon_sleep)
+ *  - a notification for the watch arrives, or the connection which is
+ *    being kept open for notifications drops
+ * SIGCHLD arrives via a signalfd, so postprocessing children get reaped
+ * as soon as they exit.
+ */
+int
+daemon_init(struct daemon_state *ds)
+{
+    ds->timer_clock = CLOCK_BOOTTIME;
+    if ((ds->timer_fd = timerfd_create(ds->timer_clock, TFD_CLOEXEC)) < 0 && errno == EINVAL) {
+        ds->timer_clock = CLOCK_MONOTONIC; // pre-3.15 kernel
+        ds->timer_fd = timerfd_create(ds->timer_clock, TFD_CLOEXEC);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    ds->sig_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+    ds->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ds->timer_fd < 0 || ds->sig_fd < 0 || ds->epoll_fd < 0
+        || epoll_watch(ds, EPOLL_CTL_ADD, ds->timer_fd) < 0
+        || epoll_watch(ds, EPOLL_CTL_ADD, ds->sig_fd) < 0
+        || (ds->ctl_fd >= 0 && epoll_watch(ds, EPOLL_CTL_ADD, ds->ctl_fd) < 0)
+        || (ds->notify_fd >= 0 && epoll_watch(ds, EPOLL_CTL_ADD, ds->notify_fd) < 0)) {
+        fprintf(stderr, "Failed to set up daemon event loop: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
+void
+daemon_done(struct daemon_state *ds)
+{
+    daemon_ctl_close(ds);
+    if (ds->epoll_fd >= 0) close(ds->epoll_fd);
+    if (ds->timer_fd >= 0) close(ds->timer_fd);
+    if (ds->sig_fd >= 0) close(ds->sig_fd);
+    ds->epoll_fd = ds->timer_fd = ds->sig_fd = -1;
+}
+
+/* Runs cmd with arg (a file which has just been saved) in the background */
+pid_t
+daemon_spawn(struct daemon_state *ds, const char *cmd, const char *arg)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL); // daemon blocks SIGCHLD
+        dup2(1, 2); // redirect stdout to stderr
+        execlp(cmd, cmd, arg, NULL);
+        _exit(127); // if exec fails
+    } else if (pid < 0)
+        fprintf(stderr, "Could not fork: %s (%d)\n", strerror(errno), errno);
+    else
+        ds->children++;
+    return pid;
+}
+
+/* Collects postprocessing commands which have finished, or (if block) waits
+ * for all of them. Returns how many are still running. */
+int
+daemon_reap(struct daemon_state *ds, bool block)
+{
+    struct signalfd_siginfo si;
+    while (ds->sig_fd >= 0 && read(ds->sig_fd, &si, sizeof si) == sizeof si)
+        ;
+
+    int child_status;
+    pid_t child_pid;
+    while (ds->children > 0 && (child_pid = waitpid(-1, &child_status, block ? 0 : WNOHANG)) != 0) {
+        if (child_pid < 0) {
+            if (errno == EINTR)
+                continue;
+            ds->children = 0; // ECHILD: someone else reaped them
+            break;
+        }
+        ds->children--;
+        if (child_status != 0)
+            fprintf(stderr, "WARNING: postprocess failed (pid %d, status %d)\n", child_pid, child_status);
+    }
+    return ds->children;
+}
+
+/* Current memory and file descriptor use, from /proc */
+void
+daemon_sample(struct daemon_state *ds)
+{
+    long pages, resident;
+    FILE *f = fopen("/proc/self/statm", "re");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) == 2) {
+            ds->rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+            if (ds->rss_kb > ds->max_rss_kb)
+                ds->max_rss_kb = ds->rss_kb;
+        }
+        fclose(f);
+    }
+
+    DIR *d = opendir("/proc/self/fd");
+    if (d) {
+        int n = 0;
+        for (struct dirent *e; (e = readdir(d)) != NULL; )
+            if (e->d_name[0] != '.')
+                n++;
+        ds->open_fds = n-1; // not counting the one reading the directory
+        closedir(d);
+    }
+}
+
+/* Accounts for one sync attempt, and tidies up after it */
+void
+daemon_cycle_done(struct daemon_state *ds, bool success, double secs)
+{
+    ds->cycles++;
+    if (success) {
+        ds->successes++;
+        ds->last_success = time(NULL);
+    } else
+        ds->failures++;
+    ds->last_cycle_secs = secs;
+    ds->total_cycle_secs += secs;
+    daemon_reap(ds, false);
+    daemon_sample(ds);
+}
+
+/****************************************************************************/
+
+int
+daemon_ctl_open(struct daemon_state *ds, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    ds->ctl_fd = -1;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create control socket: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    unlink(path); // stale socket from a previous run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "Failed to listen on control socket %s: %s (%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    ds->ctl_fd = fd;
+    ds->ctl_path = path;
+    if (ds->epoll_fd >= 0)
+        epoll_watch(ds, EPOLL_CTL_ADD, fd);
+    return fd;
+}
+
+void
+daemon_ctl_close(struct daemon_state *ds)
+{
+    if (ds->ctl_fd >= 0) {
+        close(ds->ctl_fd);
+        unlink(ds->ctl_path);
+        ds->ctl_fd = -1;
+    }
+}
+
+/****************************************************************************/
+
+// Just enough JSON to pick flat string and integer members out of a request
+
+static const char *
+json_member(const char *req, const char *key)
+{
+    size_t klen = strlen(key);
+    for (const char *p = req; (p = strchr(p, '"')) != NULL; p++) {
+        if (!strncmp(p+1, key, klen) && p[klen+1] == '"') {
+            p += klen+2;
+            p += strspn(p, " \t");
+            if (*p++ != ':')
+                continue;
+            return p + strspn(p, " \t");
+        }
+    }
+    return NULL;
+}
+
+static bool
+json_str(const char *req, const char *key, char *out, size_t size)
+{
+    const char *p = json_member(req, key), *end;
+    if (!p || *p++ != '"' || (end = strchr(p, '"')) == NULL || end-p >= size)
+        return false;
+    memcpy(out, p, end-p);
+    out[end-p] = 0;
+    return true;
+}
+
+static bool
+json_int(const char *req, const char *key, int *out)
+{
+    const char *p = json_member(req, key);
+    char *end;
+    if (!p)
+        return false;
+    errno = 0;
+    long val = strtol(p, &end, 10);
+    if (end == p || errno == ERANGE || val > INT_MAX || val < INT_MIN)
+        return false;
+    *out = (int)val;
+    return true;
+}
+
+/* Writes s as the contents of a JSON string, escaped */
+static void
+json_put_str(FILE *out, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, out);
+    }
+}
+
+static void
+handle_request(struct daemon_state *ds, const char *req, FILE *out)
+{
+    char cmd[16], device[18];
+    time_t now = time(NULL);
+
+    if (!json_str(req, "cmd", cmd, sizeof cmd)) {
+        fputs("{\"ok\":false,\"error\":\"missing cmd\"}\n", out);
+    } else if (!strcmp(cmd, "sync")) {
+        if (json_str(req, "device", device, sizeof device) && strcasecmp(device, ds->device)) {
+            fputs("{\"ok\":false,\"error\":\"not serving device ", out);
+            json_put_str(out, device);
+            fputs("\"}\n", out);
+        } else {
+            ds->sync_requested = true;
+            fputs("{\"ok\":true}\n", out);
+        }
+    } else if (!strcmp(cmd, "status")) {
+        fprintf(out, "{\"ok\":true,\"state\":\"%s\",\"device\":\"%s\",\"next_sync\":%ld,"
+                "\"queue\":%d,\"files_done\":%d,\"files_total\":%d,\"tasks_deferred\":%d,"
+                "\"transfer\":{\"file\":\"0x%08x\",\"bytes_done\":%u,\"bytes_total\":%u}}\n",
+                ds->state, ds->device, (long)ds->next_sync,
+                ds->files_total - ds->files_done, ds->files_done, ds->files_total, ds->tasks_deferred,
+                ds->xfer_fileno, ds->xfer_done, ds->xfer_total);
+    } else if (!strcmp(cmd, "metrics")) {
+        daemon_sample(ds);
+        fprintf(out, "{\"ok\":true,\"uptime\":%ld,\"cycles\":%d,\"successes\":%d,\"failures\":%d,"
+                "\"files_read\":%d,\"bytes_read\":%ld,\"bytes_written\":%ld,"
+                "\"rx_pdus\":%lu,\"rx_syscalls\":%lu,"
+                "\"last_success\":%ld,\"last_cycle_secs\":%.3f,\"mean_cycle_secs\":%.3f,"
+                "\"last_scan_secs\":%.3f,\"last_connect_secs\":%.3f,\"last_setup_secs\":%.3f,\"max_connect_path_secs\":%.3f,"
+                "\"notify_sent\":%d,\"notify_dropped\":%d,\"notify_last_ms\":%.1f,\"notify_max_ms\":%.1f,"
+                "\"tasks_deferred\":%d,\"rx_rate\":%.0f,\"tx_rate\":%.0f,"
+                "\"children\":%d,\"open_fds\":%d,\"rss_kb\":%ld,\"max_rss_kb\":%ld,"
+                "\"link\":{\"interval\":%d,\"latency\":%d,\"timeout\":%d,\"data_len\":%d,\"tx_phy\":\"%s\",\"rx_phy\":\"%s\"}}\n",
+                (long)(now - ds->started), ds->cycles, ds->successes, ds->failures,
+                ds->files_read, ds->bytes_read, ds->bytes_written,
+                ds->rx_pdus, ds->rx_calls,
+                (long)ds->last_success, ds->last_cycle_secs, ds->cycles ? ds->total_cycle_secs/ds->cycles : 0,
+                ds->last_scan_secs, ds->last_connect_secs, ds->last_setup_secs, ds->max_connect_path_secs,
+                ds->notify_sent, ds->notify_dropped, ds->notify_last_ms, ds->notify_max_ms,
+                ds->tasks_deferred, ds->rx_rate, ds->tx_rate,
+                ds->children, ds->open_fds, ds->rss_kb, ds->max_rss_kb,
+                ds->link.interval, ds->link.latency, ds->link.timeout, ds->link.data_len,
+                le_phy_name(ds->link.tx_phy), le_phy_name(ds->link.rx_phy));
+    } else if (!strcmp(cmd, "schedule")) {
+        int val;
+        if (json_int(req, "wait_success", &val) && val > 0)
+            *ds->sleep_success = val;
+        if (json_int(req, "wait_fail", &val) && val > 0)
+            *ds->sleep_fail = val;
+        fprintf(out, "{\"ok\":true,\"wait_success\":%d,\"wait_fail\":%d}\n",
+                *ds->sleep_success, *ds->sleep_fail);
+    } else {
+        fputs("{\"ok\":false,\"error\":\"unknown cmd ", out);
+        json_put_str(out, cmd);
+        fputs("\"}\n", out);
+    }
+}
+
+/* Reads one request line (without the newline) from a client; returns its length, or -1 */
+static int
+recv_line(int fd, char *buf, size_t size)
+{
+    size_t got = 0;
+    while (got < size-1) {
+        ssize_t r = recv(fd, buf+got, size-1-got, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r <= 0)
+            break;
+        got += r;
+        if (memchr(buf, '\n', got))
+            break;
+    }
+    buf[got] = 0;
+    return got ? (int)got : -1;
+}
+
+// Serves all pending clients, one request each. Returns true if a sync was requested.
+int
+daemon_ctl_serve(struct daemon_state *ds)
+{
+    int cfd;
+    while ((cfd = accept4(ds->ctl_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        // don't let a silent client hold up the daemon
+        struct timeval to = {.tv_sec=1, .tv_usec=0};
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
+
+        char req[512], *reply = NULL;
+        size_t len = 0;
+        FILE *out;
+        if (recv_line(cfd, req, sizeof req) > 0 && (out = open_memstream(&reply, &len)) != NULL) {
+            handle_request(ds, req, out);
+            fclose(out);
+            // a client which has gone away mustn't take the daemon with it (SIGPIPE)
+            for (size_t sent = 0; sent < len; ) {
+                ssize_t w = send(cfd, reply+sent, len-sent, MSG_NOSIGNAL);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                else if (w <= 0)
+                    break;
+                sent += w;
+            }
+        }
+        free(reply);
+        close(cfd);
+    }
+    return ds->sync_requested;
+}
+
+// Answers the control socket in the middle of a sync, without waiting. A sync
+// request is already being served.
+void
+daemon_ctl_poll(struct daemon_state *ds)
+{
+    if (ds->ctl_fd >= 0) {
+        daemon_ctl_serve(ds);
+        ds->sync_requested = false;
+    }
+}
+
+static void
+arm_timer(struct daemon_state *ds, const struct timespec *start, int seconds)
+{
+    struct itimerspec its = { .it_value = { .tv_sec = start->tv_sec + seconds, .tv_nsec = start->tv_nsec } };
+    timerfd_settime(ds->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    // the same deadline in wall clock time, for status: start may be a while ago
+    struct timespec now;
+    clock_gettime(ds->timer_clock, &now);
+    ds->next_sync = time(NULL) - (now.tv_sec - start->tv_sec) + seconds;
+}
+
+// Sleeps until the next scheduled sync, a sync request, a notification, (if ds->scan_fd
+// is set) our watch advertising, or (if ds->link_fd is set) the connection dropping.
+// After a notification, the next call carries on towards the same scheduled sync.
+int
+daemon_sleep(struct daemon_state *ds, int after_success, int verbose)
+{
+    int seconds = after_success ? *ds->sleep_success : *ds->sleep_fail;
+    int reason = DAEMON_WAKE_ERROR;
+
+    ds->state = (ds->link_fd >= 0) ? "connected" : "sleeping";
+    if (!ds->timer_armed) {
+        if (verbose) {
+            fprintf(stderr, "Sleeping for %d seconds...", seconds);
+            fflush(stderr);
+        }
+        clock_gettime(ds->timer_clock, &ds->sleep_start);
+        arm_timer(ds, &ds->sleep_start, seconds);
+        ds->timer_armed = true;
+    }
+    if (ds->scan_fd >= 0 && epoll_watch(ds, EPOLL_CTL_ADD, ds->scan_fd) < 0)
+        ds->scan_fd = -1;
+    // no EPOLLIN: only hangups and errors
+    struct epoll_event hup = { .events = 0, .data.fd = ds->link_fd };
+    if (ds->link_fd >= 0 && epoll_ctl(ds->epoll_fd, EPOLL_CTL_ADD, ds->link_fd, &hup) < 0)
+        ds->link_fd = -1;
+
+    while (reason == DAEMON_WAKE_ERROR) {
+        struct epoll_event ev[4];
+        int n = epoll_wait(ds->epoll_fd, ev, 4, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s (%d)\n", strerror(errno), errno);
+            break;
+        }
+
+        for (int ii=0; ii<n; ii++) {
+            int fd = ev[ii].data.fd;
+            if (fd == ds->timer_fd) {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof expirations) == sizeof expirations)
+                    reason = DAEMON_WAKE_TIMER;
+            } else if (fd == ds->sig_fd) {
+                daemon_reap(ds, false);
+            } else if (fd == ds->ctl_fd) {
+                if (daemon_ctl_serve(ds))
+                    reason = DAEMON_WAKE_REQUEST;
+                else {
+                    // schedule may have been changed over the control socket
+                    int new_seconds = after_success ? *ds->sleep_success : *ds->sleep_fail;
+                    if (new_seconds != seconds)
+                        arm_timer(ds, &ds->sleep_start, seconds = new_seconds);
+                }
+            } else if (fd == ds->scan_fd) {
+                if (ds->scan_match(ds->scan_arg) > 0)
+                    reason = DAEMON_WAKE_ADVERT;
+            } else if (fd == ds->notify_fd) {
+                reason = DAEMON_WAKE_NOTIFY;
+            } else if (fd == ds->link_fd) {
+                reason = DAEMON_WAKE_HANGUP;
+            }
+        }
+    }
+
+    if (ds->scan_fd >= 0)
+        epoll_watch(ds, EPOLL_CTL_DEL, ds->scan_fd);
+    if (ds->link_fd >= 0)
+        epoll_watch(ds, EPOLL_CTL_DEL, ds->link_fd);
+    if (reason != DAEMON_WAKE_NOTIFY) {
+        struct itimerspec off = {{0}};
+        timerfd_settime(ds->timer_fd, 0, &off, NULL);
+        ds->timer_armed = false;
+        ds->sync_requested = false;
+    }
+
+    if (verbose) {
+        switch (reason) {
+        case DAEMON_WAKE_REQUEST: fputs(" woken by sync request!\n\n", stderr); break;
+        case DAEMON_WAKE_ADVERT: fputs(" woken by watch advertising!\n\n", stderr); break;
+        case DAEMON_WAKE_NOTIFY: fputs(" woken by notification!\n", stderr); break;
+        case DAEMON_WAKE_HANGUP: fputs(" watch disconnected!\n", stderr); break;
+        default: fputc('\n', stderr);
+        }
+    }
+    return reason;
+}
+
+// Waits for our watch to advertise on ds->scan_fd, however long that takes, while
+// still serving the control socket and reaping children; a sync request changes
+// nothing, since one is on its way. Returns DAEMON_WAKE_ADVERT, DAEMON_WAKE_NOTIFY
+// (read the notifications, and call again), or DAEMON_WAKE_ERROR.
+int
+daemon_scan(struct daemon_state *ds)
+{
+    int reason = -1;
+
+    ds->state = "scanning";
+    if (ds->scan_fd < 0 || epoll_watch(ds, EPOLL_CTL_ADD, ds->scan_fd) < 0)
+        return DAEMON_WAKE_ERROR;
+
+    while (reason < 0) {
+        struct epoll_event ev[4];
+        int n = epoll_wait(ds->epoll_fd, ev, 4, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s (%d)\n", strerror(errno), errno);
+            reason = DAEMON_WAKE_ERROR;
+            break;
+        }
+
+        for (int ii=0; ii<n; ii++) {
+            int fd = ev[ii].data.fd;
+            if (fd == ds->timer_fd) {
+                // the sync it was set for is the one we're scanning for
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof expirations) == sizeof expirations)
+                    ds->timer_armed = false;
+            } else if (fd == ds->sig_fd) {
+                daemon_reap(ds, false);
+            } else if (fd == ds->ctl_fd) {
+                daemon_ctl_poll(ds);
+            } else if (fd == ds->scan_fd) {
+                int res = ds->scan_match(ds->scan_arg);
+                if (res > 0)
+                    reason = DAEMON_WAKE_ADVERT;
+                else if (res < 0)
+                    reason = DAEMON_WAKE_ERROR;
+            } else if (fd == ds->notify_fd && reason < 0) {
+                reason = DAEMON_WAKE_NOTIFY;
+            }
+        }
+    }
+
+    epoll_watch(ds, EPOLL_CTL_DEL, ds->scan_fd);
+    return reason;
+}
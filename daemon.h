@@ -0,0 +1,77 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "hcilink.h"
+
+/* reasons for daemon_sleep() to return */
+enum { DAEMON_WAKE_TIMER, DAEMON_WAKE_REQUEST, DAEMON_WAKE_ADVERT, DAEMON_WAKE_NOTIFY, DAEMON_WAKE_HANGUP, DAEMON_WAKE_ERROR };
+
+/* state of the long-running --daemon service, reported over the control socket */
+struct daemon_state {
+    int ctl_fd;                 // listening Unix-domain control socket, or -1
+    const char *ctl_path;
+
+    // event loop: everything that can wake the daemon is an fd (or -1)
+    int epoll_fd, timer_fd, sig_fd;
+    int timer_clock;
+    int timer_armed;            // for the next sync, which notifications don't put off
+    struct timespec sleep_start;
+    int scan_fd;                // HCI socket with LE scan enabled, while sleeping
+    int (*scan_match)(void *arg); // consume one HCI event, >0 if it's our watch
+    void *scan_arg;
+    int notify_fd;              // FIFO of notifications for the watch, or -1
+    int link_fd;                // ATT socket, while kept open between syncs, or -1
+
+    const char *device;         // Bluetooth address of the watch we sync with
+    int *sleep_success, *sleep_fail;
+
+    const char *state;          // "starting", "sleeping", "scanning", "connecting", "syncing"
+    time_t next_sync;
+    int sync_requested;
+
+    // progress of the current session
+    int files_done, files_total;
+    uint32_t xfer_fileno, xfer_done, xfer_total; // the file being read or written, in bytes
+
+    // metrics accumulated since startup
+    time_t started, last_success;
+    int cycles, successes, failures;
+    int files_read;
+    long bytes_read, bytes_written;
+    unsigned long rx_pdus, rx_calls; // from the watch, and the syscalls it took (batched I/O only)
+    double last_cycle_secs, total_cycle_secs;
+    double last_scan_secs;      // from starting the scan to seeing the watch
+    double last_connect_secs;   // L2CAP connection
+    double last_setup_secs;     // link parameters, device info and authorization
+    double max_connect_path_secs; // worst scan + connect + setup so far
+    struct le_link link;    // as negotiated for the last session
+    int notify_sent, notify_dropped; // the watch turned the latter down
+    double notify_last_ms, notify_max_ms; // from queueing to the watch's ack
+    int tasks_deferred;         // left for the next session, at the end of the last one
+    double rx_rate, tx_rate;    // throughput the task scheduler expects, in bytes/s
+
+    // resources, sampled at the end of each cycle: none of these should grow
+    int children;               // postprocessing commands which haven't been reaped
+    int open_fds;
+    long rss_kb, max_rss_kb;
+};
+
+int daemon_init(struct daemon_state *ds);
+void daemon_done(struct daemon_state *ds);
+int daemon_ctl_open(struct daemon_state *ds, const char *path);
+void daemon_ctl_close(struct daemon_state *ds);
+int daemon_ctl_serve(struct daemon_state *ds);
+void daemon_ctl_poll(struct daemon_state *ds);
+int daemon_sleep(struct daemon_state *ds, int after_success, int verbose);
+int daemon_scan(struct daemon_state *ds);
+pid_t daemon_spawn(struct daemon_state *ds, const char *cmd, const char *arg);
+int daemon_reap(struct daemon_state *ds, bool block);
+void daemon_sample(struct daemon_state *ds);
+void daemon_cycle_done(struct daemon_state *ds, bool success, double secs);
+
+#endif /* __DAEMON_H__ */
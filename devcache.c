@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "devcache.h"
+
+uint64_t
+fnv1a64(const void *buf, int length)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const uint8_t *p = buf, *end = p+length; p < end; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+/* like mkdir -p */
+static int
+mkdirs(char *path)
+{
+    for (char *p = path+1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            int res = mkdir(path, 0700);
+            *p = '/';
+            if (res < 0 && errno != EEXIST)
+                return -1;
+        }
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/* Opens (creating if needed) the cache for one watch, under base/device */
+DEVCACHE *
+devcache_open(const char *base, const char *device)
+{
+    DEVCACHE *c = calloc(1, sizeof *c);
+    if (!c)
+        return NULL;
+
+    if (asprintf(&c->dir, "%s/%s", base, device) < 0) {
+        c->dir = NULL;
+        goto fail;
+    }
+    if (mkdirs(c->dir) < 0 || (c->dirfd = open(c->dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not open device cache %s: %s (%d)\n", c->dir, strerror(errno), errno);
+        goto fail;
+    }
+    return c;
+
+fail:
+    free(c->dir);
+    free(c);
+    return NULL;
+}
+
+void
+devcache_close(DEVCACHE *c)
+{
+    if (c) {
+        close(c->dirfd);
+        free(c->dir);
+        free(c);
+    }
+}
+
+/* Cached contents of fileno; returns the length, or -1 if there are none
+ * (or they don't match their hash any more) */
+int
+devcache_get(DEVCACHE *c, uint32_t fileno, uint8_t **buf)
+{
+    char name[32];
+    uint64_t hash;
+    struct stat st;
+    int fd, length = -1;
+
+    *buf = NULL;
+    snprintf(name, sizeof name, "%08x.bin", fileno);
+    if ((fd = openat(c->dirfd, name, O_RDONLY|O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof hash)
+        goto out;
+
+    length = st.st_size - sizeof hash;
+    if (!(*buf = malloc(length + 1))
+        || pread(fd, &hash, sizeof hash, 0) != sizeof hash
+        || pread(fd, *buf, length, sizeof hash) != length
+        || hash != fnv1a64(*buf, length)) {
+        free(*buf);
+        *buf = NULL;
+        length = -1;
+    }
+
+out:
+    close(fd);
+    return length;
+}
+
+/* Remembers the contents of fileno, as now on the watch */
+int
+devcache_put(DEVCACHE *c, uint32_t fileno, const uint8_t *buf, int length)
+{
+    char name[32], tmpname[40];
+    uint64_t hash = fnv1a64(buf, length);
+    int fd;
+
+    snprintf(name, sizeof name, "%08x.bin", fileno);
+    snprintf(tmpname, sizeof tmpname, ".%s.part", name);
+    if ((fd = openat(c->dirfd, tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) < 0)
+        goto fail;
+    if (write(fd, &hash, sizeof hash) != sizeof hash || write(fd, buf, length) != length) {
+        close(fd);
+        goto fail;
+    }
+    if (close(fd) < 0 || renameat(c->dirfd, tmpname, c->dirfd, name) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not update device cache %s/%s: %s (%d)\n", c->dir, name, strerror(errno), errno);
+    unlinkat(c->dirfd, tmpname, 0);
+    return -1;
+}
+
+/* True if the cached copy of fileno has exactly this content */
+bool
+devcache_same(DEVCACHE *c, uint32_t fileno, const uint8_t *buf, int length)
+{
+    uint8_t *cached;
+    int clen = devcache_get(c, fileno, &cached);
+    bool same = (clen == length && !memcmp(cached, buf, length));
+    free(cached);
+    return same;
+}
+
+/* The watch's copy of fileno is unknown (e.g. after a failed write) */
+void
+devcache_forget(DEVCACHE *c, uint32_t fileno)
+{
+    char name[32];
+    snprintf(name, sizeof name, "%08x.bin", fileno);
+    unlinkat(c->dirfd, name, 0);
+}
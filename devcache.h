@@ -0,0 +1,28 @@
+#ifndef __DEVCACHE_H__
+#define __DEVCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Per-device cache of small files as they were last seen on (or written
+ * to) the watch, one directory per Bluetooth address. Each file is kept
+ * alongside its FNV-1a hash, so it's cheap to tell whether the copy on the
+ * watch already has the content we want.
+ */
+
+typedef struct devcache {
+    char *dir;
+    int dirfd;
+} DEVCACHE;
+
+uint64_t fnv1a64(const void *buf, int length);
+
+DEVCACHE *devcache_open(const char *base, const char *device);
+void devcache_close(DEVCACHE *c);
+int devcache_get(DEVCACHE *c, uint32_t fileno, uint8_t **buf);
+int devcache_put(DEVCACHE *c, uint32_t fileno, const uint8_t *buf, int length);
+bool devcache_same(DEVCACHE *c, uint32_t fileno, const uint8_t *buf, int length);
+void devcache_forget(DEVCACHE *c, uint32_t fileno);
+
+#endif /* __DEVCACHE_H__ */
@@ -0,0 +1,279 @@
+/**
+ * An emulated Bluetooth LE controller, for the simulator (see fakehci.h)
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hcilink.h"
+#include "btlink.h"
+#include "fakehci.h"
+
+#define FAKEHCI_HANDLE 0x0040   // of every connection: there's only ever one at a time
+
+/* the OUI is TomTom's; the rest comes from the watch's number */
+void
+fakehci_address(bdaddr_t *ba, int id)
+{
+    const uint8_t b[6] = { id & 0xff, (id >> 8) & 0xff, 0x00, 0x39, 0x04, 0xe4 };
+    memcpy(ba->b, b, sizeof b);
+}
+
+/* An LE Advertising Report, as read from an HCI socket. Returns its length. */
+static int
+advert_report(uint8_t *buf, const bdaddr_t *ba, bool random)
+{
+    static const uint8_t data[] = { 2, 0x01, 0x06, 7, 0x09, 'T', 'o', 'm', 'T', 'o', 'm' }; // flags, name
+    uint8_t *p = buf;
+
+    *p++ = HCI_EVENT_PKT;
+    *p++ = EVT_LE_META_EVENT;
+    *p++ = 1 + 1 + 1 + 1 + 6 + 1 + sizeof data + 1;
+    *p++ = EVT_LE_ADVERTISING_REPORT;
+    *p++ = 1;                   // reports
+    *p++ = 0x00;                // ADV_IND
+    *p++ = random ? 0x01 : 0x00;
+    memcpy(p, ba->b, 6);
+    p += 6;
+    *p++ = sizeof data;
+    memcpy(p, data, sizeof data);
+    p += sizeof data;
+    *p++ = (uint8_t)-60;        // RSSI
+    return p - buf;
+}
+
+/* The watch's side: one advertisement */
+int
+fakehci_advertise(int ctl, const bdaddr_t *ba, bool random)
+{
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    int len = advert_report(buf, ba, random);
+    return send(ctl, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT) < 0 ? -1 : 0;
+}
+
+/* The watch's side: the next connection, or -1 once the host has gone */
+int
+fakehci_accept(int ctl)
+{
+    char c;
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } u;
+    struct iovec iov = { &c, 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = u.buf, .msg_controllen = sizeof u.buf };
+    int fd;
+
+    if (recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(cm), sizeof fd);
+    return fd;
+}
+
+static int
+send_fd(int sock, int fd)
+{
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } u;
+    struct iovec iov = { "C", 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = u.buf, .msg_controllen = sizeof u.buf };
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/****************************************************************************/
+/* The host's side, as struct hci_ops */
+
+static int
+fake_open_dev(void *arg, int devid)
+{
+    struct fakehci *h = arg;
+    if (h->ctl < 0) {
+        errno = ENODEV;
+        return -1;
+    }
+    return h->ctl;
+}
+
+/* the socket to the watch stays open: the controller only stops scanning */
+static int
+fake_close_dev(void *arg, int dd)
+{
+    struct fakehci *h = arg;
+    h->scanning = false;
+    return 0;
+}
+
+static int
+fake_devba(void *arg, int devid, bdaddr_t *ba)
+{
+    const uint8_t b[6] = { 0x01, 0x00, 0x00, 0xdc, 0x1b, 0x00 };
+    memcpy(ba->b, b, sizeof b);
+    return 0;
+}
+
+/* an LE-only controller */
+static int
+fake_read_local_ext_features(void *arg, int dd, uint8_t page, uint8_t *max_page, uint8_t *features, int to)
+{
+    memset(features, 0, 8);
+    features[4] = LMP_LE;
+    if (max_page)
+        *max_page = 0;
+    return 0;
+}
+
+static int
+fake_le_set_scan_parameters(void *arg, int dd, uint8_t type, uint16_t interval, uint16_t window,
+                            uint8_t own_type, uint8_t filter, int to)
+{
+    return 0;
+}
+
+/* Each scan starts a session, so that's when it's decided whether (and
+ * where) this one will run into trouble */
+static int
+fake_le_set_scan_enable(void *arg, int dd, uint8_t enable, uint8_t filter_dup, int to)
+{
+    struct fakehci *h = arg;
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+
+    if (enable && !h->scanning) {
+        // nothing from before the scan started is reported
+        while (recv(h->ctl, buf, sizeof buf, MSG_DONTWAIT) > 0)
+            ;
+        h->fail = (rand_r(&h->seed) % 100 < h->failure) ? 1 + rand_r(&h->seed) % (FAKEHCI_STAGES-1) : FAKEHCI_OK;
+        h->lost = (h->fail == FAKEHCI_FAIL_SCAN) ? 3 + rand_r(&h->seed) % 8 : 0;
+        h->scans++;
+    }
+    h->scanning = enable;
+    return 0;
+}
+
+static int
+fake_get_filter(void *arg, int dd, struct hci_filter *f)
+{
+    memset(f, 0, sizeof *f);
+    return 0;
+}
+
+static int
+fake_set_filter(void *arg, int dd, const struct hci_filter *f)
+{
+    return 0;
+}
+
+static ssize_t
+fake_read_event(void *arg, int dd, void *buf, size_t len)
+{
+    struct fakehci *h = arg;
+    uint8_t ev[HCI_MAX_EVENT_SIZE];
+
+    ssize_t n = recv(h->ctl, ev, sizeof ev, MSG_DONTWAIT);
+    if (n == 0) {
+        errno = ENODEV; // the watch has gone for good
+        return -1;
+    } else if (n < 0)
+        return -1;
+    else if (!h->scanning) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (h->lost) {
+        // someone else's advertisement, while the watch's was lost
+        bdaddr_t other = {{ 0x13, 0x71, 0xda, 0x7d, 0x1a, 0x00 }};
+        h->lost--;
+        n = advert_report(ev, &other, false);
+    }
+    if (n > len)
+        n = len;
+    memcpy(buf, ev, n);
+    return n;
+}
+
+static int
+fake_att_connect(void *arg, bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type, int sec, int verbose)
+{
+    struct fakehci *h = arg;
+    int sv[2];
+
+    h->connects++;
+    h->dst_type = dst_type;
+    if (h->fail == FAKEHCI_FAIL_CONNECT) {
+        errno = ETIMEDOUT; // the watch never answered the connection request
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    int result = send_fd(h->ctl, sv[1]);
+    close(sv[1]);
+    if (result < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    return sv[0];
+}
+
+static int
+fake_conn_handle(void *arg, int fd, uint16_t *handle)
+{
+    *handle = FAKEHCI_HANDLE;
+    return 0;
+}
+
+static int
+fake_conn_update(void *arg, int dd, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+                 uint16_t latency, uint16_t supervision_timeout, struct le_link *link)
+{
+    struct fakehci *h = arg;
+
+    h->updates++;
+    if (h->fail == FAKEHCI_FAIL_SETUP || handle != FAKEHCI_HANDLE) {
+        h->timeouts++;
+        errno = ETIMEDOUT; // no Complete event
+        return -1;
+    }
+    link->interval = max_interval;
+    link->latency = latency;
+    link->timeout = supervision_timeout;
+    return 0;
+}
+
+/* A v2 watch takes long packets and the 2M PHY; a v1 watch (Bluetooth 4.0) neither */
+static int
+fake_optimize(void *arg, int dd, uint16_t handle, struct le_link *link, int verbose)
+{
+    struct fakehci *h = arg;
+
+    if (h->dst_type == BDADDR_LE_PUBLIC) {
+        link->data_len = 251;
+        link->tx_phy = link->rx_phy = 2;
+        return 0;
+    }
+    link->data_len = 0;
+    link->tx_phy = link->rx_phy = 1;
+    return 2;
+}
+
+const struct hci_ops fakehci_ops = {
+    fake_open_dev, fake_close_dev, fake_devba, fake_read_local_ext_features,
+    fake_le_set_scan_parameters, fake_le_set_scan_enable, fake_get_filter, fake_set_filter,
+    fake_read_event, fake_att_connect, fake_conn_handle, fake_conn_update, fake_optimize
+};
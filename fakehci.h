@@ -0,0 +1,52 @@
+#ifndef __FAKEHCI_H__
+#define __FAKEHCI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "btlink.h"
+
+/**
+ * An emulated Bluetooth LE controller, with the watch at the far end of a
+ * local socket rather than a radio, so that the simulator (sim.c) can run
+ * the daemon's own scan, connect and link setup code (btlink.c) without a
+ * dongle, and time it.
+ *
+ * The watch's side advertises with fakehci_advertise(), which sends the
+ * LE Advertising Report event a controller would (the E4:04:39 OUI, with a
+ * random address for a v1 watch and a public one for v2, which is how
+ * hci_tt_scan_match tells them apart), and takes connections with
+ * fakehci_accept(): each is one end of a fresh socket pair, standing in
+ * for the L2CAP ATT channel.
+ *
+ * The host's side is fakehci_ops, for a struct hci_link. The controller
+ * only reports advertisements while scanning, grants connection parameter
+ * updates as asked, and settles data length and PHY as the watch's
+ * generation would. Trouble can be injected at each stage, once in a
+ * while: a burst of other devices' advertisements while the watch's are
+ * lost (scan), the connection attempt timing out (connect), or connection
+ * parameter updates which never complete (link setup).
+ */
+
+enum { FAKEHCI_OK, FAKEHCI_FAIL_SCAN, FAKEHCI_FAIL_CONNECT, FAKEHCI_FAIL_SETUP, FAKEHCI_STAGES };
+
+struct fakehci {
+    int ctl;                    // to the watch: its advertisements arrive here, connections go out
+    int failure;                // chance (%) of trouble at one of the stages, per session
+    unsigned seed;
+    int fail;                   // for this session
+    int lost;                   // of the watch's advertisements, still to lose
+    bool scanning;
+    uint8_t dst_type;           // of the connection
+    int scans, connects, updates, timeouts; // what it was asked to do, and how often it didn't
+};
+
+extern const struct hci_ops fakehci_ops;
+
+void fakehci_address(bdaddr_t *ba, int id);
+int fakehci_advertise(int ctl, const bdaddr_t *ba, bool random);
+int fakehci_accept(int ctl);
+
+#endif /* __FAKEHCI_H__ */
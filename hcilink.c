@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hcilink.h"
+
+// Not all BlueZ versions have these (Bluetooth 4.2 and 5.0 commands)
+#define LINK_OCF_LE_CONN_UPDATE         0x0013
+#define LINK_OCF_LE_SET_DATA_LENGTH     0x0022
+#define LINK_OCF_LE_READ_PHY            0x0030
+#define LINK_OCF_LE_SET_PHY             0x0032
+#define LINK_EVT_LE_CONN_UPDATE_COMPLETE 0x03
+#define LINK_EVT_LE_DATA_LEN_CHANGE      0x07
+#define LINK_EVT_LE_PHY_UPDATE_COMPLETE  0x0c
+
+#define LE_PHY_2M 0x02
+#define LE_MAX_TX_OCTETS 251
+#define LE_MAX_TX_TIME 2120 // microseconds, for 251 octets on the 1M PHY
+
+#define HCI_TIMEOUT 2000
+
+struct conn_update_evt { uint8_t status; uint16_t handle, interval, latency, timeout; } __attribute__((packed));
+struct phy_evt { uint8_t status; uint16_t handle; uint8_t tx_phy, rx_phy; } __attribute__((packed));
+struct data_len_evt { uint16_t handle, max_tx_octets, max_tx_time, max_rx_octets, max_rx_time; } __attribute__((packed));
+
+/* Lets LE meta events through to dd, keeping the old filter in *of. Events
+ * which come in after a command has completed then wait in the socket. */
+static int
+le_listen(int dd, struct hci_filter *of)
+{
+    struct hci_filter nf;
+    socklen_t olen = sizeof *of;
+
+    if (getsockopt(dd, SOL_HCI, HCI_FILTER, of, &olen) < 0)
+        return -1;
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+    return setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof nf);
+}
+
+static void
+le_unlisten(int dd, const struct hci_filter *of)
+{
+    int saved = errno;
+    setsockopt(dd, SOL_HCI, HCI_FILTER, of, sizeof *of);
+    errno = saved;
+}
+
+/* Waits up to timeout ms for the given LE meta event about handle (which
+ * is at handle_off in its parameters), and copies its parameters to evt. */
+static int
+le_wait_event(int dd, uint8_t subevent, uint16_t handle, int handle_off, void *evt, size_t len, int timeout)
+{
+    struct timespec now, end;
+    uint8_t buf[HCI_MAX_EVENT_SIZE+1];
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout / 1000;
+    end.tv_nsec += (timeout % 1000) * 1000000;
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd p = { dd, POLLIN };
+        int n = poll(&p, 1, left > 0 ? left : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0)
+            return -1;
+        else if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        ssize_t got = read(dd, buf, sizeof buf);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        else if (got < 0)
+            return -1;
+
+        // packet type, event header, subevent, then the parameters
+        const uint8_t *params = buf + 1 + HCI_EVENT_HDR_SIZE + 1;
+        if (got < (ssize_t)(1 + HCI_EVENT_HDR_SIZE + 1 + len) || buf[1] != EVT_LE_META_EVENT || params[-1] != subevent)
+            continue;
+        if ((params[handle_off] | (params[handle_off+1]<<8)) != handle)
+            continue;
+        memcpy(evt, params, len);
+        return 0;
+    }
+}
+
+/* Like hci_le_conn_update, but keeps the parameters the controller settled
+ * on. If the Complete event is late, it waits a while longer for it rather
+ * than return while the update may still be pending: asking again then
+ * would only be refused as Command Disallowed. */
+int
+le_link_conn_update(int dd, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+                    uint16_t latency, uint16_t supervision_timeout, struct le_link *link)
+{
+    struct {
+        uint16_t handle, min_interval, max_interval, latency, supervision_timeout, min_ce_length, max_ce_length;
+    } __attribute__((packed)) cp = {
+        htobs(handle), htobs(min_interval), htobs(max_interval), htobs(latency), htobs(supervision_timeout), htobs(1), htobs(1)
+    };
+    struct conn_update_evt evt = {0};
+    struct hci_request rq = {
+        .ogf = OGF_LE_CTL, .ocf = LINK_OCF_LE_CONN_UPDATE, .event = LINK_EVT_LE_CONN_UPDATE_COMPLETE,
+        .cparam = &cp, .clen = sizeof cp, .rparam = &evt, .rlen = sizeof evt
+    };
+    struct hci_filter of;
+
+    if (le_listen(dd, &of) < 0)
+        return -1;
+    int result = hci_send_req(dd, &rq, HCI_TIMEOUT);
+    if (result < 0 && errno == ETIMEDOUT)
+        result = le_wait_event(dd, LINK_EVT_LE_CONN_UPDATE_COMPLETE, handle, 1, &evt, sizeof evt, HCI_TIMEOUT);
+    le_unlisten(dd, &of);
+    if (result < 0)
+        return -1;
+    if (evt.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    link->interval = btohs(evt.interval);
+    link->latency = btohs(evt.latency);
+    link->timeout = btohs(evt.timeout);
+    return 0;
+}
+
+static int
+le_set_data_length(int dd, uint16_t handle, struct le_link *link)
+{
+    struct { uint16_t handle, tx_octets, tx_time; } __attribute__((packed)) cp = {
+        htobs(handle), htobs(LE_MAX_TX_OCTETS), htobs(LE_MAX_TX_TIME)
+    };
+    struct { uint8_t status; uint16_t handle; } __attribute__((packed)) rp = {0};
+    struct hci_request rq = {
+        .ogf = OGF_LE_CTL, .ocf = LINK_OCF_LE_SET_DATA_LENGTH,
+        .cparam = &cp, .clen = sizeof cp, .rparam = &rp, .rlen = sizeof rp
+    };
+    struct data_len_evt evt;
+    struct hci_filter of;
+
+    link->data_len = 0;
+    if (le_listen(dd, &of) < 0)
+        return -1;
+    if (hci_send_req(dd, &rq, HCI_TIMEOUT) < 0)
+        goto fail;
+    if (rp.status) {
+        errno = EIO;
+        goto fail;
+    }
+
+    // the outcome is only reported by a Data Length Change event, and only
+    // if the length did change; without one, it's left as unknown
+    if (le_wait_event(dd, LINK_EVT_LE_DATA_LEN_CHANGE, handle, 0, &evt, sizeof evt, HCI_TIMEOUT/4) == 0)
+        link->data_len = btohs(evt.max_tx_octets);
+    le_unlisten(dd, &of);
+    return 0;
+
+fail:
+    le_unlisten(dd, &of);
+    return -1;
+}
+
+static int
+le_set_phy(int dd, uint16_t handle)
+{
+    struct { uint16_t handle; uint8_t all_phys, tx_phys, rx_phys; uint16_t phy_options; } __attribute__((packed)) cp = {
+        htobs(handle), 0, LE_PHY_2M, LE_PHY_2M, 0
+    };
+    struct phy_evt evt = {0};
+    struct hci_request rq = {
+        .ogf = OGF_LE_CTL, .ocf = LINK_OCF_LE_SET_PHY, .event = LINK_EVT_LE_PHY_UPDATE_COMPLETE,
+        .cparam = &cp, .clen = sizeof cp, .rparam = &evt, .rlen = sizeof evt
+    };
+
+    if (hci_send_req(dd, &rq, HCI_TIMEOUT) < 0)
+        return -1;
+    if (evt.status) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+le_read_phy(int dd, uint16_t handle, struct le_link *link)
+{
+    uint16_t cp = htobs(handle);
+    struct phy_evt rp = {0};
+    struct hci_request rq = {
+        .ogf = OGF_LE_CTL, .ocf = LINK_OCF_LE_READ_PHY,
+        .cparam = &cp, .clen = sizeof cp, .rparam = &rp, .rlen = sizeof rp
+    };
+
+    if (hci_send_req(dd, &rq, HCI_TIMEOUT) < 0)
+        return -1;
+    if (rp.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    link->tx_phy = rp.tx_phy;
+    link->rx_phy = rp.rx_phy;
+    return 0;
+}
+
+/* Asks for longer link-layer packets and the 2M PHY, then reads back what
+ * the link ended up with. Returns the number of settings that were refused. */
+int
+le_link_optimize(int dd, uint16_t handle, struct le_link *link, int verbose)
+{
+    int refused = 0;
+
+    if (le_set_data_length(dd, handle, link) < 0) {
+        if (verbose)
+            fprintf(stderr, "LE Data Length Extension not available: %s (%d)\n", strerror(errno), errno);
+        refused++;
+    }
+    if (le_set_phy(dd, handle) < 0) {
+        if (verbose)
+            fprintf(stderr, "LE 2M PHY not available: %s (%d)\n", strerror(errno), errno);
+        refused++;
+    }
+    if (le_read_phy(dd, handle, link) < 0 && verbose)
+        fprintf(stderr, "Could not read LE PHY: %s (%d)\n", strerror(errno), errno);
+
+    return refused;
+}
+
+const char *
+le_phy_name(int phy)
+{
+    switch (phy) {
+    case 1: return "1M";
+    case 2: return "2M";
+    case 3: return "Coded";
+    default: return "?";
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __HCILINK_H__
+#define __HCILINK_H__
+
+#include <stdint.h>
+
+/**
+ * Best-effort tuning of the LE link to the watch, over an HCI socket:
+ * connection parameters, Data Length Extension and the 2M PHY. All of
+ * these need CAP_NET_RAW, and either end may refuse any of them, so each
+ * result is recorded rather than treated as an error.
+ */
+
+struct le_link {
+    int interval;       // connection interval (units of 1.25 ms), 0 if unknown
+    int latency;        // slave latency (connection events)
+    int timeout;        // supervision timeout (units of 10 ms)
+    int data_len;       // LL payload negotiated with Data Length Extension, 0 if unknown
+    int tx_phy, rx_phy; // 1=1M, 2=2M, 3=Coded; 0 if unknown
+};
+
+int le_link_conn_update(int dd, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+                        uint16_t latency, uint16_t supervision_timeout, struct le_link *link);
+int le_link_optimize(int dd, uint16_t handle, struct le_link *link, int verbose);
+const char *le_phy_name(int phy);
+
+#endif /* __HCILINK_H__ */
@@ -0,0 +1,45 @@
+#ifndef __LIBTTBLUE_H__
+#define __LIBTTBLUE_H__
+
+/**
+ * Public interface of libttblue, the watch protocol engine behind the
+ * ttblue tool: a blocking, thread-per-session API.
+ *
+ * A session is a TTDEV wrapped around a connected L2CAP ATT socket
+ * (tt_device_new), which also holds the socket's receive queue and trace
+ * (struct att_sock). The library keeps no state of its own outside the
+ * TTDEV, so any number of sessions can run at once, one thread each;
+ * calls on a single TTDEV must not overlap. Every call blocks until the
+ * watch has answered (or the socket's SO_RCVTIMEO runs out): there are no
+ * completion callbacks, and nothing to poll for progress. Each session can
+ * have its own allocator for returned buffers, and a progress callback,
+ * called on the same thread, for transfers. tt_device_fd is only the
+ * socket underneath, e.g. for setting its timeouts.
+ *
+ * The sync flow itself (scanning, the task queue, the activity store and
+ * the daemon) is not part of the library: it stays in the ttblue program.
+ *
+ * Applications should include this header rather than the individual ones.
+ */
+
+#define LIBTTBLUE_VERSION_MAJOR 1
+#define LIBTTBLUE_VERSION_MINOR 0
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "ttblue.h"
+#include "version.h"
+#include "bbatt.h"
+#include "ttops.h"
+#include "hcilink.h"
+#include "manifest.h"
+#include "devcache.h"
+#include "tracking.h"
+#include "xxh64.h"
+
+#endif /* __LIBTTBLUE_H__ */
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "manifest.h"
+
+#define MANIFEST_HEADER 4
+#define MANIFEST_ENTRY 6
+
+/****************************************************************************/
+
+// Only settings whose meaning is known go here; the rest are shown as raw values.
+// The UTC offset has been entry 169 in every firmware version seen so far.
+
+static const struct manifest_def defs_v1[] = {
+    { MANIFEST_UTC_OFFSET, "utc_offset", MANIFEST_SECONDS },
+    { 0 }
+};
+
+static const struct manifest_def defs_v2[] = {
+    { MANIFEST_UTC_OFFSET, "utc_offset", MANIFEST_SECONDS },
+    { 0 }
+};
+
+static const struct manifest_schema {
+    int protocol_version;
+    struct version_tuple oldest;
+    const struct manifest_def *defs;
+} schemas[] = {
+    { 1, VERSION_TUPLE(1,8,34), defs_v1 },
+    { 2, VERSION_TUPLE(1,1,19), defs_v2 },
+    { 0 }
+};
+
+static const struct manifest_def *
+schema_for(int protocol_version, const char *firmware)
+{
+    struct version_tuple fw;
+    const struct manifest_def *defs = NULL;
+
+    if (!firmware || parse_version(firmware, &fw, ".") < 0)
+        fw = VERSION_TUPLE(0);
+
+    // the newest schema which this firmware is at least as new as
+    for (const struct manifest_schema *s = schemas; s->defs; s++)
+        if (s->protocol_version == protocol_version && compare_versions(&fw, (struct version_tuple *)&s->oldest) >= 0)
+            defs = s->defs;
+    return defs;
+}
+
+/****************************************************************************/
+
+MANIFEST *
+manifest_decode(const uint8_t *buf, int length, int protocol_version, const char *firmware)
+{
+    MANIFEST *m = calloc(1, sizeof *m);
+    if (!m)
+        return NULL;
+
+    if (length < MANIFEST_HEADER) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    // trust the entry count in the header only as far as the file goes
+    uint16_t count = buf[2] | (buf[3]<<8);
+    m->n = (length - MANIFEST_HEADER) / MANIFEST_ENTRY;
+    if (count < m->n)
+        m->n = count;
+
+    m->length = length;
+    if (!(m->raw = malloc(length)) || !(m->entries = calloc(m->n + 1, sizeof *m->entries)))
+        goto fail;
+    memcpy(m->raw, buf, length);
+
+    for (int ii=0; ii<m->n; ii++) {
+        const uint8_t *p = buf + MANIFEST_HEADER + ii*MANIFEST_ENTRY;
+        struct manifest_entry *e = &m->entries[ii];
+        uint32_t value;
+        memcpy(&value, p+2, sizeof value);
+
+        e->id = p[0] | (p[1]<<8);
+        e->value = btohl(value);
+        e->offset = MANIFEST_HEADER + ii*MANIFEST_ENTRY + 2;
+        if (e->id > m->max_id)
+            m->max_id = e->id;
+    }
+
+    if (!(m->index = malloc((m->max_id + 1) * sizeof(int))))
+        goto fail;
+    for (int ii=0; ii<=m->max_id; ii++)
+        m->index[ii] = -1;
+    for (int ii=m->n-1; ii>=0; ii--) // first one wins
+        m->index[m->entries[ii].id] = ii;
+
+    m->defs = schema_for(protocol_version, firmware);
+    return m;
+
+fail:
+    manifest_free(m);
+    return NULL;
+}
+
+/* The manifest with all changes applied; returns its length, or -1 */
+int
+manifest_encode(const MANIFEST *m, uint8_t **buf)
+{
+    if (!(*buf = malloc(m->length)))
+        return -1;
+
+    memcpy(*buf, m->raw, m->length);
+    for (int ii=0; ii<m->n; ii++) {
+        const struct manifest_entry *e = &m->entries[ii];
+        if (e->dirty) {
+            uint32_t value = htobl(e->value);
+            memcpy(*buf + e->offset, &value, sizeof value);
+        }
+    }
+    return m->length;
+}
+
+void
+manifest_free(MANIFEST *m)
+{
+    if (m) {
+        free(m->raw);
+        free(m->entries);
+        free(m->index);
+        free(m);
+    }
+}
+
+/****************************************************************************/
+
+struct manifest_entry *
+manifest_get(const MANIFEST *m, uint16_t id)
+{
+    if (id > m->max_id || m->index[id] < 0)
+        return NULL;
+    return &m->entries[m->index[id]];
+}
+
+/* Returns 1 if the setting was changed, 0 if it already had this value,
+ * or -1 if the manifest has no such setting */
+int
+manifest_set(MANIFEST *m, uint16_t id, uint32_t value)
+{
+    struct manifest_entry *e = manifest_get(m, id);
+    if (!e)
+        return -1;
+    else if (e->value == value)
+        return 0;
+
+    e->value = value;
+    e->dirty = true;
+    return 1;
+}
+
+/* Number of changed settings */
+int
+manifest_dirty(const MANIFEST *m)
+{
+    int n = 0;
+    for (int ii=0; ii<m->n; ii++)
+        n += m->entries[ii].dirty;
+    return n;
+}
+
+const struct manifest_def *
+manifest_def(const MANIFEST *m, uint16_t id)
+{
+    for (const struct manifest_def *d = m ? m->defs : NULL; d && d->name; d++)
+        if (d->id == id)
+            return d;
+    return NULL;
+}
+
+/****************************************************************************/
+
+/* Parses ID or ID=VALUE, where ID is a number or a known setting name.
+ * Returns 1 if a value was given, 0 if not, or -1 if it makes no sense. */
+int
+manifest_parse_setting(const char *arg, uint16_t *id, int64_t *value)
+{
+    const char *eq = strchr(arg, '=');
+    int namelen = eq ? eq-arg : strlen(arg);
+    char *end;
+
+    unsigned long n = strtoul(arg, &end, 0);
+    if (end == arg+namelen && namelen > 0 && n <= UINT16_MAX)
+        *id = n;
+    else {
+        const struct manifest_def *d;
+        // names are the same in all schemas
+        for (d = defs_v1; d->name; d++)
+            if (!strncmp(d->name, arg, namelen) && d->name[namelen] == '\0')
+                break;
+        if (!d->name)
+            return -1;
+        *id = d->id;
+    }
+
+    if (!eq)
+        return 0;
+
+    errno = 0;
+    *value = strtoll(eq+1, &end, 0);
+    if (errno || *end || end == eq+1 || *value < INT32_MIN || *value > UINT32_MAX)
+        return -1;
+    return 1;
+}
+
+const char *
+manifest_format(const MANIFEST *m, const struct manifest_entry *e, char *buf, int len)
+{
+    const struct manifest_def *d = manifest_def(m, e->id);
+
+    if (!d)
+        snprintf(buf, len, "%5d: %" PRIu32 " (0x%08" PRIx32 ")", e->id, e->value, e->value);
+    else if (d->type == MANIFEST_UINT)
+        snprintf(buf, len, "%5d: %s = %" PRIu32, e->id, d->name, e->value);
+    else if (d->type == MANIFEST_INT)
+        snprintf(buf, len, "%5d: %s = %" PRId32, e->id, d->name, (int32_t)e->value);
+    else
+        snprintf(buf, len, "%5d: %s = %" PRId32 " s (UTC%+.2g)", e->id, d->name, (int32_t)e->value, (int32_t)e->value/3600.0);
+    return buf;
+}
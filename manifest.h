@@ -0,0 +1,54 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "version.h"
+
+/**
+ * The settings manifest (TTBLUE_FILE_MANIFEST1) is a 4-byte header followed
+ * by a table of 6-byte entries: a 16-bit setting ID and its 32-bit value.
+ * (Based on https://github.com/ryanbinns/ttwatch/tree/master/manifest)
+ *
+ * Decoding keeps the original bytes, so that encoding only patches the
+ * values that were changed and leaves everything else exactly as the watch
+ * wrote it.
+ */
+
+enum manifest_type { MANIFEST_UINT, MANIFEST_INT, MANIFEST_SECONDS };
+
+struct manifest_def { uint16_t id; const char *name; enum manifest_type type; };
+
+struct manifest_entry {
+    uint16_t id;
+    uint32_t value;
+    int offset;         // of the value, in the manifest file
+    bool dirty;
+};
+
+typedef struct manifest {
+    uint8_t *raw;
+    int length;
+    int n;
+    struct manifest_entry *entries;
+    int *index;         // entries by ID (-1 if absent), up to max_id
+    int max_id;
+    const struct manifest_def *defs;
+} MANIFEST;
+
+#define MANIFEST_UTC_OFFSET 169
+
+MANIFEST *manifest_decode(const uint8_t *buf, int length, int protocol_version, const char *firmware);
+int manifest_encode(const MANIFEST *m, uint8_t **buf);
+void manifest_free(MANIFEST *m);
+
+struct manifest_entry *manifest_get(const MANIFEST *m, uint16_t id);
+int manifest_set(MANIFEST *m, uint16_t id, uint32_t value);
+int manifest_dirty(const MANIFEST *m);
+
+const struct manifest_def *manifest_def(const MANIFEST *m, uint16_t id);
+int manifest_parse_setting(const char *arg, uint16_t *id, int64_t *value);
+const char *manifest_format(const MANIFEST *m, const struct manifest_entry *e, char *buf, int len);
+
+#endif /* __MANIFEST_H__ */
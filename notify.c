@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "notify.h"
+
+int
+notify_open(struct notify_queue *q, const char *path)
+{
+    memset(q, 0, sizeof *q);
+    q->fd = -1;
+    q->path = path;
+
+    if (mkfifo(path, 0620) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create notification FIFO %s: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+    // opened for writing too, so that it never reads EOF when a writer goes away
+    if ((q->fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not open notification FIFO %s: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
+void
+notify_close(struct notify_queue *q)
+{
+    if (q->fd >= 0)
+        close(q->fd);
+    for (int ii=0; ii<q->n; ii++)
+        free(q->msgs[ii].text);
+    q->fd = -1;
+    q->n = 0;
+}
+
+static void
+enqueue(struct notify_queue *q, const char *text, int len)
+{
+    if (!len)
+        return;
+    if (q->n == NOTIFY_MAX_QUEUE) {
+        fprintf(stderr, "WARNING: notification queue full, dropping oldest message.\n");
+        free(q->msgs[0].text);
+        memmove(q->msgs, q->msgs+1, (--q->n) * sizeof *q->msgs);
+    }
+    struct notify_msg *m = &q->msgs[q->n];
+    if ((m->text = strndup(text, len)) != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &m->queued);
+        q->n++;
+    }
+}
+
+/* Reads all complete lines waiting in the FIFO, then keeps reading for up to
+ * coalesce_ms more as long as more lines arrive. Returns the queue length. */
+int
+notify_read(struct notify_queue *q, int coalesce_ms)
+{
+    struct pollfd pfd = { .fd = q->fd, .events = POLLIN };
+
+    do {
+        char buf[4096];
+        ssize_t r;
+        while ((r = read(q->fd, buf, sizeof buf)) > 0) {
+            for (char *p = buf, *end = buf+r; p < end; ) {
+                char *nl = memchr(p, '\n', end-p);
+                int take = (nl ? nl : end) - p;
+
+                // over-long lines are cut to what the watch can take
+                if (q->plen + take > NOTIFY_MAX_TEXT)
+                    take = NOTIFY_MAX_TEXT - q->plen;
+                memcpy(q->partial + q->plen, p, take);
+                q->plen += take;
+
+                if (!nl)
+                    break;
+                enqueue(q, q->partial, q->plen);
+                q->plen = 0;
+                p = nl+1;
+            }
+        }
+    } while (coalesce_ms > 0 && poll(&pfd, 1, coalesce_ms) > 0);
+
+    return q->n;
+}
+
+/* Joins up to max-1 bytes of the oldest queued messages, one per line, into
+ * out. Returns the number of messages joined, which stay queued until
+ * notify_drop (so that nothing is lost if sending fails). */
+int
+notify_peek(struct notify_queue *q, char *out, int max, struct timespec *oldest)
+{
+    int n = 0, len = 0;
+
+    for (; n < q->n; n++) {
+        int mlen = strlen(q->msgs[n].text);
+        if (n && len + 1 + mlen >= max)
+            break;
+        if (n)
+            out[len++] = '\n';
+        if (mlen >= max - len)
+            mlen = max - len - 1;
+        memcpy(out+len, q->msgs[n].text, mlen);
+        len += mlen;
+    }
+    out[len] = '\0';
+
+    if (n)
+        *oldest = q->msgs[0].queued;
+    return n;
+}
+
+void
+notify_drop(struct notify_queue *q, int n)
+{
+    for (int ii=0; ii<n; ii++)
+        free(q->msgs[ii].text);
+    memmove(q->msgs, q->msgs+n, (q->n - n) * sizeof *q->msgs);
+    q->n -= n;
+}
+
+double
+notify_ms_since(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec)*1e3 + (now.tv_nsec - since->tv_nsec)/1e6;
+}
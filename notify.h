@@ -0,0 +1,35 @@
+#ifndef __NOTIFY_H__
+#define __NOTIFY_H__
+
+#include <time.h>
+
+/**
+ * Queue of text notifications for the watch, fed through a named pipe:
+ * every line written to the FIFO is one message, e.g.
+ *   echo "Pager: disk full on db3" > /run/ttblue.notify
+ * Messages which arrive together are sent to the watch as one.
+ */
+
+#define NOTIFY_MAX_TEXT 512     /* bytes per message sent to the watch */
+#define NOTIFY_MAX_QUEUE 64
+#define NOTIFY_COALESCE_MS 20   /* wait this long for the rest of a burst */
+
+struct notify_msg { char *text; struct timespec queued; };
+
+struct notify_queue {
+    int fd;
+    const char *path;
+    char partial[NOTIFY_MAX_TEXT];
+    int plen;
+    int n;
+    struct notify_msg msgs[NOTIFY_MAX_QUEUE];
+};
+
+int notify_open(struct notify_queue *q, const char *path);
+void notify_close(struct notify_queue *q);
+int notify_read(struct notify_queue *q, int coalesce_ms);
+int notify_peek(struct notify_queue *q, char *out, int max, struct timespec *oldest);
+void notify_drop(struct notify_queue *q, int n);
+double notify_ms_since(const struct timespec *since);
+
+#endif /* __NOTIFY_H__ */
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "pace.h"
+
+// upper bounds of the histogram buckets, as percent of the target interval
+static const int bucket_pct[PACE_BUCKETS-1] = { 90, 110, 125, 150, 200, 400 };
+
+static inline int64_t
+ts_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec*1000000000 + ts->tv_nsec;
+}
+
+static inline struct timespec
+ns_ts(int64_t ns)
+{
+    return (struct timespec){ ns/1000000000, ns%1000000000 };
+}
+
+void
+pace_init(struct pacer *p, uint32_t interval)
+{
+    memset(p, 0, sizeof *p);
+    p->interval = interval;
+    p->old_slack = -1;
+
+    // the default 50us of timer slack is a sizeable fraction of our error budget
+    if (interval > 0) {
+        int slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+        if (slack >= 0 && prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) == 0)
+            p->old_slack = slack;
+    }
+}
+
+/* Gives the thread back the timer slack it had before pace_init */
+void
+pace_done(struct pacer *p)
+{
+    if (p->old_slack >= 0)
+        prctl(PR_SET_TIMERSLACK, (unsigned long)p->old_slack, 0, 0, 0);
+    p->old_slack = -1;
+}
+
+/* Waits until the next packet is due; the first call (after pace_init or
+ * pace_restart) returns immediately */
+void
+pace_wait(struct pacer *p)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (p->last.tv_sec || p->last.tv_nsec) {
+        int64_t due = ts_ns(&p->next);
+
+        if (due - ts_ns(&now) > PACE_SPIN_NS) {
+            struct timespec wake = ns_ts(due - PACE_SPIN_NS);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+                ;
+        }
+        do
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        while (ts_ns(&now) < due);
+
+        double achieved = (ts_ns(&now) - ts_ns(&p->last)) / 1000.0;
+        int b;
+        for (b=0; b<PACE_BUCKETS-1 && achieved*100 > (double)bucket_pct[b]*p->interval; b++)
+            ;
+        p->hist[b]++;
+        p->total += achieved;
+        p->n++;
+
+        // if we've fallen more than an interval behind, don't burst to catch up
+        if (ts_ns(&now) - due > (int64_t)p->interval*1000)
+            due = ts_ns(&now);
+        p->next = ns_ts(due + (int64_t)p->interval*1000);
+    } else
+        p->next = ns_ts(ts_ns(&now) + (int64_t)p->interval*1000);
+
+    p->last = now;
+}
+
+/* Starts a new train of packets, e.g. after waiting for an acknowledgement,
+ * without counting the gap */
+void
+pace_restart(struct pacer *p)
+{
+    p->last = (struct timespec){ 0, 0 };
+}
+
+void
+pace_report(const struct pacer *p, FILE *f, const char *indent)
+{
+    if (!p->n)
+        return;
+
+    fprintf(f, "%sPacing: %lu intervals, target %u usec, achieved %.0f usec on average\n",
+            indent, p->n, p->interval, p->total/p->n);
+    for (int b=0; b<PACE_BUCKETS; b++) {
+        char label[16];
+        if (b==0)
+            snprintf(label, sizeof label, "<%d%%", bucket_pct[0]);
+        else if (b<PACE_BUCKETS-1)
+            snprintf(label, sizeof label, "%d-%d%%", bucket_pct[b-1], bucket_pct[b]);
+        else
+            snprintf(label, sizeof label, ">%d%%", bucket_pct[b-1]);
+        fprintf(f, "%s  %9s: %lu\n", indent, label, p->hist[b]);
+    }
+}
+
+/* Best effort: makes the calling thread SCHED_FIFO (but not its children)
+ * and locks the process in memory, so that page faults and other processes
+ * don't delay packets. Needs CAP_SYS_NICE and CAP_IPC_LOCK, or root. */
+int
+pace_realtime(void)
+{
+    int result = 0;
+    struct sched_param sp = { .sched_priority = sched_get_priority_min(SCHED_FIFO) };
+
+    if (sched_setscheduler(0, SCHED_FIFO|SCHED_RESET_ON_FORK, &sp) < 0) {
+        fprintf(stderr, "Could not switch to realtime scheduling: %s (%d)\n", strerror(errno), errno);
+        result = -1;
+    }
+    if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+        fprintf(stderr, "Could not lock memory: %s (%d)\n", strerror(errno), errno);
+        result = -1;
+    }
+    return result;
+}
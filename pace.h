@@ -0,0 +1,36 @@
+#ifndef __PACE_H__
+#define __PACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Packet pacing against absolute CLOCK_MONOTONIC deadlines: each packet is
+ * due one interval after the previous deadline (not after the previous
+ * packet), so oversleeping once doesn't slow down the whole transfer. The
+ * last PACE_SPIN_NS before a deadline are spun rather than slept, since
+ * timer wakeups are rarely that precise. While a pacer is in use, the
+ * calling thread's timer slack is cut to the minimum; pace_done puts it back.
+ */
+
+#define PACE_SPIN_NS 100000
+#define PACE_BUCKETS 7
+
+struct pacer {
+    uint32_t interval;          // target, in microseconds
+    struct timespec next, last; // next deadline, and when the last packet went out
+    unsigned long n, hist[PACE_BUCKETS];
+    double total;               // sum of achieved intervals, in microseconds
+    long old_slack;             // the thread's own timer slack, or -1 if it wasn't changed
+};
+
+void pace_init(struct pacer *p, uint32_t interval);
+void pace_wait(struct pacer *p);
+void pace_done(struct pacer *p);
+void pace_restart(struct pacer *p);
+void pace_report(const struct pacer *p, FILE *f, const char *indent);
+int pace_realtime(void);
+
+#endif /* __PACE_H__ */
@@ -0,0 +1,534 @@
+/**
+ * Python 3 bindings for libttblue
+ *
+ * Released under the terms of the
+ * GNU General Public License version 3 or later
+ *
+ * Every call which talks to the watch releases the GIL for the duration,
+ * so transfers from several watches (on several threads) run in parallel,
+ * and the rest of the interpreter keeps going meanwhile. Files read from
+ * the watch come back as FileData objects, which expose the buffer the C
+ * code read into through the buffer protocol, without copying it.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libttblue.h"
+
+static PyObject *TTBlueError;
+
+//////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    PyObject_HEAD
+    uint8_t *buf;   // from tt_read_file, with the default allocator
+    Py_ssize_t len;
+} FileData;
+
+static void
+FileData_dealloc(FileData *self)
+{
+    free(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+FileData_getbuffer(FileData *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->buf, self->len, 0, flags);
+}
+
+static Py_ssize_t
+FileData_length(FileData *self)
+{
+    return self->len;
+}
+
+static PyBufferProcs FileData_as_buffer = {
+    .bf_getbuffer = (getbufferproc)FileData_getbuffer,
+};
+
+static PySequenceMethods FileData_as_sequence = {
+    .sq_length = (lenfunc)FileData_length,
+};
+
+static PyTypeObject FileData_pytype = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_ttblue.FileData",
+    .tp_basicsize = sizeof(FileData),
+    .tp_dealloc = (destructor)FileData_dealloc,
+    .tp_as_sequence = &FileData_as_sequence,
+    .tp_as_buffer = &FileData_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "contents of a file read from the watch (supports the buffer protocol)",
+};
+
+//////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    PyObject_HEAD
+    TTDEV *d;
+    bool busy;          // a call is running with the GIL released
+    PyObject *progress; // callable(fileno, done, total), or None
+} Device;
+
+// called from tt_read_file/tt_write_file, while the GIL is released
+static void
+Device_progress(void *arg, uint32_t fileno, uint32_t done, uint32_t total)
+{
+    Device *self = arg;
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyObject *cb = self->progress;
+    if (cb && cb != Py_None) {
+        Py_INCREF(cb); // in case it replaces itself
+        PyObject *r = PyObject_CallFunction(cb, "kkk", (unsigned long)fileno,
+                                            (unsigned long)done, (unsigned long)total);
+        if (r)
+            Py_DECREF(r);
+        else
+            PyErr_WriteUnraisable(cb);
+        Py_DECREF(cb);
+    }
+    PyGILState_Release(gil);
+}
+
+static int
+Device_wrap(Device *self, int fd, int protocol_version)
+{
+    if (!(self->d = tt_device_init(protocol_version, fd))) {
+        PyErr_Format(PyExc_ValueError, "unknown protocol version %d", protocol_version);
+        return -1;
+    }
+    tt_set_progress(self->d, Device_progress, self);
+    att_rx_batched(&self->d->att, true);
+    return 0;
+}
+
+static void
+Device_release(Device *self)
+{
+    if (self->d) {
+        int fd = tt_device_fd(self->d);
+        tt_device_done(self->d);
+        close(fd);
+        self->d = NULL;
+    }
+}
+
+/* Checks that the device can be used, and marks it in use; every caller
+ * must end with END_CALL */
+static bool
+BEGIN_CALL(Device *self)
+{
+    if (!self->d) {
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return false;
+    } else if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+        return false;
+    }
+    self->busy = true;
+    return true;
+}
+
+static inline void
+END_CALL(Device *self)
+{
+    self->busy = false;
+}
+
+// Device(fd, protocol_version): takes a copy of an already-connected ATT socket
+static int
+Device_init(Device *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"fd", "protocol_version", NULL};
+    int fd, protocol_version;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii:Device", kwlist, &fd, &protocol_version))
+        return -1;
+
+    // re-running __init__ would free the device under a call in progress
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+        return -1;
+    }
+    Device_release(self);
+    if ((fd = dup(fd)) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    if (Device_wrap(self, fd, protocol_version) < 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+Device_dealloc(Device *self)
+{
+    Device_release(self);
+    Py_XDECREF(self->progress);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// device.close()
+static PyObject *
+Device_close(Device *self, PyObject *unused)
+{
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+        return NULL;
+    }
+    Device_release(self);
+    Py_RETURN_NONE;
+}
+
+// device.fileno()
+static PyObject *
+Device_fileno(Device *self, PyObject *unused)
+{
+    if (!self->d) {
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return NULL;
+    }
+    return PyLong_FromLong(tt_device_fd(self->d));
+}
+
+// device.info(): {name: value} from the Device Information service
+static PyObject *
+Device_info(Device *self, PyObject *unused)
+{
+    struct ble_dev_info *info;
+    if (!BEGIN_CALL(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    info = tt_check_device_version(self->d, false);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    if (!info) {
+        PyErr_SetString(TTBlueError, "could not read device information");
+        return NULL;
+    }
+    PyObject *dict = PyDict_New();
+    for (struct ble_dev_info *p = info; dict && p->handle; p++) {
+        PyObject *v = PyUnicode_DecodeUTF8(p->buf, p->len, "replace");
+        if (!v || PyDict_SetItemString(dict, p->name, v) < 0)
+            Py_CLEAR(dict);
+        Py_XDECREF(v);
+    }
+    return dict;
+}
+
+// device.authorize(code, new_code=False)
+static PyObject *
+Device_authorize(Device *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"code", "new_code", NULL};
+    const char *code;
+    int new_code = 0, result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p:authorize", kwlist, &code, &new_code))
+        return NULL;
+
+    char c[7] = {0};
+    strncpy(c, code, 6);
+    if (!BEGIN_CALL(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    result = tt_authorize(self->d, c, new_code);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    if (result < 0) {
+        PyErr_Format(TTBlueError, "device didn't accept pairing code %s", c);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// device.list(fileno): the file numbers under a parent file, e.g. FILE_TTBIN_DATA
+static PyObject *
+Device_list(Device *self, PyObject *args)
+{
+    unsigned int fileno;
+    uint16_t *list;
+    int n;
+    if (!PyArg_ParseTuple(args, "I:list", &fileno))
+        return NULL;
+
+    if (!BEGIN_CALL(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    n = tt_list_sub_files(self->d, fileno, &list);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    if (n < 0) {
+        PyErr_Format(TTBlueError, "could not list files 0x%08x", fileno);
+        return NULL;
+    }
+    PyObject *out = PyList_New(n);
+    for (int ii=0; out && ii<n; ii++) {
+        PyObject *v = PyLong_FromUnsignedLong(fileno + list[ii]);
+        if (!v)
+            Py_CLEAR(out);
+        else
+            PyList_SET_ITEM(out, ii, v);
+    }
+    tt_free(self->d, list);
+    return out;
+}
+
+// device.read(fileno): a FileData with the contents
+static PyObject *
+Device_read(Device *self, PyObject *args)
+{
+    unsigned int fileno;
+    uint8_t *buf;
+    int length;
+    if (!PyArg_ParseTuple(args, "I:read", &fileno))
+        return NULL;
+
+    FileData *fd = PyObject_New(FileData, &FileData_pytype);
+    if (!fd)
+        return NULL;
+    fd->buf = NULL;
+    fd->len = 0;
+
+    if (!BEGIN_CALL(self)) {
+        Py_DECREF(fd);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    length = tt_read_file(self->d, fileno, 0, &buf);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    if (length < 0) {
+        Py_DECREF(fd);
+        PyErr_Format(TTBlueError, "could not read file 0x%08x", fileno);
+        return NULL;
+    }
+    fd->buf = buf;
+    fd->len = length;
+    return (PyObject *)fd;
+}
+
+// device.write(fileno, data, write_delay=0): write_delay is in microseconds between packets
+static PyObject *
+Device_write(Device *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"fileno", "data", "write_delay", NULL};
+    unsigned int fileno, write_delay = 0;
+    Py_buffer buf = {.buf=NULL};
+    int length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Iy*|I:write", kwlist, &fileno, &buf, &write_delay))
+        return NULL;
+    if (buf.len > INT32_MAX) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_OverflowError, "file too large");
+        return NULL;
+    }
+
+    if (!BEGIN_CALL(self)) {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    length = tt_write_file(self->d, fileno, 0, buf.buf, buf.len, write_delay);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    Py_ssize_t want = buf.len;
+    PyBuffer_Release(&buf);
+    if (length != want) {
+        PyErr_Format(TTBlueError, "could not write file 0x%08x", fileno);
+        return NULL;
+    }
+    return PyLong_FromLong(length);
+}
+
+// device.delete(fileno)
+static PyObject *
+Device_delete(Device *self, PyObject *args)
+{
+    unsigned int fileno;
+    int result;
+    if (!PyArg_ParseTuple(args, "I:delete", &fileno))
+        return NULL;
+
+    if (!BEGIN_CALL(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    result = tt_delete_file(self->d, fileno);
+    Py_END_ALLOW_THREADS
+    END_CALL(self);
+
+    if (result < 0) {
+        PyErr_Format(TTBlueError, "could not delete file 0x%08x", fileno);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Device_enter(Device *self, PyObject *unused)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+Device_exit(Device *self, PyObject *args)
+{
+    return Device_close(self, NULL);
+}
+
+static PyObject *
+Device_get_protocol_version(Device *self, void *closure)
+{
+    if (!self->d)
+        Py_RETURN_NONE;
+    return PyLong_FromLong(self->d->protocol_version);
+}
+
+static PyMethodDef Device_methods[] = {
+    {"close", (PyCFunction)Device_close, METH_NOARGS, "close the connection"},
+    {"fileno", (PyCFunction)Device_fileno, METH_NOARGS, "the connection's socket"},
+    {"info", (PyCFunction)Device_info, METH_NOARGS, "read the device information"},
+    {"authorize", (PyCFunction)Device_authorize, METH_VARARGS|METH_KEYWORDS, "authorize with the pairing code"},
+    {"list", (PyCFunction)Device_list, METH_VARARGS, "list the sub-files of a file"},
+    {"read", (PyCFunction)Device_read, METH_VARARGS, "read a file"},
+    {"write", (PyCFunction)Device_write, METH_VARARGS|METH_KEYWORDS, "write a file"},
+    {"delete", (PyCFunction)Device_delete, METH_VARARGS, "delete a file"},
+    {"__enter__", (PyCFunction)Device_enter, METH_NOARGS, ""},
+    {"__exit__", (PyCFunction)Device_exit, METH_VARARGS, ""},
+    {NULL},
+};
+
+static PyMemberDef Device_members[] = {
+    {"progress", T_OBJECT, offsetof(Device, progress), 0, "callable(fileno, done, total), called during transfers"},
+    {NULL},
+};
+
+static PyGetSetDef Device_getset[] = {
+    {"protocol_version", (getter)Device_get_protocol_version, NULL, "1 or 2", NULL},
+    {NULL},
+};
+
+static PyTypeObject Device_pytype = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_ttblue.Device",
+    .tp_basicsize = sizeof(Device),
+    .tp_dealloc = (destructor)Device_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "connection to a TomTom watch",
+    .tp_methods = Device_methods,
+    .tp_members = Device_members,
+    .tp_getset = Device_getset,
+    .tp_init = (initproc)Device_init,
+    .tp_new = PyType_GenericNew,
+};
+
+//////////////////////////////////////////////////////////////////////
+
+// connect(address, address_type="random", adapter=None)
+static PyObject *
+module_connect(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"address", "address_type", "adapter", NULL};
+    const char *addr, *type = "random", *adapter = NULL;
+    bdaddr_t src = {{0}}, dst;
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sz:connect", kwlist, &addr, &type, &adapter))
+        return NULL;
+
+    if (str2ba(addr, &dst) < 0 || (adapter && str2ba(adapter, &src) < 0)) {
+        PyErr_SetString(PyExc_ValueError, "invalid Bluetooth address");
+        return NULL;
+    }
+    // v1 watches use random addresses, v2 public ones
+    uint8_t dst_type;
+    if (!strcmp(type, "random"))
+        dst_type = BDADDR_LE_RANDOM;
+    else if (!strcmp(type, "public"))
+        dst_type = BDADDR_LE_PUBLIC;
+    else {
+        PyErr_SetString(PyExc_ValueError, "address_type must be 'random' or 'public'");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    fd = l2cap_le_att_connect(&src, &dst, dst_type, BT_SECURITY_MEDIUM, false);
+    Py_END_ALLOW_THREADS
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Device *self = PyObject_New(Device, &Device_pytype);
+    if (!self) {
+        close(fd);
+        return NULL;
+    }
+    self->d = NULL;
+    self->busy = false;
+    self->progress = NULL;
+    if (Device_wrap(self, fd, dst_type==BDADDR_LE_RANDOM ? 1 : 2) < 0) {
+        close(fd);
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static PyMethodDef module_methods[] = {
+    {"connect", (PyCFunction)module_connect, METH_VARARGS|METH_KEYWORDS, "connect to a watch, returning a Device" },
+    {NULL},
+};
+
+PyDoc_STRVAR(module__doc__,
+             "Bindings for libttblue, to sync TomTom GPS watches over Bluetooth LE.");
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_ttblue",
+    .m_doc = module__doc__,
+    .m_size = -1,
+    .m_methods = module_methods,
+};
+
+PyMODINIT_FUNC
+PyInit__ttblue(void)
+{
+    if (PyType_Ready(&FileData_pytype) < 0 || PyType_Ready(&Device_pytype) < 0)
+        return NULL;
+
+    PyObject *mod = PyModule_Create(&module_def);
+    if (!mod)
+        return NULL;
+
+    TTBlueError = PyErr_NewException("_ttblue.error", PyExc_OSError, NULL);
+    Py_INCREF(TTBlueError);
+    PyModule_AddObject(mod, "error", TTBlueError);
+    Py_INCREF(&Device_pytype);
+    PyModule_AddObject(mod, "Device", (PyObject *)&Device_pytype);
+    Py_INCREF(&FileData_pytype);
+    PyModule_AddObject(mod, "FileData", (PyObject *)&FileData_pytype);
+
+    PyModule_AddIntConstant(mod, "FILE_TTBIN_DATA", TTBLUE_FILE_TTBIN_DATA);
+    PyModule_AddIntConstant(mod, "FILE_STEP_BUCKET", TTBLUE_FILE_STEP_BUCKET);
+    PyModule_AddIntConstant(mod, "FILE_MANIFEST1", TTBLUE_FILE_MANIFEST1);
+    PyModule_AddIntConstant(mod, "FILE_PREFERENCES_XML", TTBLUE_FILE_PREFERENCES_XML);
+    PyModule_AddIntConstant(mod, "FILE_GPSQUICKFIX_DATA", TTBLUE_FILE_GPSQUICKFIX_DATA);
+    PyModule_AddIntConstant(mod, "FILE_HOSTNAME1", TTBLUE_FILE_HOSTNAME1);
+    PyModule_AddIntConstant(mod, "FILE_HOSTNAME2", TTBLUE_FILE_HOSTNAME2);
+    return mod;
+}
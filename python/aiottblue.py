@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""asyncio interface to the _ttblue bindings.
+
+Each call runs the blocking C function in an executor thread; the C code
+releases the GIL while it talks to the watch, so the event loop (and any
+other watches) keep going meanwhile. Progress callbacks are delivered on
+the event loop's thread.
+
+    async def main():
+        async with await aiottblue.connect('E4:04:39:11:22:33') as dev:
+            await dev.authorize('123456')
+            for fileno in await dev.list(aiottblue.FILE_TTBIN_DATA):
+                data = await dev.read(fileno)
+                open('%08x.ttbin' % fileno, 'wb').write(data)
+"""
+
+import asyncio
+import functools
+
+import _ttblue
+from _ttblue import (error, FileData, FILE_TTBIN_DATA, FILE_STEP_BUCKET, FILE_MANIFEST1,
+                     FILE_PREFERENCES_XML, FILE_GPSQUICKFIX_DATA, FILE_HOSTNAME1, FILE_HOSTNAME2)
+
+
+class AsyncDevice(object):
+    def __init__(self, dev, loop=None, executor=None):
+        self.dev = dev
+        self.loop = loop or asyncio.get_running_loop()
+        self.executor = executor
+        self._progress = None
+
+    def _run(self, fn, *args, **kwargs):
+        return self.loop.run_in_executor(self.executor, functools.partial(fn, *args, **kwargs))
+
+    @property
+    def progress(self):
+        return self._progress
+
+    @progress.setter
+    def progress(self, cb):
+        # called on the executor thread: hand it over to the loop
+        self._progress = cb
+        if cb is None:
+            self.dev.progress = None
+        else:
+            self.dev.progress = lambda *a: self.loop.call_soon_threadsafe(cb, *a)
+
+    @property
+    def protocol_version(self):
+        return self.dev.protocol_version
+
+    def fileno(self):
+        return self.dev.fileno()
+
+    async def info(self):
+        return await self._run(self.dev.info)
+
+    async def authorize(self, code, new_code=False):
+        return await self._run(self.dev.authorize, code, new_code)
+
+    async def list(self, fileno):
+        return await self._run(self.dev.list, fileno)
+
+    async def read(self, fileno):
+        return await self._run(self.dev.read, fileno)
+
+    async def write(self, fileno, data, write_delay=0):
+        return await self._run(self.dev.write, fileno, data, write_delay)
+
+    async def delete(self, fileno):
+        return await self._run(self.dev.delete, fileno)
+
+    def close(self):
+        self.dev.close()
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        self.close()
+
+
+async def connect(address, address_type='random', adapter=None, executor=None):
+    loop = asyncio.get_running_loop()
+    dev = await loop.run_in_executor(executor, functools.partial(_ttblue.connect, address, address_type, adapter))
+    return AsyncDevice(dev, loop, executor)
@@ -1,11 +1,32 @@
 #!/usr/bin/env python
 
-from distutils.core import setup, Extension
-setup(name = "crc16_modbus",
-      version = "0.1",
-      ext_modules=[
-          Extension("crc16_modbus", ["crc16_modbus.c"], extra_compile_args=['--std=c99'])
-      ],
+import sys
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
+
+# the C engine is compiled straight into the extension, so it doesn't
+# depend on libttblue being installed
+libttblue_src = ['../' + f for f in ('bbatt.c', 'ttops.c', 'util.c', 'version.c', 'pace.c')]
+
+if sys.version_info[0] >= 3:
+    ext_modules = [
+        Extension("_ttblue", ["_ttblue.c"] + libttblue_src, include_dirs=['..'],
+                  libraries=['bluetooth'], extra_compile_args=['--std=c99']),
+    ]
+    py_modules = ['aiottblue']
+else:
+    # only used by the bluepy-based ttblue.py
+    ext_modules = [
+        Extension("crc16_modbus", ["crc16_modbus.c"], extra_compile_args=['--std=c99'])
+    ]
+    py_modules = []
+
+setup(name = "ttblue",
+      version = "0.2",
+      ext_modules = ext_modules,
+      py_modules = py_modules,
 
       author = 'Dan Lenski',
       author_email = 'dlenski@gmail.com',
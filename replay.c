@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "bbatt.h"
+#include "ttops.h"
+#include "ttblue.h"
+#include "util.h"
+#include "replay.h"
+
+static inline uint16_t
+pdu_handle(const struct trace_pdu *p)
+{
+    return p->len >= 3 ? p->pdu[1] | (p->pdu[2]<<8) : 0;
+}
+
+static inline bool
+is_file_op(const struct trace_pdu *p, uint16_t cmd_status)
+{
+    if (p->dir != ATT_TRACE_TX || p->len != 3+4 || p->pdu[0] != BT_ATT_OP_WRITE_REQ || pdu_handle(p) != cmd_status)
+        return false;
+    switch (p->pdu[3]) {
+    case MSG_READ: case MSG_WRITE: case MSG_DELETE: case MSG_LIST_FILES:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* v1 and v2 watches differ in where the command/status handle is */
+static int
+guess_protocol_version(const struct trace_session *s)
+{
+    for (int ii=0; ii<s->n; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+        if (p->dir == ATT_TRACE_TX && p->len == 3+4 && p->pdu[0] == BT_ATT_OP_WRITE_REQ) {
+            if (pdu_handle(p) == 0x0025)
+                return 1;
+            else if (pdu_handle(p) == 0x0072)
+                return 2;
+        }
+    }
+    return 1;
+}
+
+TRACE *
+trace_load(const char *path)
+{
+    TRACE *t = calloc(1, sizeof(TRACE));
+    struct stat st;
+    int fd;
+
+    if (!t)
+        return NULL;
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not open trace %s: %s (%d)\n", path, strerror(errno), errno);
+        goto fail;
+    }
+    if (!(t->data = malloc(st.st_size+1)))
+        goto fail;
+    for (off_t got = 0; got < st.st_size; ) {
+        ssize_t r = read(fd, t->data+got, st.st_size-got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r <= 0) {
+            fprintf(stderr, "Could not read trace %s: %s (%d)\n", path, strerror(errno), errno);
+            goto fail;
+        }
+        got += r;
+    }
+
+    // one header per recorded session, each followed by its PDUs
+    struct trace_session *s = NULL;
+    for (const uint8_t *p = t->data, *end = p+st.st_size; p < end; ) {
+        if (end-p >= sizeof(struct att_trace_hdr) && !memcmp(p, ATT_TRACE_MAGIC, 8)) {
+            const struct att_trace_hdr *h = (const void *)p;
+            if (btohl(h->version) != ATT_TRACE_VERSION) {
+                fprintf(stderr, "Trace %s has unknown version %d\n", path, btohl(h->version));
+                goto fail;
+            }
+            if (!(s = realloc(t->s, (t->n+1) * sizeof *s)))
+                goto fail;
+            t->s = s;
+            s = &t->s[t->n++];
+            memset(s, 0, sizeof *s);
+            p += sizeof *h;
+        } else if (!s || end-p < sizeof(struct att_trace_rec)) {
+            goto corrupt;
+        } else {
+            const struct att_trace_rec *r = (const void *)p;
+            int len = btohs(r->len);
+            if (end-p < sizeof *r + len)
+                goto corrupt;
+
+            struct trace_pdu *pdus = realloc(s->p, (s->n+1) * sizeof *pdus);
+            if (!pdus)
+                goto fail;
+            s->p = pdus;
+            s->p[s->n++] = (struct trace_pdu){ btohll(r->ns), r->dir, len, p + sizeof *r };
+            p += sizeof *r + len;
+        }
+    }
+    if (!t->n)
+        goto corrupt;
+    for (int ii=0; ii<t->n; ii++)
+        t->s[ii].protocol_version = guess_protocol_version(&t->s[ii]);
+
+    close(fd);
+    return t;
+
+corrupt:
+    fprintf(stderr, "Trace %s is truncated or corrupt\n", path);
+fail:
+    if (fd >= 0)
+        close(fd);
+    trace_free(t);
+    return NULL;
+}
+
+void
+trace_free(TRACE *t)
+{
+    if (t) {
+        for (int ii=0; ii<t->n; ii++)
+            free(t->s[ii].p);
+        free(t->s);
+        free(t->data);
+        free(t);
+    }
+}
+
+/****************************************************************************/
+
+/* Plays the watch's side of the session over fd. Returns the number of the
+ * host's PDUs which differed from the recording, or <0 on error. */
+int
+replay_peer(int fd, const struct trace_session *s, bool timed, int verbose)
+{
+    uint8_t buf[ATT_RX_SLOT];
+    int mismatches = 0;
+    struct timespec base;
+    uint64_t base_ns = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &base);
+    for (int ii=0; ii<s->n; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+
+        if (p->dir == ATT_TRACE_TX) {
+            int len = recv(fd, buf, sizeof buf, 0);
+            if (len < 0)
+                return -1;
+            else if (len == 0)
+                return mismatches + 1; // the host gave up before the end
+
+            if (len != p->len || memcmp(buf, p->pdu, len)) {
+                mismatches++;
+                if (verbose) {
+                    fprintf(stderr, "PDU %d differs from the recording:\n  expected ", ii);
+                    hexlify(stderr, p->pdu, p->len, true);
+                    fprintf(stderr, "       got ");
+                    hexlify(stderr, buf, len, true);
+                }
+            }
+            // the watch's answers are timed from the request they follow
+            clock_gettime(CLOCK_MONOTONIC, &base);
+            base_ns = p->ns;
+        } else {
+            if (timed && p->ns > base_ns) {
+                uint64_t due_ns = base.tv_sec*1000000000ULL + base.tv_nsec + (p->ns - base_ns);
+                struct timespec due = { due_ns/1000000000, due_ns%1000000000 };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+                    ;
+            }
+            if (send(fd, p->pdu, p->len, 0) < 0)
+                return -1;
+        }
+    }
+    return mismatches;
+}
+
+/* The first notification of status 0 ends each file operation */
+static int
+end_of_op(const struct trace_session *s, int from, uint16_t cmd_status)
+{
+    for (int ii=from+1; ii<s->n; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+        if (p->dir == ATT_TRACE_RX && p->len == 3+4 && p->pdu[0] == BT_ATT_OP_HANDLE_VAL_NOT
+            && pdu_handle(p) == cmd_status && !memcmp(p->pdu+3, "\0\0\0\0", 4))
+            return ii;
+    }
+    return s->n-1;
+}
+
+/* Skips the response to the request at index ii, if it's there */
+static int
+skip_response(const struct trace_session *s, int ii)
+{
+    if (ii+1 < s->n && s->p[ii+1].dir == ATT_TRACE_RX) {
+        switch (s->p[ii+1].pdu[0]) {
+        case BT_ATT_OP_READ_RSP: case BT_ATT_OP_WRITE_RSP: case BT_ATT_OP_ERROR_RSP:
+            return ii+1;
+        }
+    }
+    return ii;
+}
+
+/* Puts back together the file the host wrote between from and to, minus the
+ * CRC after each block. Returns its length, or -1 if the recording doesn't
+ * hold all of it. */
+static int
+recorded_write(const struct trace_session *s, int from, int to, const struct tt_handles *h, uint8_t **out)
+{
+    uint32_t length = 0;
+    size_t size = 0, got = 0;
+    bool have_length = false;
+    uint8_t *buf;
+
+    *out = NULL;
+
+    // the buffer is sized from what was actually sent, never from the length the host claimed
+    for (int ii=from+1; ii<=to; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+        if (p->dir != ATT_TRACE_TX || p->len < 3 || p->pdu[0] != BT_ATT_OP_WRITE_CMD)
+            continue;
+        if (pdu_handle(p) == h->length && p->len == 3+4 && !have_length) {
+            memcpy(&length, p->pdu+3, 4);
+            length = btohl(length);
+            have_length = true;
+        } else if (pdu_handle(p) == h->transfer && have_length)
+            size += p->len-3;
+    }
+    if (!have_length || length > INT_MAX || length > size || !(buf = malloc(size ? size : 1)))
+        return -1;
+
+    for (int ii=from+1, seen=0; ii<=to; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+        if (p->dir != ATT_TRACE_TX || p->len < 3 || p->pdu[0] != BT_ATT_OP_WRITE_CMD)
+            continue;
+        if (pdu_handle(p) == h->length && p->len == 3+4)
+            seen = 1;
+        else if (pdu_handle(p) == h->transfer && seen) {
+            if (got + (p->len-3) > size)
+                goto truncated;
+            memcpy(buf+got, p->pdu+3, p->len-3);
+            got += p->len-3;
+        }
+    }
+
+    // drop the CRC trailers; every block, even a short last one, has one
+    uint8_t *o = buf;
+    for (size_t off=0; off < got; off += TT_BLOCK_LEN+2) {
+        if (got-off < 2)
+            goto truncated;
+        size_t blen = (got-off-2 < TT_BLOCK_LEN) ? got-off-2 : TT_BLOCK_LEN;
+        memmove(o, buf+off, blen);
+        o += blen;
+    }
+    if (o-buf != length)
+        goto truncated;
+    *out = buf;
+    return length;
+
+truncated:
+    free(buf);
+    return -1;
+}
+
+/* Re-enacts the host's side of the session over d. The file operations are
+ * timed, and listed in *ops (which the caller frees). Returns 0 on success. */
+int
+replay_host(TTDEV *d, const struct trace_session *s, struct replay_op **ops, int *nops, int debug)
+{
+    uint8_t buf[BT_ATT_DEFAULT_LE_MTU];
+    uint16_t handle;
+
+    *ops = NULL;
+    *nops = 0;
+    for (int ii=0; ii<s->n; ii++) {
+        const struct trace_pdu *p = &s->p[ii];
+        if (p->len < 1)
+            continue;
+
+        if (p->dir == ATT_TRACE_RX) {
+            // not the response to any request: the host was waiting for it
+            if (p->pdu[0] == BT_ATT_OP_HANDLE_VAL_NOT && att_read_not(&d->att, &handle, buf) < 0)
+                return -1;
+        } else if (is_file_op(p, d->h->cmd_status)) {
+            struct replay_op *op = realloc(*ops, (*nops+1) * sizeof *op);
+            if (!op)
+                return -1;
+            *ops = op;
+            op = &op[(*nops)++];
+
+            int end = end_of_op(s, ii, d->h->cmd_status);
+            op->cmd = p->pdu[3];
+            op->fileno = (p->pdu[4]<<16) | p->pdu[5] | (p->pdu[6]<<8);
+            op->recorded = (s->p[end].ns - p->ns) / 1e9;
+
+            uint8_t *fbuf = NULL;
+            uint16_t *list = NULL;
+            int wlen = (op->cmd == MSG_WRITE) ? recorded_write(s, ii, end, d->h, &fbuf) : 0;
+            struct timeval start;
+            gettimeofday(&start, NULL);
+            switch (op->cmd) {
+            case MSG_READ:
+                op->length = tt_read_file(d, op->fileno, debug>1, &fbuf);
+                tt_free(d, fbuf);
+                break;
+            case MSG_WRITE:
+                op->length = (wlen < 0) ? -1 : tt_write_file(d, op->fileno, debug>1, fbuf, wlen, 0);
+                free(fbuf);
+                break;
+            case MSG_DELETE:
+                op->length = tt_delete_file(d, op->fileno);
+                break;
+            case MSG_LIST_FILES:
+                op->length = tt_list_sub_files(d, op->fileno, &list);
+                tt_free(d, list);
+                break;
+            }
+            op->replayed = elapsed_secs(&start);
+            // an operation may have failed in the recording too; if it
+            // failed differently, the peer will notice that we're out of step
+            ii = end;
+        } else {
+            // everything else is repeated as is; ATT errors are part of the recording
+            handle = pdu_handle(p);
+            switch (p->pdu[0]) {
+            case BT_ATT_OP_READ_REQ:
+                if (att_read(&d->att, handle, buf) == -1)
+                    return -1;
+                ii = skip_response(s, ii);
+                break;
+            case BT_ATT_OP_WRITE_REQ:
+                if (att_wrreq(&d->att, handle, p->pdu+3, p->len-3) == -1)
+                    return -1;
+                ii = skip_response(s, ii);
+                break;
+            case BT_ATT_OP_WRITE_CMD:
+                if (att_write(&d->att, handle, p->pdu+3, p->len-3) < 0)
+                    return -1;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static const char *
+op_name(uint8_t cmd)
+{
+    switch (cmd) {
+    case MSG_READ: return "read";
+    case MSG_WRITE: return "write";
+    case MSG_DELETE: return "delete";
+    case MSG_LIST_FILES: return "list";
+    default: return "?";
+    }
+}
+
+/* What one replay of a session cost the host */
+struct replay_cost {
+    double secs, cpu_secs;
+    unsigned long rx_calls;     // syscalls spent receiving
+};
+
+static double
+rusage_secs(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+/* Plays one session back, with a forked peer, over plain or batched
+ * receives. Returns 0 if it matched the recording, -1 if the host lost the
+ * connection, 1 if the peer saw PDUs differ, or -2 if it couldn't start. */
+static int
+replay_once(const struct trace_session *s, bool timed, bool batched, int debug,
+            struct replay_op **ops, int *nops, struct replay_cost *cost)
+{
+    int sv[2], status;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "Could not create socket pair: %s (%d)\n", strerror(errno), errno);
+        return -2;
+    }
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Could not fork: %s (%d)\n", strerror(errno), errno);
+        close(sv[0]);
+        close(sv[1]);
+        return -2;
+    } else if (pid == 0) {
+        close(sv[0]);
+        _exit(replay_peer(sv[1], s, timed, debug>1) == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+
+    // a diverging replay could otherwise leave both sides waiting forever
+    uint64_t gap = 0;
+    for (int ii=1; timed && ii<s->n; ii++)
+        if (s->p[ii].ns - s->p[ii-1].ns > gap)
+            gap = s->p[ii].ns - s->p[ii-1].ns;
+    struct timeval to = { 5 + gap/1000000000, 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
+
+    TTDEV *d = tt_device_init(s->protocol_version, sv[0]);
+    if (d && batched)
+        att_rx_batched(&d->att, true);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    double cpu_start = rusage_secs();
+    int result = d ? replay_host(d, s, ops, nops, debug) : -1;
+    cost->secs = elapsed_secs(&start);
+    cost->cpu_secs = rusage_secs() - cpu_start;
+
+    // without batching, every PDU from the watch took a recv()
+    struct att_rx_stats st = {0};
+    if (!d || att_rx_stats(&d->att, &st) < 0)
+        for (int ii=0; ii<s->n; ii++)
+            st.calls += (s->p[ii].dir == ATT_TRACE_RX);
+    cost->rx_calls = st.calls;
+    tt_device_done(d);
+    close(sv[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    if (result < 0)
+        return -1;
+    return (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ? 1 : 0;
+}
+
+/* Replays each session in the trace against the file transfer code, and
+ * compares the time taken with the recording. As fast as possible, each
+ * session is also played back a second time with the other way of
+ * receiving, to compare batched and plain receives on the same workload.
+ * Returns the number of sessions which failed or diverged from the
+ * recording, or <0 on error. */
+int
+replay_run(const char *path, bool timed, bool batched, int debug)
+{
+    TRACE *t = trace_load(path);
+    int failed = 0;
+
+    if (!t)
+        return -1;
+
+    for (int ss=0; ss<t->n; ss++) {
+        const struct trace_session *s = &t->s[ss];
+        struct replay_op *ops = NULL;
+        int nops = 0;
+        struct replay_cost cost[2];
+
+        int result = replay_once(s, timed, batched, debug, &ops, &nops, &cost[0]);
+        if (result == -2) {
+            free(ops);
+            goto fatal;
+        }
+
+        double recorded = s->n ? (s->p[s->n-1].ns - s->p[0].ns) / 1e9 : 0;
+        fprintf(stderr, "Session %d: v%d watch, %d PDUs, %s\n", ss+1, s->protocol_version, s->n,
+                timed ? "original timing" : "as fast as possible");
+        fprintf(stderr, "  %-8s %-10s %8s %11s %11s\n", "op", "file", "bytes", "recorded", "replayed");
+        for (int ii=0; ii<nops; ii++)
+            fprintf(stderr, "  %-8s 0x%08x %8d %10.3fs %10.3fs\n", op_name(ops[ii].cmd), ops[ii].fileno,
+                    ops[ii].length, ops[ii].recorded, ops[ii].replayed);
+        fprintf(stderr, "  %-28s %10.3fs %10.3fs\n", "whole session", recorded, cost[0].secs);
+        free(ops);
+
+        if (result != 0) {
+            fprintf(stderr, "  FAILED: %s\n", result < 0 ? "lost the connection" : "PDUs differed from the recording");
+            failed++;
+            continue;
+        }
+        fprintf(stderr, "  OK\n");
+        if (timed)
+            continue; // the watch's delays would swamp the difference
+
+        // the same session again, receiving the other way
+        ops = NULL;
+        nops = 0;
+        result = replay_once(s, false, !batched, debug, &ops, &nops, &cost[1]);
+        free(ops);
+        if (result == -2)
+            goto fatal;
+        else if (result != 0) {
+            fprintf(stderr, "  FAILED: %s replay %s\n", batched ? "blocking" : "batched",
+                    result < 0 ? "lost the connection" : "differed from the recording");
+            failed++;
+            continue;
+        }
+
+        const struct replay_cost *b = batched ? &cost[0] : &cost[1], *p = batched ? &cost[1] : &cost[0];
+        fprintf(stderr, "  %-10s %10s %10s %12s\n", "receive", "time", "host CPU", "rx syscalls");
+        fprintf(stderr, "  %-10s %9.3fs %9.3fs %12lu\n", "blocking", p->secs, p->cpu_secs, p->rx_calls);
+        fprintf(stderr, "  %-10s %9.3fs %9.3fs %12lu\n", "batched", b->secs, b->cpu_secs, b->rx_calls);
+    }
+    trace_free(t);
+    return failed;
+
+fatal:
+    trace_free(t);
+    return -1;
+}
@@ -0,0 +1,55 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ttops.h"
+
+/**
+ * Replays sessions recorded with att_trace_start (ttblue --capture).
+ *
+ * The peer side stands in for the watch: it expects the host's PDUs in
+ * the recorded order, and answers with the watch's recorded PDUs, either
+ * with their original delays (measured from the request they follow) or
+ * as fast as possible.
+ *
+ * The host side re-issues the recorded file operations through the normal
+ * tt_read_file, tt_write_file, tt_delete_file and tt_list_sub_files, and
+ * everything else as the same raw ATT requests, so that the time each
+ * operation takes can be compared with the recording.
+ */
+
+struct trace_pdu {
+    uint64_t ns;
+    int dir;            // ATT_TRACE_TX or ATT_TRACE_RX
+    int len;
+    const uint8_t *pdu;
+};
+
+struct trace_session {
+    int n;
+    struct trace_pdu *p;
+    int protocol_version;
+};
+
+typedef struct trace {
+    uint8_t *data;      // the whole file
+    int n;
+    struct trace_session *s;
+} TRACE;
+
+struct replay_op {
+    uint8_t cmd;        // MSG_READ, MSG_WRITE...
+    uint32_t fileno;
+    int length;         // bytes transferred, <0 if it failed
+    double recorded, replayed; // seconds
+};
+
+TRACE *trace_load(const char *path);
+void trace_free(TRACE *t);
+int replay_peer(int fd, const struct trace_session *s, bool timed, int verbose);
+int replay_host(TTDEV *d, const struct trace_session *s, struct replay_op **ops, int *nops, int debug);
+int replay_run(const char *path, bool timed, bool batched, int debug);
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,912 @@
+/**
+ * The per-session body of the daemon (see session.h), and the work it does
+ * with the watch in each session.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include <curl/curl.h>
+
+#include "bbatt.h"
+#include "ttops.h"
+#include "util.h"
+#include "ttblue.h"
+#include "daemon.h"
+#include "store.h"
+#include "hcilink.h"
+#include "manifest.h"
+#include "devcache.h"
+#include "notify.h"
+#include "tracking.h"
+#include "tasks.h"
+#include "session.h"
+
+const char *PLEASE_SETCAP_ME =
+    "**********************************************************\n"
+    "NOTE: This program lacks the permissions necessary for\n"
+    "  manipulating the raw Bluetooth HCI socket, which\n"
+    "  is required for scanning and for setting the minimum\n"
+    "  connection inverval to speed up data transfer.\n\n"
+    "  To fix this, run it as root or, better yet, set the\n"
+    "  following capabilities on the ttblue executable:\n\n"
+    "    # sudo setcap 'cap_net_raw,cap_net_admin+eip' ttblue\n\n"
+    "  For gory details, see the BlueZ mailing list:\n"
+    "    http://thread.gmane.org/gmane.linux.bluez.kernel/63778\n"
+    "**********************************************************\n";
+
+static const char *PAIRING_CODE_PROMPT =
+    "\n**************************************************\n"
+    "Enter 6-digit pairing code shown on device: ";
+
+/* Ends the connection: adds up its receive counters (if batched), frees
+ * the device (if any) and closes the ATT socket */
+static void
+l2cap_le_att_close(TTDEV *ttd, int fd, struct daemon_state *ds, int verbose)
+{
+    struct att_rx_stats st;
+
+    if (ttd && att_rx_stats(&ttd->att, &st) == 0) {
+        if (verbose)
+            fprintf(stderr, "Received %lu PDUs in %lu syscalls.\n", st.pdus, st.calls);
+        ds->rx_pdus += st.pdus;
+        ds->rx_calls += st.calls;
+    }
+    tt_device_done(ttd);
+    close(fd);
+}
+
+/* keeps the daemon's control socket answering during long transfers */
+static void
+daemon_progress(void *arg, uint32_t fileno, uint32_t done, uint32_t total)
+{
+    struct daemon_state *ds = arg;
+    ds->xfer_fileno = fileno;
+    ds->xfer_done = done;
+    ds->xfer_total = total;
+    daemon_ctl_poll(ds);
+}
+
+time_t
+read_gqf_status(TTDEV *ttd, int debug)
+{
+    time_t last_update = 0;
+    uint8_t *fbuf;
+    int length;
+    if ((length=tt_read_file(ttd, TTBLUE_FILE_GPS_STATUS, debug, &fbuf)) < 0) {
+        fprintf(stderr, "WARNING: Could not read GPS status file 0x%08x from watch.\n", TTBLUE_FILE_GPS_STATUS);
+        last_update = -1;
+    } else {
+        if (length > 6 && (fbuf[0x02] | fbuf[0x03] | fbuf[0x04] | fbuf[0x05]) != 0) {
+            struct tm tmp = { .tm_mday = fbuf[0x05], .tm_mon = fbuf[0x04]-1, .tm_year = (((int)fbuf[0x02])<<8) + fbuf[0x03] - 1900 };
+            last_update = timegm(&tmp);
+        }
+        free(fbuf);
+    }
+    return last_update;
+}
+
+#define TT_FILENAME_MAX 32
+
+const char *
+make_tt_filename(char *filename, size_t len, uint32_t fileno, const char *ext)
+{
+    char filetime[16];
+    struct tm tm;
+    time_t t = time(NULL);
+    strftime(filetime, sizeof filetime, "%Y%m%d_%H%M%S", localtime_r(&t, &tm));
+    snprintf(filename, len, "%08x_%s.%s", fileno, filetime, ext);
+    return filename;
+}
+
+const struct tt_file_kind known_files[] = {
+    { TTBLUE_FILE_TTBIN_DATA,       "activities",        "ttbin" },
+    { TTBLUE_FILE_STEP_BUCKET,      "step buckets",      "bin" },
+    { TTBLUE_FILE_GOLF_SCORECARDS,  "golf scorecards",   "bin" },
+    { TTBLUE_FILE_GOLF_MANIFEST,    "golf manifest",     "bin" },
+    { TTBLUE_FILE_MANIFEST1,        "settings manifest", "bin" },
+    { TTBLUE_FILE_PREFERENCES_XML,  "preferences",       "xml" },
+    { TTBLUE_FILE_NOTIFICATION,     "notifications",     "bin" },
+    { TTBLUE_FILE_REST_PROTO_FILE,  "rest proto",        "bin" },
+    { TTBLUE_FILE_FIRMWARE_CHUNK,   "firmware",          "bin" },
+    { 0x00020000,                   "system",            "bin" }, // GPS status, hostnames
+    { 0x00010000,                   "GPS",               "bin" }, // QuickFix data
+    { 0 }
+};
+
+static const struct tt_file_kind *
+file_kind(uint32_t fileno)
+{
+    for (const struct tt_file_kind *k = known_files; k->name; k++)
+        if (k->fileno == (fileno & 0xffff0000))
+            return k;
+    return NULL;
+}
+
+static void
+list_files(TTDEV *ttd)
+{
+    for (const struct tt_file_kind *k = known_files; k->name; k++) {
+        uint16_t *list;
+        int n_files = tt_list_sub_files(ttd, k->fileno, &list);
+        if (n_files < 0)
+            continue;
+        fprintf(stderr, "0x%08x %-18s %d file(s)\n", k->fileno, k->name, n_files);
+        for (int ii=0; ii<n_files; ii++)
+            fprintf(stderr, "  0x%08x\n", k->fileno + list[ii]);
+        free(list);
+    }
+}
+
+/* Copies one file, or (for a known parent ID) every one of its sub-files, into the store.
+ * Returns the number of bytes copied, or -1 on failure. */
+static long
+get_files(TTDEV *ttd, STORE *store, uint32_t fileno, int debug)
+{
+    uint16_t *list = NULL;
+    int n_files = -1;
+    const struct tt_file_kind *k = file_kind(fileno);
+    long total = 0;
+
+    if (k && k->fileno == fileno)
+        n_files = tt_list_sub_files(ttd, fileno, &list);
+    if (n_files < 0) {
+        n_files = 1; // not a listable parent: just the file itself
+        list = NULL;
+    }
+
+    for (int ii=0; ii<n_files; ii++) {
+        uint32_t sub = list ? fileno + list[ii] : fileno;
+        uint8_t *fbuf;
+        int length;
+
+        fprintf(stderr, "  Reading file 0x%08x ...\n", sub);
+        if ((length = tt_read_file(ttd, sub, debug, &fbuf)) < 0) {
+            fprintf(stderr, "Could not read file 0x%08x from watch!\n", sub);
+            goto fail;
+        }
+        char name[TT_FILENAME_MAX];
+        int staged = store_stage(store, sub, make_tt_filename(name, sizeof name, sub, k ? k->ext : "bin"), fbuf, length, 4, debug>1);
+        if (staged < 0 || (staged == store->batch && store_commit(store, 4, true) < 0))
+            goto fail;
+        else if (staged == store->batch)
+            store_release(store);
+        total += length;
+    }
+    free(list);
+    return total;
+
+fail:
+    free(list);
+    return -1;
+}
+
+/* Makes fileno on the watch hold exactly buf. It's left alone if the device
+ * cache (or, without one, a read back from the watch) shows that it already
+ * does, unless force is set. Returns 1 if written, 0 if not needed, -1 on failure. */
+static int
+sync_small_file(TTDEV *ttd, DEVCACHE *cache, uint32_t fileno, const uint8_t *buf, int length,
+                bool force, uint32_t write_delay, int debug)
+{
+    if (!force) {
+        bool same;
+        if (cache)
+            same = devcache_same(cache, fileno, buf, length);
+        else {
+            uint8_t *fbuf;
+            int flen = tt_read_file(ttd, fileno, false, &fbuf);
+            same = (flen == length && !memcmp(fbuf, buf, length));
+            free(fbuf);
+        }
+        if (same) {
+            if (debug > 1)
+                fprintf(stderr, "  File 0x%08x is already up to date.\n", fileno);
+            return 0;
+        }
+    }
+
+    tt_delete_file(ttd, fileno);
+    if (tt_write_file(ttd, fileno, false, buf, length, write_delay) != length) {
+        if (cache)
+            devcache_forget(cache, fileno);
+        return -1;
+    }
+    if (cache)
+        devcache_put(cache, fileno, buf, length);
+    return 1;
+}
+
+/* Whether the watch is still connected, after something went wrong */
+static bool
+link_alive(int fd)
+{
+    struct pollfd p = { .fd = fd, .events = 0 };
+    return poll(&p, 1, 0) == 0; // only hangups and errors
+}
+
+/* Sends everything queued for the watch, batched into as few messages as will
+ * fit. Notifications the watch turns down are dropped, since they would only
+ * hold up the rest; if it's the connection that failed, they're kept for the
+ * next one. Returns the number of notifications delivered, or -1 if the
+ * watch is gone. */
+static int
+push_notifications(TTDEV *ttd, struct notify_queue *nq, struct daemon_state *ds, uint32_t write_delay, int debug)
+{
+    char text[NOTIFY_MAX_TEXT+1];
+    struct timespec oldest;
+    int n, total = 0;
+
+    while ((n = notify_peek(nq, text, sizeof text, &oldest)) > 0) {
+        if (tt_notify(ttd, text, write_delay) < 0) {
+            if (!link_alive(tt_device_fd(ttd))) {
+                fprintf(stderr, "Could not send notification to watch; will retry.\n");
+                return -1;
+            }
+            fprintf(stderr, "Watch did not take %d notification(s); dropping them.\n", n);
+            notify_drop(nq, n);
+            ds->notify_dropped += n;
+            continue;
+        }
+        notify_drop(nq, n);
+
+        double ms = notify_ms_since(&oldest);
+        if (debug)
+            fprintf(stderr, "Delivered %d notification(s) to watch, %.0f ms after queueing.\n", n, ms);
+        ds->notify_sent += n;
+        ds->notify_last_ms = ms;
+        if (ms > ds->notify_max_ms)
+            ds->notify_max_ms = ms;
+        total += n;
+    }
+    return total;
+}
+
+/* Applies all settings changes to the manifest in a single write-back. If the
+ * cached manifest already has the wanted values (and nothing is only being
+ * read), the watch isn't even asked. Returns the number of settings changed,
+ * or -1 on failure. */
+static int
+sync_settings(TTDEV *ttd, DEVCACHE *cache, const char *firmware, const struct setting_req *req, int n,
+              uint32_t write_delay, int debug)
+{
+    uint8_t *fbuf = NULL;
+    int length, changed = 0;
+    MANIFEST *m = NULL;
+    bool need_read = false;
+
+    if (cache && (length = devcache_get(cache, TTBLUE_FILE_MANIFEST1, &fbuf)) >= 0
+        && (m = manifest_decode(fbuf, length, ttd->protocol_version, firmware)) != NULL) {
+        for (int ii=0; ii<n && !need_read; ii++) {
+            struct manifest_entry *e = manifest_get(m, req[ii].id);
+            need_read = !req[ii].set || !e || e->value != req[ii].value;
+        }
+    } else
+        need_read = true;
+    free(fbuf);
+    fbuf = NULL;
+
+    if (!need_read) {
+        if (debug > 1)
+            fprintf(stderr, "  Settings are up to date (cached in %s).\n", cache->dir);
+        goto out;
+    }
+
+    manifest_free(m);
+    fprintf(stderr, "Checking watch settings manifest file 0x%08x...\n", TTBLUE_FILE_MANIFEST1);
+    if ((length = tt_read_file(ttd, TTBLUE_FILE_MANIFEST1, debug, &fbuf)) < 0) {
+        fprintf(stderr, "WARNING: Could not read settings manifest file 0x%08x from watch!\n", TTBLUE_FILE_MANIFEST1);
+        return -1;
+    }
+    if (!(m = manifest_decode(fbuf, length, ttd->protocol_version, firmware))) {
+        fprintf(stderr, "WARNING: Could not understand settings manifest file 0x%08x!\n", TTBLUE_FILE_MANIFEST1);
+        free(fbuf);
+        return -1;
+    }
+    if (cache)
+        devcache_put(cache, TTBLUE_FILE_MANIFEST1, fbuf, length);
+    free(fbuf);
+
+    for (int ii=0; ii<n; ii++) {
+        char old[80], new[80];
+        struct manifest_entry *e = manifest_get(m, req[ii].id);
+
+        if (!e)
+            fprintf(stderr, "WARNING: Could not find setting %d in manifest!\n", req[ii].id);
+        else if (!req[ii].set)
+            fprintf(stderr, "  %s\n", manifest_format(m, e, old, sizeof old));
+        else {
+            manifest_format(m, e, old, sizeof old);
+            if (manifest_set(m, req[ii].id, req[ii].value) > 0)
+                fprintf(stderr, "  Changing %s\n        to %s\n", old, manifest_format(m, e, new, sizeof new));
+        }
+    }
+
+    // everything in one write, and none at all if nothing changed
+    if ((changed = manifest_dirty(m)) > 0) {
+        if ((length = manifest_encode(m, &fbuf)) < 0) {
+            changed = -1;
+            goto out;
+        }
+        tt_delete_file(ttd, TTBLUE_FILE_MANIFEST1);
+        if (tt_write_file(ttd, TTBLUE_FILE_MANIFEST1, false, fbuf, length, write_delay) != length) {
+            fprintf(stderr, "WARNING: Could not write settings manifest file 0x%08x to watch!\n", TTBLUE_FILE_MANIFEST1);
+            if (cache)
+                devcache_forget(cache, TTBLUE_FILE_MANIFEST1);
+            changed = -1;
+        } else if (cache)
+            devcache_put(cache, TTBLUE_FILE_MANIFEST1, fbuf, length);
+        free(fbuf);
+    }
+
+out:
+    manifest_free(m);
+    return changed;
+}
+
+/* Sends the watch fresh QuickFix data from url, unless it had some less than a
+ * day ago (or if force is set). Returns the number of bytes sent (0 if not
+ * needed, or if the download failed), or -1 if the watch couldn't take it. */
+static long
+update_quickfix(TTDEV *ttd, const char *url_fmt, bool force, uint32_t write_delay, int debug)
+{
+    time_t last_gqf_update = read_gqf_status(ttd, debug-1);
+    if (!force && time(NULL) - last_gqf_update < 24*3600) {
+        fprintf(stderr, "  No GPS update needed, last was less than %ld hours ago\n", (time(NULL) - last_gqf_update)/3600);
+        return 0;
+    }
+    if (last_gqf_update != -1 && last_gqf_update != 0)
+        fprintf(stderr, "  Last GPS update was at %.24s.\n", ctime(&last_gqf_update));
+    else
+        fprintf(stderr, "  Last GPS update unknown.\n");
+
+    CURLcode res;
+    char curlerr[CURL_ERROR_SIZE];
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        fputs("Could not start curl\n", stderr);
+        return -1;
+    }
+
+    char url[128];
+    FILE *f;
+    sprintf(url, url_fmt, (long)time(NULL));
+    fprintf(stderr, "  Downloading %s\n", url);
+
+    if ((f = tmpfile()) == NULL) {
+        fprintf(stderr, "Could not create temporary file: %s (%d)\n", strerror(errno), errno);
+        curl_easy_cleanup(curl);
+        return -1;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curlerr);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10); // connection phase
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);        // transfer phase
+    res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    if (res != 0) {
+        fprintf(stderr, "WARNING: Download failed: %s\n", curlerr);
+        fclose(f);
+        return 0;
+    }
+
+    int length = ftell(f);
+    fprintf(stderr, "  Sending update to watch (%d bytes)...\n", length);
+    fflush(f);
+    tt_delete_file(ttd, TTBLUE_FILE_GPSQUICKFIX_DATA);
+    int result = tt_write_file_fd(ttd, TTBLUE_FILE_GPSQUICKFIX_DATA, debug, fileno(f), write_delay);
+    fclose(f);
+    if (result < 0) {
+        fputs("Failed to send QuickFixGPS update to watch.\n", stderr);
+        return -1;
+    }
+
+    // official TomTom Android app seems to only issue this
+    // "magic" update command when the GPS is brand new or
+    // after a factory reset, or with 3x --update-gps
+    att_wrreq(&ttd->att, ttd->h->cmd_status, BARRAY(MSG_UPDATE_EPHEMERIS, 0x01, 0x00, 0x01), 4);
+
+    last_gqf_update = read_gqf_status(ttd, debug-1);
+    if (last_gqf_update != -1 && last_gqf_update != 0)
+        fprintf(stderr, "  Last GPS update is now %.24s.\n", ctime(&last_gqf_update));
+    else
+        fprintf(stderr, "  Could not re-read GPS update time.\n");
+    return result;
+}
+
+/* Replaces fileno on the watch with the contents of path. Returns the number
+ * of bytes written, or -1 on failure. */
+static long
+upload_file(TTDEV *ttd, uint32_t fileno, const char *path, uint32_t write_delay, int debug)
+{
+    int ufd = open(path, O_RDONLY|O_CLOEXEC);
+    if (ufd < 0) {
+        fprintf(stderr, "Could not open %s: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+    fprintf(stderr, "Uploading %s to file 0x%08x on watch...\n", path, fileno);
+    term_title("ttblue: Uploading");
+    tt_delete_file(ttd, fileno);
+    int result = tt_write_file_fd(ttd, fileno, debug, ufd, write_delay);
+    close(ufd);
+    if (result < 0) {
+        fprintf(stderr, "Failed to upload %s to watch.\n", path);
+        return -1;
+    }
+    return result;
+}
+
+/****************************************************************************/
+
+void
+session_init(struct session *s, const struct session_opts *o, const struct session_link *link,
+             struct daemon_state *ds, TASKS *tasks, STORE *store, struct notify_queue *nq)
+{
+    *s = (struct session){ .o = o, .link = link, .ds = ds, .tasks = tasks, .store = store, .nq = nq,
+                           .first = true, .time_cmd = o->time_cmd };
+    ds->scan_match = link->scan_match;
+    ds->scan_arg = link->arg;
+}
+
+/* Sleeps until the next sync is due (unless this is the first session, or
+ * one is due right away), then syncs. Returns SESSION_OK or SESSION_FAILED,
+ * or SESSION_FATAL if there's no point in carrying on; either way, all that
+ * the session opened is closed again, except for the adapter. */
+int
+session_run(struct session *s)
+{
+    const struct session_opts *o = s->o;
+    const struct session_link *l = s->link;
+    struct daemon_state *ds = s->ds;
+    TASKS *tasks = s->tasks;
+    STORE *store = s->store;
+    struct notify_queue *nq = s->nq;
+    int debug = o->debug;
+    bool seen = false;          // advertising, while we slept
+    bool notify_only = false;   // woken to deliver notifications, before the next sync is due
+    bool needs_reboot = false;
+    uint32_t write_delay;
+    int fd = -1, protocol_version = 0;
+    char addr[18];
+    TTDEV *ttd = NULL;
+    uint16_t *list = NULL;
+    DEVCACHE *cache = NULL;
+
+    if (!s->first && !s->wake_now) {
+        term_title("ttblue: Sleeping");
+        // after a failure, the watch is probably out of range: scan while
+        // sleeping so that we connect as soon as it shows up again
+        if (!s->success)
+            ds->scan_fd = l->scan_start(l->arg);
+        int woke = daemon_sleep(ds, s->success, s->success || (debug>1));
+        if (woke == DAEMON_WAKE_NOTIFY) {
+            notify_read(nq, NOTIFY_COALESCE_MS);
+            notify_only = s->synced; // after a failure, the sync is overdue anyway
+        }
+        seen = (woke == DAEMON_WAKE_ADVERT);
+        if (ds->scan_fd >= 0 && seen) {
+            l->scan_stop(l->arg);
+            ds->scan_fd = -1;
+        }
+    }
+    s->wake_now = false;
+    term_title("ttblue: Connecting...");
+    ds->state = "connecting";
+    ds->files_done = ds->files_total = 0;
+    struct timeval cycle_start;
+    gettimeofday(&cycle_start, NULL);
+
+    // the adapter stays open between daemon iterations
+    if (l->open(l->arg, s->first) < 0)
+        return SESSION_FATAL;
+
+    // scan for TomTom devices
+    if (o->dev_address)
+        fprintf(stderr, "Scanning for TomTom BLE device %s...\n", o->dev_address);
+    else
+        fprintf(stderr, "Scanning for TomTom BLE devices...\n");
+
+    struct timeval phase_start;
+    gettimeofday(&phase_start, NULL);
+    int scanned = 0;
+    if (seen)
+        ; // it woke us up
+    else if (o->daemonize) {
+        // in the event loop, which keeps serving the control socket, children and notifications
+        int woke = DAEMON_WAKE_ERROR;
+        if (ds->scan_fd >= 0 || (ds->scan_fd = l->scan_start(l->arg)) >= 0) {
+            while ((woke = daemon_scan(ds)) == DAEMON_WAKE_NOTIFY)
+                notify_read(nq, NOTIFY_COALESCE_MS);
+            int saved = errno;
+            l->scan_stop(l->arg);
+            ds->scan_fd = -1;
+            errno = saved;
+        }
+        fputc('\n', stderr);
+        scanned = (woke == DAEMON_WAKE_ADVERT) ? 0 : -1;
+    } else
+        scanned = l->scan(l->arg);
+    if (scanned < 0) {
+        if (errno==EPERM)
+            fputs(PLEASE_SETCAP_ME, stderr);
+        else
+            fprintf(stderr, "BLE scan failed: %s (%d)\n", strerror(errno), errno);
+        return SESSION_FATAL;
+    }
+
+    ds->last_scan_secs = elapsed_secs(&phase_start);
+    if (notify_only && !ds->timer_armed)
+        notify_only = false; // the sync came due while we were scanning
+
+    // create L2CAP socket connected to watch
+    gettimeofday(&phase_start, NULL);
+    fd = l->connect(l->arg, &protocol_version, addr, debug>1);
+    ds->last_connect_secs = elapsed_secs(&phase_start);
+    tasks_begin(tasks); // the watch may not stay in range for long
+    if (fd < 0) {
+        if (errno!=ENOTCONN || debug>1)
+            fprintf(stderr, "Failed to connect: %s (%d)\n", strerror(errno), errno);
+        goto fail_connect;
+    }
+
+    // initialize device
+    ttd = tt_device_init(protocol_version, fd);
+    if (!ttd)
+        goto fatal;
+    if (o->batched && att_rx_batched(&ttd->att, true) < 0)
+        fprintf(stderr, "Could not batch receives, falling back to blocking I/O.\n");
+    if (s->capture && att_trace_start(&ttd->att, s->capture) < 0)
+        fprintf(stderr, "Could not record session to %s.\n", o->capture_path);
+    if (o->daemonize)
+        tt_set_progress(ttd, daemon_progress, ds);
+
+    gettimeofday(&phase_start, NULL);
+
+    time_t now = time(NULL);
+    fprintf(stderr, "Connected to v%d device at %.24s.\n", ttd->protocol_version, ctime(&now));
+
+    // connection parameters, and how fast the watch can take packets
+    struct le_link link = {0};
+    int delay = l->tune(l->arg, ttd, &link, s->first);
+    if (delay == -2)
+        goto fatal;
+    else if (delay < 0)
+        goto fail;
+    write_delay = delay;
+    if (debug > 1)
+        fprintf(stderr, "Link: interval=%d (x1.25 ms), latency=%d, timeout=%d (x10 ms), data_len=%d, phy=%s/%s\n",
+                link.interval, link.latency, link.timeout, link.data_len, le_phy_name(link.tx_phy), le_phy_name(link.rx_phy));
+    ds->link = link;
+
+    // check that it's actually a TomTom device with compatible firmware version
+    struct ble_dev_info *info = tt_check_device_version(ttd, s->first);
+    if (!info) {
+        if (s->first) goto fatal; else goto fail;
+    }
+    const char *firmware = NULL;
+    for (struct ble_dev_info *p = info; p->handle; p++)
+        if (!strcmp(p->name, "firmware"))
+            firmware = p->buf;
+
+    // show device identifiers if --version
+    if (o->version && s->first) {
+        for (struct ble_dev_info *p = info; p->handle; p++)
+            fprintf(stderr, "  %-10.10s: %s\n", p->name, p->buf);
+    }
+
+    // prompt for pairing code
+    if (o->new_pair) {
+        fputs(PAIRING_CODE_PROMPT, stderr);
+        fgets(s->dev_code, 7, stdin);
+    }
+
+    // authorize with the device
+    if (tt_authorize(ttd, s->dev_code, o->new_pair) < 0) {
+        fprintf(stderr, "Device didn't accept pairing code %s.\n", s->dev_code);
+        if (s->first) goto fatal; else goto fail;
+    }
+
+    ds->last_setup_secs = elapsed_secs(&phase_start);
+    if (debug > 1)
+        fprintf(stderr, "Scan took %.3f s, connection %.3f s, link setup and authorization %.3f s.\n",
+                ds->last_scan_secs, ds->last_connect_secs, ds->last_setup_secs);
+    if (ds->last_scan_secs + ds->last_connect_secs + ds->last_setup_secs > ds->max_connect_path_secs)
+        ds->max_connect_path_secs = ds->last_scan_secs + ds->last_connect_secs + ds->last_setup_secs;
+
+    term_title("ttblue: Connected");
+    ds->state = notify_only ? "notifying" : "syncing";
+
+    // set timeout to 20 seconds (delete and write operations can be slow)
+    struct timeval to = {.tv_sec=20, .tv_usec=0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
+
+    // whatever was queued while we weren't connected goes first; if it
+    // doesn't get through, it waits for the next connection
+    if (nq->fd >= 0 && notify_read(nq, 0) > 0)
+        push_notifications(ttd, nq, ds, write_delay, debug);
+    if (notify_only)
+        goto connected; // that's all this connection was for
+
+    // transfer files
+    uint8_t *fbuf;
+    int length;
+
+    // remembers what's on this watch, so that unchanged files and settings needn't be rewritten
+    if (o->cache_dir)
+        cache = devcache_open(o->cache_dir, addr);
+
+    // a new pairing may come after a reset, which would make the cache wrong
+    bool force = o->force_write || o->new_pair;
+
+    // the regular work of every session, unless it's still queued from the last one
+    tasks_add(tasks, TASK_HOSTNAME, 0, 0);
+    if (o->set_time)
+        tasks_add(tasks, TASK_TIME, 0, 0);
+    if (o->n_settings)
+        tasks_add(tasks, TASK_SETTINGS, 0, 0);
+    if (o->get_activities)
+        tasks_add(tasks, TASK_LIST, 0, 0);
+    if (o->get_tracking)
+        tasks_add(tasks, TASK_TRACKING, 0, 0);
+    if (o->update_gps)
+        tasks_add(tasks, TASK_GPS, 0, 0);
+
+    int n_read = 0;
+    for (struct task t;;) {
+        bool more = tasks_next(tasks, &t);
+        if (o->daemonize)
+            daemon_ctl_poll(ds);
+
+        // checkpoint: activities are only deleted from the watch once they're safely on disk
+        if (store && store->n && (store->n == store->batch || !more || t.kind != TASK_ACTIVITY)) {
+            if (store_commit(store, 4, true) < 0)
+                goto fail;
+
+            for (int jj=0; jj<store->n; jj++) {
+                const char *filename = store->staged[jj].path;
+
+                if (o->postproc) {
+                    fprintf(stderr, "    Postprocessing %s with %s ...\n", filename, o->postproc);
+                    fflush(stderr);
+
+                    if (daemon_spawn(ds, o->postproc, filename) < 0)
+                        goto fatal;
+                }
+                if (tasks_add(tasks, TASK_DELETE, store->staged[jj].fileno, 0) < 0)
+                    goto fail;
+            }
+            store_release(store);
+            continue; // the deletes come first
+        }
+        if (!more)
+            break;
+
+        if (debug > 1)
+            fprintf(stderr, "Next task: %s, estimated %.1f s, %.1f s left.\n",
+                    task_name(t.kind), tasks_estimate(tasks, &t), tasks_left(tasks));
+        struct timeval task_start;
+        long moved = ds->bytes_read + ds->bytes_written;
+        gettimeofday(&task_start, NULL);
+
+        switch (t.kind) {
+        case TASK_HOSTNAME:
+            fprintf(stderr, "Setting PHONE menu to '%s'.\n", o->hostname);
+            // Write name to two files as V1 and V2 devices seem to use different files
+            if (sync_small_file(ttd, cache, TTBLUE_FILE_HOSTNAME1, (uint8_t*)o->hostname, strlen(o->hostname), force, write_delay, debug) > 0)
+                ds->bytes_written += strlen(o->hostname);
+            if (sync_small_file(ttd, cache, TTBLUE_FILE_HOSTNAME2, (uint8_t*)o->hostname, strlen(o->hostname), force, write_delay, debug) > 0)
+                ds->bytes_written += strlen(o->hostname);
+            break;
+
+        case TASK_TIME: {
+            time_t now = time(NULL);
+            struct tm *lt = localtime(&now);
+
+            if (s->time_cmd) {
+                // one small command, if asked for and the firmware takes it
+                if (tt_set_time(ttd, now, lt->tm_gmtoff) == 0)
+                    fprintf(stderr, "Set watch clock to UTC%+ld.\n", lt->tm_gmtoff);
+                else {
+                    if (debug > 1)
+                        fprintf(stderr, "Watch can't set its clock directly; will edit its settings manifest.\n");
+                    s->time_cmd = false; // don't ask again (a session only ever talks to one watch)
+                }
+            }
+            if (!s->time_cmd)
+                tasks_add(tasks, TASK_SETTINGS, 0, 0);
+            break;
+        }
+
+        case TASK_SETTINGS: {
+            struct setting_req req[o->n_settings+1];
+            int n_req = o->n_settings;
+            memcpy(req, o->settings, o->n_settings * sizeof *req);
+
+            if (o->set_time && !s->time_cmd) {
+                time_t now = time(NULL);
+                req[n_req++] = (struct setting_req){ MANIFEST_UTC_OFFSET, true, (uint32_t)localtime(&now)->tm_gmtoff };
+            }
+
+            // the watch only reads its manifest at startup
+            if (n_req && sync_settings(ttd, cache, firmware, req, n_req, write_delay, debug) > 0)
+                needs_reboot = true;
+            break;
+        }
+
+        case TASK_LIST: {
+            int n_files = tt_list_sub_files(ttd, TTBLUE_FILE_TTBIN_DATA, &list);
+
+            if (n_files < 0) {
+                fprintf(stderr, "Could not list activity files on watch!\n");
+                goto fail;
+            }
+            fprintf(stderr, "Found %d activity files on watch.\n", n_files);
+
+            // what's on the watch now replaces whatever was left from the last
+            // session, except for files which are in the store and only need deleting
+            tasks_drop(tasks, TASK_ACTIVITY);
+            for (int ii=0; ii<n_files; ii++) {
+                uint32_t fileno = TTBLUE_FILE_TTBIN_DATA + list[ii];
+                if (!tasks_queued(tasks, TASK_DELETE, fileno) && tasks_add(tasks, TASK_ACTIVITY, fileno, 0) < 0)
+                    goto fail;
+            }
+            ds->files_total = n_files;
+            tt_free(ttd, list);
+            list = NULL;
+            break;
+        }
+
+        case TASK_ACTIVITY:
+            fprintf(stderr, "  Reading activity file 0x%08X ...\n", t.fileno);
+            term_title("ttblue: Transferring activity %d/%d", ++n_read, ds->files_total);
+            if ((length = tt_read_file(ttd, t.fileno, debug, &fbuf)) < 0) {
+                fprintf(stderr, "Could not read activity file 0x%08X from watch!\n", t.fileno);
+                tasks_drop(tasks, TASK_ACTIVITY); // list them again next time, in case it's gone
+                goto fail;
+            }
+
+            ds->files_read++;
+            ds->bytes_read += length;
+            char name[TT_FILENAME_MAX];
+            if (store_stage(store, t.fileno, make_tt_filename(name, sizeof name, t.fileno, "ttbin"), fbuf, length, 4, debug>1) < 0)
+                goto fail;
+            break;
+
+        case TASK_DELETE:
+            fprintf(stderr, "    Deleting activity file 0x%08X ...\n", t.fileno);
+            tt_delete_file(ttd, t.fileno);
+            ds->files_done++;
+            break;
+
+        case TASK_TRACKING: {
+            fputs("Copying new tracking data from watch...\n", stderr);
+            term_title("ttblue: Copying tracking data");
+            long bytes = tracking_sync(ttd, cache, o->activity_store, debug);
+            if (bytes < 0)
+                goto fail;
+            ds->bytes_read += bytes;
+            break;
+        }
+
+        case TASK_GPS: {
+            fputs("Updating QuickFixGPS...\n", stderr);
+            term_title("ttblue: Updating QuickFixGPS");
+            long bytes = update_quickfix(ttd, o->gqf_url, o->update_gps > 1, write_delay, debug);
+            if (bytes < 0)
+                goto fail;
+            ds->bytes_written += bytes;
+            break;
+        }
+
+        case TASK_LS:
+            list_files(ttd);
+            break;
+
+        case TASK_GET: {
+            fprintf(stderr, "Copying file tree 0x%08x from watch...\n", t.fileno);
+            term_title("ttblue: Copying files");
+            long bytes = get_files(ttd, store, t.fileno, debug);
+            if (bytes < 0)
+                goto fail;
+            ds->bytes_read += bytes;
+            if (store->n && store_commit(store, 4, true) < 0)
+                goto fail;
+            store_release(store);
+            break;
+        }
+
+        case TASK_RM:
+            fprintf(stderr, "Deleting file 0x%08x from watch...\n", t.fileno);
+            if (tt_delete_file(ttd, t.fileno) < 0)
+                fprintf(stderr, "WARNING: Could not delete file 0x%08x.\n", t.fileno);
+            break;
+
+        case TASK_UPLOAD: {
+            long bytes = upload_file(ttd, t.fileno, o->upload_path, write_delay, debug);
+            if (bytes < 0)
+                goto fail;
+            ds->bytes_written += bytes;
+            break;
+        }
+        }
+
+        tasks_done(tasks, &t, ds->bytes_read + ds->bytes_written - moved, elapsed_secs(&task_start));
+    }
+
+    ds->tasks_deferred = tasks_end(tasks, debug > 0);
+    ds->rx_rate = tasks->rx_rate;
+    ds->tx_rate = tasks->tx_rate;
+    s->success = s->synced = true;
+    daemon_cycle_done(ds, true, elapsed_secs(&cycle_start));
+connected:
+    if (needs_reboot) {
+        fprintf(stderr, "Rebooting watch...\n");
+        fprintf(stderr, "WARNING: this may not work with some devices\n");
+        tt_reboot(ttd);
+    } else if (nq->fd >= 0) {
+        // stay connected, so that notifications reach the watch without a reconnect
+        int reason;
+        term_title("ttblue: Connected");
+        ds->link_fd = fd;
+        while ((reason = daemon_sleep(ds, true, debug>1)) == DAEMON_WAKE_NOTIFY) {
+            notify_read(nq, NOTIFY_COALESCE_MS);
+            if (push_notifications(ttd, nq, ds, write_delay, debug) < 0)
+                break;
+        }
+        ds->link_fd = -1;
+        if (reason == DAEMON_WAKE_TIMER || reason == DAEMON_WAKE_REQUEST)
+            s->wake_now = true; // time for the next sync, on a fresh connection
+        else if (!notify_only)
+            s->success = false; // lost the watch: look out for it again
+    }
+    if (ds->tasks_deferred && !s->wake_now)
+        s->success = s->synced = false; // not done yet: reconnect as soon as the watch shows up
+    s->first = false;
+    l2cap_le_att_close(ttd, fd, ds, debug>1);
+    devcache_close(cache);
+    return SESSION_OK;
+
+fail:
+    if (store)
+        store_abort(store);
+    devcache_close(cache);
+    tt_free(ttd, list);
+    if (!notify_only)
+        ds->tasks_deferred = tasks_end(tasks, debug > 1);
+fail_connect:
+    if (fd >= 0)
+        l2cap_le_att_close(ttd, fd, ds, debug>1);
+    l->reset(l->arg); // reopen in case the adapter was reset
+    if (notify_only) {
+        // the last sync stands; the notifications wait for the next connection
+        fprintf(stderr, "Could not deliver notifications; they will wait for the next connection.\n");
+        return SESSION_OK;
+    }
+    s->success = s->synced = false;
+    daemon_cycle_done(ds, false, elapsed_secs(&cycle_start));
+    fprintf(stderr, "Communication with watch failed...\n");
+    return SESSION_FAILED;
+
+fatal:
+    if (ttd)
+        tt_free(ttd, list);
+    devcache_close(cache);
+    if (fd >= 0)
+        l2cap_le_att_close(ttd, fd, ds, debug>1);
+    return SESSION_FATAL;
+}
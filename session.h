@@ -0,0 +1,87 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ttops.h"
+#include "hcilink.h"
+#include "daemon.h"
+#include "notify.h"
+#include "store.h"
+#include "tasks.h"
+
+/**
+ * One session with the watch, exactly as the daemon runs it over and over
+ * (and the command line runs it once): sleep until the next sync is due,
+ * scan, connect, set up the link, authorize, work through the task queue
+ * with store checkpoints, and tear everything down again, whether it
+ * worked or not.
+ *
+ * The radio is reached through a struct session_link, which btlink.c
+ * provides over a Bluetooth adapter: a real one, or the emulated controller
+ * in fakehci.c, on which the load generator and soak test (sim.c) run this
+ * same code.
+ */
+
+/* How the session reaches the watch */
+struct session_link {
+    void *arg;
+    int (*open)(void *arg, bool first);     // the adapter, unless it's open already; <0 is fatal
+    int (*scan_start)(void *arg);           // returns an fd to wait on for advertisements, or <0
+    int (*scan_match)(void *arg);           // consumes one event: >0 if it's our watch, <0 on error
+    void (*scan_stop)(void *arg);
+    int (*scan)(void *arg);                 // blocks until the watch advertises, outside the daemon
+    int (*connect)(void *arg, int *protocol_version, char addr[18], int verbose); // the ATT socket, and which watch it is
+    int (*tune)(void *arg, TTDEV *d, struct le_link *link, bool first); // write delay in us, -1 to fail, -2 if fatal
+    void (*reset)(void *arg);               // after a failure, in case the adapter was reset
+};
+
+/* A --setting: get (or, if set, change) one entry of the settings manifest */
+struct setting_req { uint16_t id; bool set; uint32_t value; };
+
+/* parent file IDs whose sub-files can be enumerated with tt_list_sub_files */
+struct tt_file_kind { uint32_t fileno; const char *name, *ext; };
+extern const struct tt_file_kind known_files[];
+
+/* What every session does, from the command line */
+struct session_opts {
+    int debug;
+    bool daemonize, new_pair, version, force_write, batched;
+    bool get_activities, get_tracking, set_time, time_cmd;
+    int update_gps;                         // more than once forces the update
+    const char *dev_address;                // the watch, or NULL for any TomTom
+    const char *hostname;                   // for the PHONE menu
+    const char *activity_store, *gqf_url, *postproc, *cache_dir, *upload_path, *capture_path;
+    const struct setting_req *settings;
+    int n_settings;
+};
+
+struct session {
+    const struct session_opts *o;
+    const struct session_link *link;
+    struct daemon_state *ds;
+    TASKS *tasks;
+    STORE *store;                           // or NULL
+    struct notify_queue *nq;
+    FILE *capture;                          // or NULL
+
+    // carried from one session to the next
+    bool first;                             // no session has worked yet
+    bool success;                           // the last one did
+    bool synced;                            // the last sync did, even if the watch was lost after it
+    bool wake_now;                          // the next one is due right away
+    bool time_cmd;                          // the watch may take MSG_SET_TIME
+    char dev_code[7];
+};
+
+enum { SESSION_OK, SESSION_FAILED, SESSION_FATAL };
+
+extern const char *PLEASE_SETCAP_ME;
+
+void session_init(struct session *s, const struct session_opts *o, const struct session_link *link,
+                  struct daemon_state *ds, TASKS *tasks, STORE *store, struct notify_queue *nq);
+int session_run(struct session *s);
+
+#endif /* __SESSION_H__ */
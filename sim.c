@@ -0,0 +1,1068 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "bbatt.h"
+#include "ttops.h"
+#include "ttblue.h"
+#include "util.h"
+#include "store.h"
+#include "daemon.h"
+#include "manifest.h"
+#include "notify.h"
+#include "tasks.h"
+#include "session.h"
+#include "btlink.h"
+#include "fakehci.h"
+#include "sim.h"
+
+#define SIM_CODE "123456"
+#define SIM_EVENT_NS 7500000ULL // connection interval: the watch's notifications go out in bursts this far apart
+#define SIM_OTHER_FILES 8
+#define SIM_MAX_WRITE (1<<20)
+
+/* where the watch can make a connection fail (see sim_params.failure); the
+ * emulated controller has stages of its own (see fakehci.h) */
+enum { SIM_OK, SIM_FAIL_CONNECT, SIM_FAIL_INFO, SIM_FAIL_AUTH, SIM_FAIL_LIST, SIM_FAIL_READ, SIM_FAIL_DELETE, SIM_STAGES };
+
+/* Shares out the failures, so that every stage is as likely as any other */
+static int
+peer_failure(const struct sim_params *p)
+{
+    return p->failure * (SIM_STAGES-1) / (SIM_STAGES-1 + FAKEHCI_STAGES-1);
+}
+
+static int
+controller_failure(const struct sim_params *p)
+{
+    return p->failure - peer_failure(p);
+}
+
+/****************************************************************************/
+/* The watches, in the child process */
+
+struct sim_watch {
+    int id, protocol_version;
+    const struct tt_handles *h;
+    const struct ble_dev_info *info;
+    const struct sim_params *p;
+    bdaddr_t addr;
+    int ctl;                    // advertisements go out, connections come in
+    uint16_t *files;            // activities still on the watch
+    int nfiles;
+    uint16_t next_id;
+    int fail;                   // for this connection
+    const uint8_t *data;        // what each of them contains
+    struct sim_file { uint32_t fileno; uint8_t *buf; int length; } other[SIM_OTHER_FILES];
+    int nother;                 // files the host has written, and the settings manifest
+    unsigned seed;
+    uint64_t due_ns;            // when the link will have sent everything so far
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int
+peer_notify(int fd, uint16_t handle, const void *buf, int length)
+{
+    uint8_t pdu[ATT_RX_SLOT] = { BT_ATT_OP_HANDLE_VAL_NOT, handle & 0xff, handle >> 8 };
+    memcpy(pdu+3, buf, length);
+    return send(fd, pdu, 3+length, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int
+peer_notify32(int fd, uint16_t handle, uint32_t val)
+{
+    val = htobl(val);
+    return peer_notify(fd, handle, &val, sizeof val);
+}
+
+/* Holds the watch's notifications to the link speed, one connection event's worth at a time */
+static void
+peer_pace(struct sim_watch *w, int bytes)
+{
+    if (!w->p->rate)
+        return;
+
+    uint64_t now = now_ns();
+    if (w->due_ns < now)
+        w->due_ns = now; // time the link spent idle isn't saved up
+    w->due_ns += bytes * 1000000000ULL / w->p->rate;
+    if (w->due_ns - now >= SIM_EVENT_NS) {
+        struct timespec due = { w->due_ns/1000000000, w->due_ns%1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            ;
+    }
+}
+
+static inline uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+    return p+4;
+}
+
+static inline uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v; p[1] = v>>8;
+    return p+2;
+}
+
+static inline uint8_t *
+putf(uint8_t *p, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, 4);
+    return put32(p, v);
+}
+
+/* Device information, as tt_check_device_version reads it, and the PPCP */
+static int
+peer_read(struct sim_watch *w, int fd, uint16_t handle)
+{
+    uint8_t rsp[BT_ATT_DEFAULT_LE_MTU] = { BT_ATT_OP_READ_RSP };
+    char *value = (char *)rsp+1;
+    const char *name = NULL;
+
+    if (w->fail == SIM_FAIL_INFO)
+        return -1;
+    if (handle && handle == w->h->ppcp) {
+        // Preferred Peripheral Connection Parameters: 7.5 ms, no latency, 2 s timeout
+        uint8_t *p = rsp+1;
+        p = put16(p, 6);
+        p = put16(p, 6);
+        p = put16(p, 0);
+        p = put16(p, 200);
+        return send(fd, rsp, p-rsp, MSG_NOSIGNAL) < 0 ? -1 : 0;
+    }
+    for (const struct ble_dev_info *p = w->info; p->handle; p++)
+        if (p->handle == handle)
+            name = p->name;
+    if (!name) {
+        uint8_t err[] = { BT_ATT_OP_ERROR_RSP, BT_ATT_OP_READ_REQ, handle & 0xff, handle >> 8, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND };
+        return send(fd, err, sizeof err, MSG_NOSIGNAL) < 0 ? -1 : 0;
+    }
+
+    if (!strcmp(name, "maker"))
+        strcpy(value, "TomTom Fitness");
+    else if (!strcmp(name, "serial"))
+        sprintf(value, "SIM%05d", w->id);
+    else if (!strcmp(name, "model_name"))
+        strcpy(value, w->protocol_version == 1 ? "Runner" : "Spark");
+    else if (!strcmp(name, "model_num"))
+        strcpy(value, w->protocol_version == 1 ? "1001" : "2005");
+    else if (!strcmp(name, "firmware"))
+        strcpy(value, w->protocol_version == 1 ? "1.8.42" : "1.7.64");
+    else
+        strcpy(value, "0");
+    return send(fd, rsp, 1+strlen(value), MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int
+peer_find(struct sim_watch *w, uint32_t fileno)
+{
+    if ((fileno & 0xffff0000) != TTBLUE_FILE_TTBIN_DATA)
+        return -1;
+    for (int ii=0; ii<w->nfiles; ii++)
+        if (w->files[ii] == (fileno & 0xffff))
+            return ii;
+    return -1;
+}
+
+static int
+peer_expect_ack(struct sim_watch *w, int fd, uint32_t counter)
+{
+    uint8_t pdu[ATT_RX_SLOT];
+    uint32_t ack;
+
+    int len = recv(fd, pdu, sizeof pdu, 0);
+    if (len != 3+4 || pdu[0] != BT_ATT_OP_WRITE_CMD || (pdu[1] | (pdu[2]<<8)) != w->h->check)
+        return -1;
+    memcpy(&ack, pdu+3, 4);
+    return btohl(ack) == counter ? 0 : -1;
+}
+
+static struct sim_file *
+peer_other(struct sim_watch *w, uint32_t fileno)
+{
+    for (int ii=0; ii<w->nother; ii++)
+        if (w->other[ii].fileno == fileno)
+            return &w->other[ii];
+    return NULL;
+}
+
+/* Keeps buf (which it takes over) as fileno, replacing whatever was there */
+static int
+peer_keep(struct sim_watch *w, uint32_t fileno, uint8_t *buf, int length)
+{
+    struct sim_file *f = peer_other(w, fileno);
+
+    if (!f && w->nother == SIM_OTHER_FILES) {
+        free(buf);
+        return -1;
+    } else if (!f)
+        f = &w->other[w->nother++];
+    else
+        free(f->buf);
+    *f = (struct sim_file){ fileno, buf, length };
+    return 0;
+}
+
+static void
+peer_forget(struct sim_watch *w, uint32_t fileno)
+{
+    struct sim_file *f = peer_other(w, fileno);
+    if (f) {
+        free(f->buf);
+        *f = w->other[--w->nother];
+    }
+}
+
+/* Sends the file in blocks, each followed by its CRC and acknowledged by the host.
+ * Returns <0 if the link is gone, including when it's dropped on purpose. */
+static int
+peer_read_file(struct sim_watch *w, int fd, uint32_t fileno)
+{
+    const struct tt_handles *h = w->h;
+    const uint8_t *data = w->data;
+    int length = w->p->file_size;
+    uint8_t block[TT_BLOCK_LEN+2];
+    struct sim_file *f;
+
+    if ((f = peer_other(w, fileno)) != NULL) {
+        data = f->buf;
+        length = f->length;
+    } else if (peer_find(w, fileno) < 0)
+        return peer_notify32(fd, h->cmd_status, 0);
+
+    // the watch going out of range, somewhere in the middle
+    int drop_at = (w->fail == SIM_FAIL_READ) ? rand_r(&w->seed) % (length+1) : -1;
+
+    if (peer_notify32(fd, h->cmd_status, 1) < 0 || peer_notify32(fd, h->length, length) < 0)
+        return -1;
+    for (int off=0, counter=1; off < length; off += TT_BLOCK_LEN, counter++) {
+        int blen = (length-off < TT_BLOCK_LEN) ? length-off : TT_BLOCK_LEN;
+        uint16_t crc = crc16(data+off, blen, 0xffff);
+
+        memcpy(block, data+off, blen);
+        block[blen] = crc & 0xff;
+        block[blen+1] = crc >> 8;
+        for (int o=0; o < blen+2; o += 20) {
+            int plen = (blen+2-o < 20) ? blen+2-o : 20;
+            if (drop_at >= 0 && off+o >= drop_at)
+                return -1;
+            peer_pace(w, plen);
+            if (peer_notify(fd, h->transfer, block+o, plen) < 0)
+                return -1;
+        }
+        if (peer_expect_ack(w, fd, counter) < 0)
+            return -1;
+    }
+    return peer_notify32(fd, h->cmd_status, 0);
+}
+
+/* Takes a file from the host, block by block, each checked against its CRC
+ * and acknowledged. Writing file 0 is how tt_reboot restarts a v1 watch. */
+static int
+peer_write_file(struct sim_watch *w, int fd, uint32_t fileno)
+{
+    const struct tt_handles *h = w->h;
+    uint8_t pdu[ATT_RX_SLOT], block[TT_BLOCK_LEN+2];
+    uint32_t length;
+    uint8_t *buf;
+
+    if (fileno == TTBLUE_FILE_BRIDGEHEAD)
+        return -1;
+    if (peer_notify32(fd, h->cmd_status, 1) < 0)
+        return -1;
+    int len = recv(fd, pdu, sizeof pdu, 0);
+    if (len != 3+4 || pdu[0] != BT_ATT_OP_WRITE_CMD || (pdu[1] | (pdu[2]<<8)) != h->length)
+        return -1;
+    memcpy(&length, pdu+3, 4);
+    length = btohl(length);
+    if (length > SIM_MAX_WRITE || !(buf = malloc(length + 1)))
+        return -1;
+
+    for (uint32_t off=0, counter=1; off < length; off += TT_BLOCK_LEN, counter++) {
+        int blen = (length-off < TT_BLOCK_LEN) ? length-off : TT_BLOCK_LEN;
+        for (int got=0; got < blen+2; got += len-3) {
+            len = recv(fd, pdu, sizeof pdu, 0);
+            if (len < 3 || pdu[0] != BT_ATT_OP_WRITE_CMD || (pdu[1] | (pdu[2]<<8)) != h->transfer || got+len-3 > blen+2)
+                goto fail;
+            memcpy(block+got, pdu+3, len-3);
+        }
+        if (crc16(block, blen+2, 0xffff) != 0 || peer_notify32(fd, h->check, counter) < 0)
+            goto fail;
+        memcpy(buf+off, block, blen);
+    }
+    if (peer_keep(w, fileno, buf, length) < 0)
+        return -1;
+    return peer_notify32(fd, h->cmd_status, 0);
+
+fail:
+    free(buf);
+    return -1;
+}
+
+static int
+peer_list_files(struct sim_watch *w, int fd, uint32_t fileno)
+{
+    int n = (fileno == TTBLUE_FILE_TTBIN_DATA) ? w->nfiles : 0;
+    uint16_t list[1+n];
+
+    list[0] = htobs(n);
+    for (int ii=0; ii<n; ii++)
+        list[1+ii] = htobs(w->files[ii]);
+
+    if (peer_notify32(fd, w->h->cmd_status, 1) < 0)
+        return -1;
+    for (int o=0; o < sizeof list; o += 20)
+        if (peer_notify(fd, w->h->transfer, (uint8_t *)list+o, (sizeof list-o < 20) ? sizeof list-o : 20) < 0)
+            return -1;
+    return peer_notify32(fd, w->h->cmd_status, 0);
+}
+
+static int
+peer_command(struct sim_watch *w, int fd, uint8_t cmd, uint32_t fileno)
+{
+    int ii;
+
+    switch (cmd) {
+    case MSG_READ:
+        return peer_read_file(w, fd, fileno);
+    case MSG_LIST_FILES:
+        return (w->fail == SIM_FAIL_LIST) ? -1 : peer_list_files(w, fd, fileno);
+    case MSG_WRITE:
+        return peer_write_file(w, fd, fileno);
+    case MSG_DELETE:
+        if (w->fail == SIM_FAIL_DELETE)
+            return -1;
+        if ((ii = peer_find(w, fileno)) >= 0)
+            w->files[ii] = w->files[--w->nfiles];
+        peer_forget(w, fileno);
+        if (peer_notify32(fd, w->h->cmd_status, 1) < 0)
+            return -1;
+        return peer_notify32(fd, w->h->cmd_status, 0);
+    case MSG_RESET_DEVICE:
+        return -1; // the watch restarts, dropping the link
+    default:
+        // nothing else is simulated
+        return peer_notify32(fd, w->h->cmd_status, 0);
+    }
+}
+
+/* One connection, until the host hangs up or the link drops */
+static void
+peer_serve(struct sim_watch *w, int fd)
+{
+    uint8_t pdu[ATT_RX_SLOT];
+    int len;
+
+    while ((len = recv(fd, pdu, sizeof pdu, 0)) > 0) {
+        uint16_t handle = (len >= 3) ? pdu[1] | (pdu[2]<<8) : 0;
+        int result = 0;
+
+        switch (pdu[0]) {
+        case BT_ATT_OP_READ_REQ:
+            result = peer_read(w, fd, handle);
+            break;
+        case BT_ATT_OP_WRITE_REQ:
+            result = send(fd, BARRAY(BT_ATT_OP_WRITE_RSP), 1, MSG_NOSIGNAL);
+            if (result < 0)
+                break;
+            else if (handle == w->h->passcode && len == 3+4) {
+                uint32_t code;
+                memcpy(&code, pdu+3, 4);
+                result = peer_notify(fd, handle, BARRAY(btohl(code) == atoi(SIM_CODE) && w->fail != SIM_FAIL_AUTH), 1);
+            } else if (handle == w->h->cmd_status && len == 3+4)
+                result = peer_command(w, fd, pdu[3], (pdu[4]<<16) | pdu[5] | (pdu[6]<<8));
+            break;
+        }
+        if (result < 0)
+            return;
+    }
+}
+
+/* New activities, recorded since the last sync */
+static void
+peer_refill(struct sim_watch *w)
+{
+    for (w->nfiles = 0; w->nfiles < w->p->backlog; w->nfiles++)
+        w->files[w->nfiles] = w->next_id++;
+}
+
+/* Advertises until the host connects, and again after each connection,
+ * until the host hangs up for good */
+static void *
+peer_thread(void *arg)
+{
+    struct sim_watch *w = arg;
+
+    for (;;) {
+        struct pollfd pfd = { w->ctl, POLLIN };
+        int r = poll(&pfd, 1, w->p->advert_ms + rand_r(&w->seed) % 10); // plus advDelay, as in the spec
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r < 0)
+            break;
+        else if (r == 0) {
+            fakehci_advertise(w->ctl, &w->addr, w->protocol_version == 1);
+            continue;
+        }
+
+        int fd = fakehci_accept(w->ctl);
+        if (fd < 0)
+            break;
+        if (!w->nfiles)
+            peer_refill(w);
+        w->fail = (rand_r(&w->seed) % 100 < peer_failure(w->p)) ? 1 + rand_r(&w->seed) % (SIM_STAGES-1) : SIM_OK;
+        if (w->fail != SIM_FAIL_CONNECT)
+            peer_serve(w, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Fills buf with something like a real activity file, so that it compresses
+ * like one: a run, with a GPS fix and a heart rate record every second.
+ * The last record is cut short wherever size runs out. */
+static void
+sim_ttbin(uint8_t *buf, int size, unsigned seed)
+{
+    static const int dlat[4] = { 1, 0, -1, 0 }, dlon[4] = { 0, 1, 0, -1 };
+    const uint32_t start = 1438418176;  // local time
+    const int32_t utc_offset = 7200;
+    uint8_t rec[160], *p = rec;
+    int32_t lat = 523700000, lon = 49000000; // 1e-7 degrees
+    float distance = 0;
+    int hr = 120, speed = 300;          // bpm, cm/s
+
+    // file header, with the length of each kind of record to follow
+    *p++ = 0x20;
+    p = put16(p, 7);
+    *p++ = 1; *p++ = 8; *p++ = 42;
+    p = put16(p, 1001);
+    p = put32(p, start);
+    memset(p, 0, 16+80);                // software and GPS firmware versions
+    p += 16+80;
+    p = put32(p, start);
+    p = put32(p, utc_offset);
+    *p++ = 0;
+    *p++ = 3;
+    *p++ = 0x21; p = put16(p, 7);
+    *p++ = 0x22; p = put16(p, 28);
+    *p++ = 0x25; p = put16(p, 7);
+    // status: running
+    *p++ = 0x21; *p++ = 3; *p++ = 0; p = put32(p, start);
+
+    for (int off=0, t=0; off < size; t++) {
+        int len = p - rec;
+        memcpy(buf+off, rec, (size-off < len) ? size-off : len);
+        off += len;
+
+        // a lap of the block every four minutes
+        int d = (t/60) % 4;
+        speed += (int)(rand_r(&seed) % 21) - 10;
+        speed = speed < 200 ? 200 : speed > 450 ? 450 : speed;
+        lat += dlat[d] * speed * 898 / 1000;
+        lon += dlon[d] * speed * 1460 / 1000;
+        distance += speed / 100.0f;
+        hr += (int)(rand_r(&seed) % 5) - 2 + (hr < 150);
+        hr = hr > 185 ? 185 : hr;
+
+        p = rec;
+        *p++ = 0x22;
+        p = put32(p, lat);
+        p = put32(p, lon);
+        p = put16(p, d * 9000);
+        p = put16(p, speed);
+        p = put32(p, start - utc_offset + t);
+        p = put16(p, t/10);
+        p = putf(p, speed / 100.0f);
+        p = putf(p, distance);
+        *p++ = 2 + (rand_r(&seed) & 1);
+
+        *p++ = 0x25;
+        *p++ = hr;
+        *p++ = 0;
+        p = put32(p, start + t);
+    }
+}
+
+/* A settings manifest with just the time zone in it, at UTC */
+static int
+peer_manifest(struct sim_watch *w)
+{
+    uint8_t *m = malloc(4 + 6);
+    if (!m)
+        return -1;
+    put16(m, 0);
+    put16(m+2, 1);
+    put16(m+4, MANIFEST_UTC_OFFSET);
+    put32(m+6, 0);
+    return peer_keep(w, TTBLUE_FILE_MANIFEST1, m, 4 + 6);
+}
+
+static int
+sim_watches(const struct sim_params *p, const int *ctl)
+{
+    struct sim_watch *w = calloc(p->watches, sizeof *w);
+    pthread_t *threads = calloc(p->watches, sizeof *threads);
+    uint8_t *data = malloc(p->file_size + 1);
+    unsigned seed = 1;
+    int started = 0;
+
+    if (!w || !threads || !data)
+        goto out;
+    sim_ttbin(data, p->file_size, seed);
+
+    for (; started < p->watches; started++) {
+        struct sim_watch *s = &w[started];
+        s->id = started+1;
+        s->protocol_version = p->protocol_version ? p->protocol_version : 1 + started%2;
+        s->h = tt_protocol_handles(s->protocol_version, &s->info);
+        fakehci_address(&s->addr, s->id);
+        s->p = p;
+        s->ctl = ctl[started];
+        s->data = data;
+        s->seed = s->id;
+        if (!(s->files = malloc((p->backlog+1) * sizeof(uint16_t))) || peer_manifest(s) < 0) {
+            free(s->files);
+            break;
+        }
+        if ((errno = pthread_create(&threads[started], NULL, peer_thread, s)) != 0) {
+            fprintf(stderr, "Could not start simulated watch: %s (%d)\n", strerror(errno), errno);
+            free(s->files);
+            peer_forget(s, TTBLUE_FILE_MANIFEST1);
+            break;
+        }
+    }
+    for (int ii=0; ii<started; ii++) {
+        pthread_join(threads[ii], NULL);
+        free(w[ii].files);
+        while (w[ii].nother)
+            peer_forget(&w[ii], w[ii].other[0].fileno);
+    }
+
+out:
+    free(data);
+    free(threads);
+    free(w);
+    return started == p->watches ? 0 : -1;
+}
+
+/****************************************************************************/
+/* The host, with one thread per watch */
+
+struct sim_state {
+    pthread_mutex_t lock;
+    struct daemon_state ds;     // counters, added up over all the hosts' daemon sessions
+    int finished;               // host threads
+};
+
+struct sim_host {
+    int id, protocol_version, ctl, debug;
+    const struct sim_params *p;
+    struct sim_state *st;
+    char dir[PATH_MAX];
+    STORE *store;
+
+    // one daemon session per watch, as main() sets it up, on an emulated controller
+    struct fakehci fh;
+    struct hci_link hl;
+    struct daemon_state ds;
+    int sleep_secs;
+    TASKS tasks;
+    struct notify_queue nq;
+    struct session_opts opts;
+    struct session_link link;
+    struct session sess;
+
+    int sessions, failures, files;
+    long bytes;                 // read from the watch, including what was read again after a failure
+    double scan_secs, setup_secs; // summed over all sessions
+    double time_to_sync;
+    bool done;
+};
+
+/* In a soak test, what earlier cycles saved only takes up space */
+static void
+host_clear_store(struct sim_host *s)
+{
+    DIR *d = opendir(s->dir);
+    if (!d)
+        return;
+    for (struct dirent *e; (e = readdir(d)) != NULL; )
+        if (e->d_name[0] != '.')
+            unlinkat(dirfd(d), e->d_name, 0);
+    closedir(d);
+}
+
+/* The daemon's own session, set up as main() does it but against the
+ * simulated watch, with the sleeps between syncs cut to nothing */
+static int
+host_init(struct sim_host *s, const char *base)
+{
+    s->ds = (struct daemon_state){ .ctl_fd = -1, .epoll_fd = -1, .timer_fd = -1, .sig_fd = -1, .scan_fd = -1,
+                                   .notify_fd = -1, .link_fd = -1, .started = time(NULL),
+                                   .sleep_success = &s->sleep_secs, .sleep_fail = &s->sleep_secs };
+    s->nq = (struct notify_queue){ .fd = -1 };
+    tasks_init(&s->tasks, 0);
+    s->opts = (struct session_opts){ .debug = s->debug > 1 ? s->debug-1 : 0, .daemonize = true,
+                                     .batched = s->p->batched, .get_activities = true, .set_time = true,
+                                     .hostname = "ttblue-sim", .postproc = s->p->postproc };
+    if (asprintf((char **)&s->opts.cache_dir, "%s/cache", base) < 0) {
+        s->opts.cache_dir = NULL;
+        return -1;
+    }
+    if (daemon_init(&s->ds) < 0)
+        return -1;
+    s->fh = (struct fakehci){ .ctl = s->ctl, .failure = controller_failure(s->p), .seed = s->id };
+    s->hl = (struct hci_link){ .ops = &fakehci_ops, .arg = &s->fh, .dd = -1, .debug = s->opts.debug };
+    hci_session_link(&s->hl, &s->link);
+    session_init(&s->sess, &s->opts, &s->link, &s->ds, &s->tasks, s->store, &s->nq);
+    strcpy(s->sess.dev_code, SIM_CODE);
+    // as if the daemon had been running for a while: a failed session is
+    // retried, rather than being taken for a watch which isn't there
+    s->sess.first = false;
+    s->sess.success = s->sess.synced = true;
+    return 0;
+}
+
+static void
+host_done(struct sim_host *s)
+{
+    if (!s->opts.hostname)
+        return; // never set up
+    daemon_done(&s->ds);
+    tasks_free(&s->tasks);
+    free((char *)s->opts.cache_dir);
+}
+
+/* One daemon session. Returns 0 if the watch has nothing more to sync,
+ * -1 if the session failed, or -2 if the watch has vanished. */
+static int
+host_sync(struct sim_host *s)
+{
+    struct daemon_state *ds = &s->ds, before = s->ds;
+
+    if (s->p->cycles)
+        host_clear_store(s);
+    ds->last_scan_secs = ds->last_connect_secs = ds->last_setup_secs = 0;
+    int result = session_run(&s->sess);
+
+    s->files += ds->files_done;
+    s->bytes += ds->bytes_read - before.bytes_read;
+    s->scan_secs += ds->last_scan_secs;
+    s->setup_secs += ds->last_connect_secs + ds->last_setup_secs;
+
+    pthread_mutex_lock(&s->st->lock);
+    s->st->ds.cycles += ds->cycles - before.cycles;
+    s->st->ds.failures += ds->failures - before.failures;
+    s->st->ds.total_cycle_secs += ds->total_cycle_secs - before.total_cycle_secs;
+    s->st->ds.children += ds->children - before.children;
+    pthread_mutex_unlock(&s->st->lock);
+
+    if (result == SESSION_FATAL) {
+        fprintf(stderr, "Simulated watch %d stopped advertising.\n", s->id);
+        return -2;
+    }
+    return (result == SESSION_OK && !ds->tasks_deferred) ? 0 : -1;
+}
+
+static void *
+host_thread(void *arg)
+{
+    struct sim_host *s = arg;
+    int limit = s->p->cycles ? s->p->cycles : SIM_MAX_SESSIONS;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    while (s->sessions < limit) {
+        int result = host_sync(s);
+        s->sessions++;
+
+        if (result == 0) {
+            if (!s->done)
+                s->time_to_sync = elapsed_secs(&start);
+            s->done = true;
+            if (!s->p->cycles)
+                break;
+        } else if (result == -2)
+            break;
+        else {
+            s->failures++;
+            if (s->debug > 1)
+                fprintf(stderr, "Sync with simulated watch %d failed, will retry.\n", s->id);
+        }
+    }
+    if (!s->done)
+        s->time_to_sync = elapsed_secs(&start);
+
+    pthread_mutex_lock(&s->st->lock);
+    s->st->finished++;
+    pthread_mutex_unlock(&s->st->lock);
+    return NULL;
+}
+
+/* Soak test: every tenth of the way, shows how resource use and cycle times
+ * have moved. Returns once all the host threads have finished. */
+static void
+sim_monitor(struct sim_state *st, const struct sim_params *p, int threads, FILE *out,
+            double *first_mean, double *last_mean, long *first_rss)
+{
+    int step = (p->watches * p->cycles + 9) / 10, next = step, prev_cycles = 0;
+    double prev_secs = 0;
+    bool first = true;
+
+    fprintf(out, "  %7s %7s %11s %9s %9s %5s %8s\n", "cycles", "failed", "mean cycle", "RSS", "max RSS", "fds", "children");
+    for (bool done = false; !done; ) {
+        struct timespec tick = { 0, 100000000 };
+        nanosleep(&tick, NULL);
+
+        pthread_mutex_lock(&st->lock);
+        done = (st->finished == threads);
+        if (!done && st->ds.cycles < next) {
+            pthread_mutex_unlock(&st->lock);
+            continue;
+        }
+        daemon_sample(&st->ds); // the hosts' sessions reap their own children
+        struct daemon_state ds = st->ds;
+        pthread_mutex_unlock(&st->lock);
+
+        if (ds.cycles == prev_cycles)
+            continue;
+        double mean = (ds.total_cycle_secs - prev_secs) / (ds.cycles - prev_cycles);
+        fprintf(out, "  %7d %7d %10.3fs %6ld kB %6ld kB %5d %8d\n",
+                ds.cycles, ds.failures, mean, ds.rss_kb, ds.max_rss_kb, ds.open_fds, ds.children);
+        fflush(out);
+        if (first) {
+            *first_mean = mean;
+            *first_rss = ds.rss_kb;
+            first = false;
+        }
+        *last_mean = mean;
+        prev_cycles = ds.cycles;
+        prev_secs = ds.total_cycle_secs;
+        while (next <= ds.cycles)
+            next += step;
+    }
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+cpu_secs(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec/1e6;
+}
+
+int
+sim_parse_param(struct sim_params *p, const char *arg)
+{
+    static const struct { const char *name; size_t offset; long min, max; } params[] = {
+        { "version", offsetof(struct sim_params, protocol_version), 0, 2 },
+        { "backlog", offsetof(struct sim_params, backlog), 0, 0xffff },
+        { "size", offsetof(struct sim_params, file_size), 0, 1<<30 },
+        { "advert", offsetof(struct sim_params, advert_ms), 20, 10240 }, // what BLE allows
+        { "rate", offsetof(struct sim_params, rate), 0, INT_MAX },
+        { "failure", offsetof(struct sim_params, failure), 0, 100 },
+        { NULL }
+    };
+    const char *eq = strchr(arg, '=');
+    char *end;
+
+    if (!eq)
+        return -1;
+    long value = strtol(eq+1, &end, 0);
+    if (end == eq+1 || *end)
+        return -1;
+    for (int ii=0; params[ii].name; ii++) {
+        if (strlen(params[ii].name) == eq-arg && !strncmp(arg, params[ii].name, eq-arg)) {
+            if (value < params[ii].min || value > params[ii].max)
+                return -1;
+            *(int *)((char *)p + params[ii].offset) = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Syncs the whole simulated fleet at once, into a scratch directory under
+ * store_dir, and reports how the host coped. Returns the number of watches
+ * which could not be synced (plus one, in a soak test, if file descriptors
+ * leaked), or <0 on error. */
+int
+sim_run(const struct sim_params *p, const char *store_dir, int debug)
+{
+    struct sim_host *hosts = calloc(p->watches, sizeof *hosts);
+    pthread_t *threads = calloc(p->watches, sizeof *threads);
+    int *ctl = malloc(2 * p->watches * sizeof(int));
+    double *tts = calloc(p->watches, sizeof(double));
+    char base[PATH_MAX] = "", rate[32] = "unlimited";
+    int nctl = 0, started = 0, unfinished = -1, status, saved_stderr = -1;
+    FILE *report = stderr;      // the soak test's progress, while the sessions' output is hidden
+    pid_t pid = -1;
+    struct sim_state st = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                            .ds = { .ctl_fd = -1, .epoll_fd = -1, .timer_fd = -1, .sig_fd = -1, .scan_fd = -1,
+                                    .notify_fd = -1, .link_fd = -1, .started = time(NULL) } };
+
+    if (!hosts || !threads || !ctl || !tts)
+        goto out;
+    snprintf(base, sizeof base, "%s/.ttblue-sim-XXXXXX", store_dir);
+    if (!mkdtemp(base)) {
+        fprintf(stderr, "Could not create %s: %s (%d)\n", base, strerror(errno), errno);
+        base[0] = 0;
+        goto out;
+    }
+
+    // the watches' ends of these go to the child process
+    for (; nctl < p->watches; nctl++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, &ctl[2*nctl]) < 0) {
+            fprintf(stderr, "Could not create socket pair: %s (%d)\n", strerror(errno), errno);
+            goto out;
+        }
+    }
+    fflush(stderr);
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Could not fork: %s (%d)\n", strerror(errno), errno);
+        goto out;
+    } else if (pid == 0) {
+        int peer_ctl[p->watches];
+        for (int ii=0; ii<p->watches; ii++) {
+            close(ctl[2*ii]);
+            peer_ctl[ii] = ctl[2*ii+1];
+        }
+        _exit(sim_watches(p, peer_ctl) < 0 ? 1 : 0);
+    }
+    for (int ii=0; ii<p->watches; ii++) {
+        close(ctl[2*ii+1]);
+        ctl[2*ii+1] = -1;
+    }
+
+    // a link that drops shows up as EPIPE, as it would on L2CAP
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int ii=0; ii<p->watches; ii++) {
+        struct sim_host *s = &hosts[ii];
+        s->id = ii+1;
+        s->protocol_version = p->protocol_version ? p->protocol_version : 1 + ii%2;
+        s->ctl = ctl[2*ii];
+        s->debug = debug;
+        s->p = p;
+        s->st = &st;
+        snprintf(s->dir, sizeof s->dir, "%s/watch%03d", base, s->id);
+        if (mkdir(s->dir, 0777) < 0) {
+            fprintf(stderr, "Could not create %s: %s (%d)\n", s->dir, strerror(errno), errno);
+            goto out;
+        }
+        if (!(s->store = store_open(s->dir, p->batch)))
+            goto out;
+        if (p->archive) {
+            // beside the watch's directory, which is emptied in a soak test
+            char path[PATH_MAX];
+            snprintf(path, sizeof path, "%s/watch%03d.ttza", base, s->id);
+            if (store_archive(s->store, path, p->archive_dict) < 0)
+                goto out;
+        }
+
+        // long enough for a few advertisements, in case the watches are slow to start
+        struct timeval to = { 5 + p->advert_ms/1000, 0 };
+        setsockopt(s->ctl, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
+        if (host_init(s, base) < 0)
+            goto out;
+    }
+
+    if (p->rate)
+        snprintf(rate, sizeof rate, "%d bytes/s", p->rate);
+    fprintf(stderr, "Simulating %d %s watches: %d activities of %d bytes each, advertising every %d ms, link %s, %d%% failures\n",
+            p->watches, p->protocol_version == 1 ? "v1" : p->protocol_version == 2 ? "v2" : "v1 and v2",
+            p->backlog, p->file_size, p->advert_ms, rate, p->failure);
+    fputs("  simulated: the Bluetooth controller and radio, and the watches, in a child process\n"
+          "  real: the daemon's sessions (HCI scan, connect, link setup, authorize, tasks, store, device cache, teardown),\n"
+          "    one per watch in this process, each with its own event loop, as if a daemon were run per watch\n", stderr);
+    if (p->cycles)
+        fprintf(stderr, "Soak test: %d sync cycles per watch%s%s\n", p->cycles,
+                p->postproc ? ", postprocessing with " : "", p->postproc ? p->postproc : "");
+
+    // the daemon's sessions talk a lot: only the report goes to stderr
+    if (debug < 2) {
+        fflush(stderr);
+        int null = open("/dev/null", O_WRONLY|O_CLOEXEC);
+        if ((saved_stderr = fcntl(2, F_DUPFD_CLOEXEC, 3)) < 0 || null < 0 || !(report = fdopen(saved_stderr, "w"))) {
+            fprintf(stderr, "Could not redirect stderr: %s (%d)\n", strerror(errno), errno);
+            if (null >= 0)
+                close(null);
+            if (saved_stderr >= 0)
+                close(saved_stderr);
+            goto out;
+        }
+        dup2(null, 2);
+        close(null);
+    }
+
+    // nothing which is open now should be left open by the syncs
+    daemon_sample(&st.ds);
+    int baseline_fds = st.ds.open_fds;
+
+    struct rusage before, after, peers;
+    struct timeval start;
+    double first_mean = 0, last_mean = 0;
+    long first_rss = 0;
+    getrusage(RUSAGE_SELF, &before);
+    gettimeofday(&start, NULL);
+    for (; started < p->watches; started++) {
+        if ((errno = pthread_create(&threads[started], NULL, host_thread, &hosts[started])) != 0) {
+            fprintf(stderr, "Could not start thread: %s (%d)\n", strerror(errno), errno);
+            break;
+        }
+    }
+    if (p->cycles && started == p->watches)
+        sim_monitor(&st, p, started, report, &first_mean, &last_mean, &first_rss);
+    for (int ii=0; ii<started; ii++)
+        pthread_join(threads[ii], NULL);
+    double wall = elapsed_secs(&start);
+    getrusage(RUSAGE_SELF, &after);
+    if (started < p->watches)
+        goto out;
+
+    // whatever is still running now, and whatever is still open once it's done
+    daemon_reap(&st.ds, false);
+    int running = st.ds.children;
+    daemon_reap(&st.ds, true);
+    daemon_sample(&st.ds);
+    if (report != stderr) {
+        fflush(stderr);
+        dup2(saved_stderr, 2);
+    }
+
+    // hanging up makes the watches stop
+    for (int ii=0; ii<p->watches; ii++) {
+        close(ctl[2*ii]);
+        ctl[2*ii] = -1;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    pid = -1;
+    getrusage(RUSAGE_CHILDREN, &peers);
+
+    long bytes = 0;
+    int files = 0, sessions = 0, n = 0;
+    unfinished = 0;
+    fprintf(stderr, "  %5s %2s %8s %6s %5s %10s %9s %9s %12s\n",
+            "watch", "v", "sessions", "failed", "files", "bytes", "scan", "setup", "time to sync");
+    for (int ii=0; ii<p->watches; ii++) {
+        struct sim_host *s = &hosts[ii];
+        fprintf(stderr, "  %5d %2d %8d %6d %5d %10ld %8.3fs %8.3fs %11.3fs%s\n",
+                s->id, s->protocol_version, s->sessions, s->failures, s->files, s->bytes,
+                s->sessions ? s->scan_secs/s->sessions : 0, s->sessions ? s->setup_secs/s->sessions : 0,
+                s->time_to_sync, s->done ? "" : " (gave up)");
+        bytes += s->bytes;
+        files += s->files;
+        sessions += s->sessions;
+        if (s->done)
+            tts[n++] = s->time_to_sync;
+        else
+            unfinished++;
+    }
+    qsort(tts, n, sizeof *tts, compare_double);
+
+    fprintf(stderr, "Synced %d activities from %d watches in %d sessions, %.3f s:\n", files, p->watches-unfinished, sessions, wall);
+    fprintf(stderr, "  throughput: %.1f kB/s over all links (%ld bytes, including reads repeated after failures)\n",
+            wall > 0 ? bytes/wall/1000 : 0, bytes);
+    if (n)
+        fprintf(stderr, "  time to sync: min %.3f s, median %.3f s, 95th percentile %.3f s, max %.3f s\n",
+                tts[0], tts[n/2], tts[(n*95+99)/100-1], tts[n-1]);
+    if (unfinished)
+        fprintf(stderr, "  %d watches could not be synced within %d sessions\n", unfinished, SIM_MAX_SESSIONS);
+
+    double user = cpu_secs(&after.ru_utime) - cpu_secs(&before.ru_utime);
+    double sys = cpu_secs(&after.ru_stime) - cpu_secs(&before.ru_stime);
+    fprintf(stderr, "  host CPU: %.3f s user + %.3f s system (%.0f%% of one core), peak RSS %ld kB\n",
+            user, sys, wall > 0 ? 100*(user+sys)/wall : 0, after.ru_maxrss);
+    fprintf(stderr, "  simulated watches' CPU: %.3f s user + %.3f s system\n",
+            cpu_secs(&peers.ru_utime), cpu_secs(&peers.ru_stime));
+    if (p->archive) {
+        ARCHIVE all = { .cdict = hosts[0].store->archive->cdict };
+        for (int ii=0; ii<p->watches; ii++) {
+            all.in_bytes += hosts[ii].store->archive->in_bytes;
+            all.out_bytes += hosts[ii].store->archive->out_bytes;
+            all.secs += hosts[ii].store->archive->secs;
+        }
+        archive_report(&all, stderr, "  ");
+    }
+
+    if (p->cycles) {
+        bool leaked = st.ds.open_fds > baseline_fds;
+        fprintf(stderr, "Soak test drift, from the first tenth to the end:\n");
+        fprintf(stderr, "  mean cycle %.3f s -> %.3f s (%+.1f%%)\n", first_mean, last_mean,
+                first_mean > 0 ? 100*(last_mean-first_mean)/first_mean : 0);
+        fprintf(stderr, "  RSS %ld kB -> %ld kB (%+ld kB), max %ld kB\n", first_rss, st.ds.rss_kb,
+                st.ds.rss_kb - first_rss, st.ds.max_rss_kb);
+        fprintf(stderr, "  open fds %d before, %d after%s\n", baseline_fds, st.ds.open_fds, leaked ? " (LEAKED)" : "");
+        fprintf(stderr, "  postprocessing still running at the end: %d\n", running);
+        if (leaked)
+            unfinished++;
+    }
+
+out:
+    if (report != stderr) {
+        fflush(stderr);
+        dup2(saved_stderr, 2);
+        fclose(report);
+    }
+    for (int ii=0; hosts && ii<p->watches; ii++)
+        host_done(&hosts[ii]);
+    for (int ii=0; ii<2*nctl; ii++)
+        if (ctl[ii] >= 0)
+            close(ctl[ii]);
+    if (pid > 0)
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+    for (int ii=0; hosts && ii<p->watches; ii++)
+        store_close(hosts[ii].store);
+    if (base[0] && nftw(base, remove_entry, 16, FTW_DEPTH|FTW_PHYS) < 0)
+        fprintf(stderr, "Could not remove %s: %s (%d)\n", base, strerror(errno), errno);
+    free(tts);
+    free(ctl);
+    free(threads);
+    free(hosts);
+    return unfinished;
+}
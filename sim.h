@@ -0,0 +1,48 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdbool.h>
+
+/**
+ * Load generator for capacity planning: a fleet of simulated watches, each
+ * a thread in a child process which speaks the v1 or v2 protocol over a
+ * local socket, is synced concurrently by one thread per watch in this
+ * process. Each thread runs the daemon's own session_run() (see session.h),
+ * with its own event loop, task queue and device cache, as if a daemon were
+ * run for each watch: scan -> connect -> device check -> authorize -> PHONE
+ * menu, clock and settings -> list -> read -> store checkpoint -> delete,
+ * with the usual teardown after a failure. Only the radio is stood in for,
+ * by an emulated controller (fakehci.h) under the daemon's own HCI scan,
+ * connect and link setup code (btlink.h); the sleeps between syncs are cut
+ * to nothing.
+ *
+ * As a soak test (sim_params.cycles), each watch records a new backlog
+ * before every sync, and the daemon's resource counters are tracked over
+ * thousands of cycles, with failures injected at every stage from the
+ * connection to the final delete.
+ */
+
+#define SIM_MAX_SESSIONS 100    // per watch, before giving up on it
+
+struct sim_params {
+    int watches;
+    int protocol_version;       // 1 or 2, or 0 for half of each
+    int backlog;                // activity files on each watch
+    int file_size;              // bytes per activity file
+    int advert_ms;              // advertising interval
+    int rate;                   // link speed from the watch, in bytes/s (0 = unlimited)
+    int failure;                // chance (%) of a connection failing, at a random stage
+    int cycles;                 // soak test: sync this many times, with new activities each time
+    const char *postproc;       // command to run on each saved file, as with --post
+    bool archive;               // compress into an archive per watch, as with --archive
+    const char *archive_dict;
+    int batch;                  // store checkpoint every this many files
+    bool batched;               // receive with recvmmsg
+};
+
+#define SIM_DEFAULTS { .backlog = 4, .file_size = 65536, .advert_ms = 100, .batch = 1, .batched = true }
+
+int sim_parse_param(struct sim_params *p, const char *arg);
+int sim_run(const struct sim_params *p, const char *store_dir, int debug);
+
+#endif /* __SIM_H__ */
@@ -0,0 +1,70 @@
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <stdbool.h>
+#include <semaphore.h>
+
+/**
+ * Lock-free single-producer/single-consumer ring of pointers.
+ *
+ * The producer only writes head and the consumer only writes tail, each on
+ * its own cache line. The two semaphores are only there so that either side
+ * can sleep when the ring is full or empty; they are never held.
+ */
+
+#define SPSC_SLOTS 16 /* must be a power of 2 */
+#define CACHELINE 64
+
+struct spsc {
+    unsigned head __attribute__((aligned(CACHELINE)));
+    unsigned tail __attribute__((aligned(CACHELINE)));
+    void *slot[SPSC_SLOTS] __attribute__((aligned(CACHELINE)));
+    sem_t items, space;
+};
+
+static inline int
+spsc_init(struct spsc *r)
+{
+    r->head = r->tail = 0;
+    if (sem_init(&r->items, 0, 0) < 0)
+        return -1;
+    if (sem_init(&r->space, 0, SPSC_SLOTS) < 0) {
+        sem_destroy(&r->items);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void
+spsc_destroy(struct spsc *r)
+{
+    sem_destroy(&r->items);
+    sem_destroy(&r->space);
+}
+
+/* producer side: blocks while the ring is full */
+static inline void
+spsc_push(struct spsc *r, void *p)
+{
+    while (sem_wait(&r->space) < 0)
+        ;
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    r->slot[head & (SPSC_SLOTS-1)] = p;
+    __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+    sem_post(&r->items);
+}
+
+/* consumer side: blocks while the ring is empty */
+static inline void *
+spsc_pop(struct spsc *r)
+{
+    while (sem_wait(&r->items) < 0)
+        ;
+    unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    void *p = r->slot[tail & (SPSC_SLOTS-1)];
+    __atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+    sem_post(&r->space);
+    return p;
+}
+
+#endif /* __SPSC_H__ */
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "xxh64.h"
+#include "ttblue.h"
+
+#define STORE_CHUNK 65536       // hashed while it's still in the cache from writing it
+
+/* Writes len bytes to fd, adding each chunk to the hash h and feeding it to
+ * the decoder d (either of which may be NULL) once written. Returns 0 on
+ * success, or -1 with errno set. */
+static int
+write_all(int fd, const char *p, size_t len, struct xxh64 *h, struct ttbin_decoder *d)
+{
+    for (const char *end = p+len; p < end; ) {
+        ssize_t w = write(fd, p, end-p < STORE_CHUNK ? end-p : STORE_CHUNK);
+        if (w < 0 && errno == EINTR)
+            continue;
+        else if (w < 0)
+            return -1;
+        if (h)
+            xxh64_update(h, p, w);
+        if (d)
+            ttbin_decode(d, p, w);
+        p += w;
+    }
+    return 0;
+}
+
+/* worker thread: writes each staged file to its temporary name, and its hash next to it,
+ * summarizing activity files on the way */
+static void *
+store_worker(void *arg)
+{
+    STORE *s = arg;
+    struct store_entry *e;
+
+    while ((e = spsc_pop(&s->ring)) != NULL) {
+        struct xxh64 h;
+        struct ttbin_decoder *d = NULL;
+        char line[32 + strlen(e->name)];
+
+        e->error = 0;
+        e->summarized = false;
+        xxh64_init(&h, 0);
+        if (s->summaries && (e->fileno & 0xffff0000) == TTBLUE_FILE_TTBIN_DATA) {
+            d = &s->decoder;
+            ttbin_decode_init(d);
+        }
+        if (s->archive) {
+            e->hash = xxh64(e->buf, e->length, 0);
+            if (d)
+                ttbin_decode(d, e->buf, e->length);
+            if ((e->stored = archive_append(s->archive, e->fileno, e->name, e->buf, e->length, e->hash)) < 0)
+                e->error = errno ? errno : EIO;
+        } else if ((e->fd = openat(s->dirfd, e->tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0) {
+            e->error = errno;
+            fprintf(stderr, "    Could not open %s/%s: %s (%d)\n", s->dir, e->tmpname, strerror(errno), errno);
+        } else if (write_all(e->fd, e->buf, e->length, &h, d) < 0) {
+            e->error = errno;
+            fprintf(stderr, "    Could not save to %s/%s: %s (%d)\n", s->dir, e->tmpname, strerror(errno), errno);
+        } else {
+            // in the format of xxh64sum, so that it can check them
+            e->hash = xxh64_digest(&h);
+            int len = sprintf(line, "%016llx  %s\n", (unsigned long long)e->hash, e->name);
+            if ((e->hash_fd = openat(s->dirfd, e->hash_tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0
+                || write_all(e->hash_fd, line, len, NULL, NULL) < 0) {
+                e->error = errno;
+                fprintf(stderr, "    Could not save to %s/%s: %s (%d)\n", s->dir, e->hash_tmpname, strerror(errno), errno);
+            }
+        }
+        if (d && !e->error)
+            e->summarized = (ttbin_decode_finish(d, e->fileno, &e->sum) == 0);
+        free(e->buf);
+        e->buf = NULL;
+        sem_post(&s->written);
+    }
+    return NULL;
+}
+
+STORE *
+store_open(const char *dir, int batch)
+{
+    STORE *s;
+
+    if (batch < 1)
+        batch = 1;
+
+    // the ring wants its cache-line alignment
+    if (posix_memalign((void **)&s, CACHELINE, sizeof(STORE) + batch*sizeof(struct store_entry)) != 0)
+        return NULL;
+    memset(s, 0, sizeof(STORE) + batch*sizeof(struct store_entry));
+
+    s->dir = dir;
+    s->batch = batch;
+    if ((s->dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not open activity store %s: %s (%d)\n", dir, strerror(errno), errno);
+        goto fail;
+    }
+    if (!(s->summaries = summaries_load(dir)))
+        fprintf(stderr, "Activities will not be summarized.\n");
+
+    if (spsc_init(&s->ring) < 0)
+        goto fail_dir;
+    if (sem_init(&s->written, 0, 0) < 0)
+        goto fail_ring;
+    if ((errno = pthread_create(&s->worker, NULL, store_worker, s)) != 0) {
+        fprintf(stderr, "Could not start activity store thread: %s (%d)\n", strerror(errno), errno);
+        goto fail_sem;
+    }
+    return s;
+
+fail_sem:
+    sem_destroy(&s->written);
+fail_ring:
+    spsc_destroy(&s->ring);
+fail_dir:
+    summaries_free(s->summaries);
+    close(s->dirfd);
+fail:
+    free(s);
+    return NULL;
+}
+
+void
+store_close(STORE *s)
+{
+    if (s) {
+        store_abort(s);
+        spsc_push(&s->ring, NULL);
+        pthread_join(s->worker, NULL);
+        sem_destroy(&s->written);
+        spsc_destroy(&s->ring);
+        close(s->dirfd);
+        archive_close(s->archive);
+        summaries_free(s->summaries);
+        free(s);
+    }
+}
+
+static void
+free_entry(struct store_entry *e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+    if (e->hash_fd >= 0)
+        close(e->hash_fd);
+    free(e->buf);
+    free(e->name);
+    free(e->tmpname);
+    free(e->path);
+    free(e->hash_name);
+    free(e->hash_tmpname);
+    memset(e, 0, sizeof *e);
+}
+
+/* wait for the worker thread to finish writing all staged files */
+static void
+store_drain(STORE *s)
+{
+    for (; s->pending; s->pending--)
+        while (sem_wait(&s->written) < 0)
+            ;
+}
+
+/* From now on, compresses files into the archive at path (relative to the store
+ * directory, unless absolute) rather than saving them separately */
+int
+store_archive(STORE *s, const char *path, const char *dict_path)
+{
+    char *full = NULL;
+
+    if (path[0] != '/' && asprintf(&full, "%s/%s", s->dir, path) < 0)
+        return -1;
+    store_drain(s);
+    s->archive = archive_open(full ? full : path, dict_path, true);
+    free(full);
+    return s->archive ? 0 : -1;
+}
+
+/* Queues buf (which the store takes over, and frees) to be written to a temporary file.
+ * Returns the number of staged files, which is at most s->batch (caller should then
+ * store_commit), or <0 on error. Write errors are reported by store_commit. */
+int
+store_stage(STORE *s, uint32_t fileno, const char *name, void *buf, int length, int indent, int verbose)
+{
+    char istr[indent+1];
+    memset(istr, ' ', indent);
+    istr[indent] = 0;
+
+    if (s->n >= s->batch)
+        goto fail;
+
+    // refuse to overwrite, like fopen(.., "wx") would
+    if (!s->archive && faccessat(s->dirfd, name, F_OK, 0) == 0) {
+        fprintf(stderr, "%sCould not save to %s/%s: %s (%d)\n", istr, s->dir, name, strerror(EEXIST), EEXIST);
+        goto fail;
+    }
+
+    struct store_entry *e = &s->staged[s->n];
+    e->fileno = fileno;
+    e->fd = e->hash_fd = -1;
+    if (asprintf(&e->name, "%s", name) < 0 || asprintf(&e->tmpname, ".%s.part", name) < 0
+        || asprintf(&e->path, "%s/%s", s->dir, name) < 0
+        || asprintf(&e->hash_name, "%s.xxh64", name) < 0 || asprintf(&e->hash_tmpname, ".%s.xxh64.part", name) < 0) {
+        free_entry(e);
+        goto fail;
+    }
+    e->buf = buf;
+    e->length = length;
+
+    s->pending++;
+    spsc_push(&s->ring, e);
+
+    if (verbose)
+        fprintf(stderr, "%sStaged %d bytes for %s\n", istr, length, e->path);
+    return ++s->n;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+/* Adds the summaries of the staged activity files, and saves them all. Returns
+ * the number added, or -1 on error. */
+static int
+save_summaries(STORE *s, const char *istr, int verbose)
+{
+    int added = 0;
+
+    for (int ii=0; ii<s->n && s->summaries; ii++) {
+        struct store_entry *e = &s->staged[ii];
+        if (!e->summarized)
+            continue;
+        if (summaries_add(s->summaries, &e->sum) < 0) {
+            fprintf(stderr, "%sCould not summarize %s: %s (%d)\n", istr, e->name, strerror(errno), errno);
+            return -1;
+        }
+        added++;
+    }
+    if (added && summaries_save(s->summaries) < 0)
+        return -1;
+    if (added && verbose)
+        fprintf(stderr, "%sSummarized %d activity file(s) in %s\n", istr, added, s->summaries->path);
+    return added;
+}
+
+/* Checkpoint: flush all staged files, then rename them into place and flush the directory.
+ * Returns the number of committed files (still listed in s->staged until store_release);
+ * any whose name was taken in the meantime are left out, so they stay on the watch. */
+int
+store_commit(STORE *s, int indent, int verbose)
+{
+    char istr[indent+1];
+    memset(istr, ' ', indent);
+    istr[indent] = 0;
+
+    store_drain(s);
+
+    if (s->archive) {
+        for (int ii=0; ii<s->n; ii++)
+            if (s->staged[ii].error)
+                return -1; // already reported by the worker
+        int added = save_summaries(s, istr, verbose);
+        if (added < 0 || archive_commit(s->archive) < 0)
+            return -1;
+        if (added && fsync(s->dirfd) < 0) {
+            fprintf(stderr, "%sCould not flush %s: %s (%d)\n", istr, s->dir, strerror(errno), errno);
+            return -1;
+        }
+        if (verbose)
+            for (int ii=0; ii<s->n; ii++)
+                fprintf(stderr, "%sArchived %d bytes of %s in %s (%d compressed)\n", istr, s->staged[ii].length,
+                        s->staged[ii].name, s->archive->path, s->staged[ii].stored);
+        return s->n;
+    }
+
+    // group the expensive flushes together, rather than one per write
+    for (int ii=0; ii<s->n; ii++) {
+        struct store_entry *e = &s->staged[ii];
+        if (e->error)
+            return -1; // already reported by the worker
+        if (fdatasync(e->fd) < 0 || close(e->fd) < 0) {
+            e->fd = -1;
+            fprintf(stderr, "%sCould not flush %s/%s: %s (%d)\n", istr, s->dir, e->tmpname, strerror(errno), errno);
+            return -1;
+        }
+        e->fd = -1;
+        if (fdatasync(e->hash_fd) < 0 || close(e->hash_fd) < 0) {
+            e->hash_fd = -1;
+            fprintf(stderr, "%sCould not flush %s/%s: %s (%d)\n", istr, s->dir, e->hash_tmpname, strerror(errno), errno);
+            return -1;
+        }
+        e->hash_fd = -1;
+    }
+
+    // like the hashes, so that a saved activity always has its summary
+    if (save_summaries(s, istr, verbose) < 0)
+        return -1;
+
+    // The file goes first, and never replaces anything; its hash only follows
+    // once it's in place, so that an existing file's hash is never swapped
+    // for another's (a crash in between leaves a file without one, rather
+    // than with the wrong one). A file whose name was taken since it was
+    // staged is dropped, and stays on the watch.
+    int kept = 0;
+    for (int ii=0; ii<s->n; ii++) {
+        struct store_entry *e = &s->staged[ii];
+
+#ifdef RENAME_NOREPLACE
+        int res = renameat2(s->dirfd, e->tmpname, s->dirfd, e->name, RENAME_NOREPLACE);
+        if (res < 0 && (errno == EINVAL || errno == ENOSYS)) // filesystem or kernel doesn't support it
+#else
+        int res;
+        if (faccessat(s->dirfd, e->name, F_OK, 0) == 0) {
+            errno = EEXIST;
+            res = -1;
+        } else
+#endif
+            res = renameat(s->dirfd, e->tmpname, s->dirfd, e->name);
+        if (res < 0 && errno == EEXIST) {
+            fprintf(stderr, "%sCould not save to %s: %s (%d)\n", istr, e->path, strerror(errno), errno);
+            unlinkat(s->dirfd, e->tmpname, 0);
+            unlinkat(s->dirfd, e->hash_tmpname, 0);
+            free_entry(e);
+            continue;
+        } else if (res < 0) {
+            fprintf(stderr, "%sCould not rename %s/%s: %s (%d)\n", istr, s->dir, e->tmpname, strerror(errno), errno);
+            s->n = kept + (s->n - ii); // the rest are still staged, for store_abort
+            memmove(&s->staged[kept], e, (s->n - kept) * sizeof *e);
+            return -1;
+        }
+        if (renameat(s->dirfd, e->hash_tmpname, s->dirfd, e->hash_name) < 0) {
+            fprintf(stderr, "%sCould not rename %s/%s: %s (%d)\n", istr, s->dir, e->hash_tmpname, strerror(errno), errno);
+            s->n = kept + (s->n - ii);
+            memmove(&s->staged[kept], e, (s->n - kept) * sizeof *e);
+            return -1;
+        }
+        if (kept != ii)
+            s->staged[kept] = *e;
+        kept++;
+    }
+    s->n = kept;
+
+    if (fsync(s->dirfd) < 0) {
+        fprintf(stderr, "%sCould not flush %s: %s (%d)\n", istr, s->dir, strerror(errno), errno);
+        return -1;
+    }
+
+    if (verbose)
+        for (int ii=0; ii<s->n; ii++)
+            fprintf(stderr, "%sSaved %d bytes to %s (xxh64 %016llx)\n", istr, s->staged[ii].length, s->staged[ii].path,
+                    (unsigned long long)s->staged[ii].hash);
+    return s->n;
+}
+
+/* Forgets committed files */
+void
+store_release(STORE *s)
+{
+    store_drain(s);
+    for (int ii=0; ii<s->n; ii++)
+        free_entry(&s->staged[ii]);
+    s->n = 0;
+}
+
+/* Discards staged files which have not been committed; they're still on the watch */
+void
+store_abort(STORE *s)
+{
+    store_drain(s);
+    if (s->archive)
+        archive_abort(s->archive);
+    for (int ii=0; ii<s->n && !s->archive; ii++) {
+        struct store_entry *e = &s->staged[ii];
+        if (e->fd >= 0 || faccessat(s->dirfd, e->tmpname, F_OK, 0) == 0)
+            unlinkat(s->dirfd, e->tmpname, 0);
+        if (e->hash_fd >= 0 || faccessat(s->dirfd, e->hash_tmpname, F_OK, 0) == 0)
+            unlinkat(s->dirfd, e->hash_tmpname, 0);
+    }
+    store_release(s);
+}
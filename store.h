@@ -0,0 +1,71 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "spsc.h"
+#include "archive.h"
+#include "summary.h"
+
+/**
+ * Durable activity store: files are staged under a temporary name, and
+ * a checkpoint (store_commit) flushes all staged files in one batch, renames
+ * them into place and syncs the directory. Only after that is it safe to
+ * delete the files from the watch.
+ *
+ * The file writes happen on a worker thread, fed through a lock-free
+ * ring, so that the next download from the watch can start while the
+ * previous one is still going to disk. The worker also fingerprints each
+ * file (XXH64) as it writes it, and saves the hash next to it as NAME.xxh64,
+ * so that duplicates can be found and the store audited without reading
+ * every file again.
+ *
+ * With an archive (store_archive), the worker compresses each file into it
+ * instead, with the hash in the archive's index rather than a separate file.
+ *
+ * Activity files are summarized as they're written, too, and the summaries
+ * saved to SUMMARY_FILE at the checkpoint, just before the files themselves.
+ */
+
+struct store_entry {
+    uint32_t fileno;
+    void *buf;          // handed over to the worker thread, which frees it
+    int length;
+    int error;          // set by the worker thread
+    uint64_t hash;      // likewise
+    int stored;         // bytes in the archive, if there is one
+    bool summarized;    // an activity file, with its summary in sum
+    struct ttbin_summary sum;
+    int fd, hash_fd;    // open until the checkpoint
+    char *name;         // final name, relative to the store directory
+    char *tmpname;
+    char *path;         // final name, including the store directory
+    char *hash_name, *hash_tmpname;
+};
+
+typedef struct store {
+    struct spsc ring;   // of struct store_entry *, to the worker
+    sem_t written;      // posted by the worker after each file
+    pthread_t worker;
+
+    const char *dir;
+    int dirfd;
+    int batch;          // checkpoint every this many files
+    int n, pending;     // staged files, and how many of those the worker hasn't finished
+    ARCHIVE *archive;   // or NULL for separate files
+    SUMMARIES *summaries; // or NULL if they couldn't be loaded
+    struct ttbin_decoder decoder; // the worker's
+    struct store_entry staged[];
+} STORE;
+
+STORE *store_open(const char *dir, int batch);
+void store_close(STORE *s);
+int store_archive(STORE *s, const char *path, const char *dict_path);
+int store_stage(STORE *s, uint32_t fileno, const char *name, void *buf, int length, int indent, int verbose);
+int store_commit(STORE *s, int indent, int verbose);
+void store_release(STORE *s);
+void store_abort(STORE *s);
+
+#endif /* __STORE_H__ */
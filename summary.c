@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "summary.h"
+
+#define TAG_HEADER 0x20
+#define TAG_STATUS 0x21
+#define TAG_GPS    0x22
+#define TAG_HR     0x25
+
+#define HEADER_FIXED 118        // up to and including the count of record lengths
+#define MOVING_SPEED 50         // cm/s; slower than that is standing around
+#define MAX_GAP 10              // seconds between fixes, beyond which the GPS lost track
+
+static inline uint16_t
+get16(const uint8_t *p)
+{
+    return p[0] | p[1]<<8;
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline float
+getf(const uint8_t *p)
+{
+    uint32_t v = get32(p);
+    float f;
+    memcpy(&f, &v, sizeof f);
+    return f;
+}
+
+void
+ttbin_decode_init(struct ttbin_decoder *d)
+{
+    memset(d, 0, sizeof *d);
+}
+
+/* The folds go through whole blocks, with whatever isn't filled zeroed (which
+ * adds nothing), since with a fixed count the compiler vectorizes them even at
+ * -O2; likewise, & rather than && keeps the loop free of branches. */
+static void
+fold_gps(struct ttbin_decoder *d)
+{
+    const uint32_t *dt = d->gps_dt, *v = d->gps_speed;
+    uint32_t moving = 0;
+
+    if (!d->n_gps)
+        return;
+    memset(d->gps_dt + d->n_gps, 0, (TTBIN_BLOCK - d->n_gps) * sizeof *dt);
+    memset(d->gps_speed + d->n_gps, 0, (TTBIN_BLOCK - d->n_gps) * sizeof *v);
+    for (int ii=0; ii<TTBIN_BLOCK; ii++)
+        moving += ((v[ii] >= MOVING_SPEED) & (dt[ii] <= MAX_GAP)) ? dt[ii] : 0;
+    d->moving += moving;
+    d->n_gps = 0;
+}
+
+static void
+fold_hr(struct ttbin_decoder *d)
+{
+    const uint8_t *hr = d->hr;
+    uint32_t sum = 0, n = 0;
+    uint8_t max = d->hr_max;
+
+    if (!d->n_hr)
+        return;
+    memset(d->hr + d->n_hr, 0, TTBIN_BLOCK - d->n_hr);
+    // 0 is no reading, which mustn't count towards the average
+    for (int ii=0; ii<TTBIN_BLOCK; ii++) {
+        sum += hr[ii];
+        n += hr[ii] != 0;
+        max = hr[ii] > max ? hr[ii] : max;
+    }
+    d->hr_sum += sum;
+    d->hr_n += n;
+    d->hr_max = max;
+    d->n_hr = 0;
+}
+
+static inline void
+saw_time(struct ttbin_decoder *d, uint32_t t)
+{
+    if (!d->first || t < d->first)
+        d->first = t;
+    if (t > d->last)
+        d->last = t;
+}
+
+static void
+header(struct ttbin_decoder *d, const uint8_t *rec, int len)
+{
+    d->start = get32(rec+8);
+    d->utc_offset = get32(rec+112);
+    for (const uint8_t *p = rec+HEADER_FIXED; p + 3 <= rec+len; p += 3)
+        d->length[p[0]] = get16(p+1);
+    d->header = true;
+}
+
+static void
+record(struct ttbin_decoder *d, const uint8_t *rec, int len)
+{
+    switch (rec[0]) {
+    case TAG_STATUS:
+        if (len >= 3)
+            d->activity = rec[2];
+        break;
+
+    case TAG_GPS: {
+        if (len < 28)
+            break;
+        uint32_t t = get32(rec+13);
+        if (t == 0xffffffff || (get32(rec+1) == 0 && get32(rec+5) == 0))
+            break; // no fix
+        if (d->n_gps == TTBIN_BLOCK)
+            fold_gps(d);
+        // nothing to measure the first fix's time from
+        d->gps_dt[d->n_gps] = d->gps_last ? t - d->gps_last : 0;
+        d->gps_speed[d->n_gps++] = get16(rec+11);
+        d->gps_last = t;
+        d->calories = get16(rec+17);
+        d->distance = getf(rec+23);   // the watch's own, cumulative
+        saw_time(d, t);
+        break;
+    }
+
+    case TAG_HR:
+        if (len < 7)
+            break;
+        if (d->n_hr == TTBIN_BLOCK)
+            fold_hr(d);
+        d->hr[d->n_hr++] = rec[1];
+        saw_time(d, get32(rec+3) - d->utc_offset);
+        break;
+    }
+}
+
+/* Feeds the decoder the next len bytes of the file. Records may be split
+ * anywhere between calls. Decoding stops at the first kind of record which
+ * the header doesn't give a length for, since there's no telling where the
+ * next one starts; whatever came before still counts. */
+void
+ttbin_decode(struct ttbin_decoder *d, const void *buf, size_t len)
+{
+    const uint8_t *p = buf, *end = p + len;
+
+    while (p < end && !d->done) {
+        if (!d->need) {
+            if (!d->header)
+                d->need = (*p == TAG_HEADER) ? HEADER_FIXED : 0;
+            else
+                d->need = d->length[*p];
+            if (!d->need || d->need > TTBIN_MAX_RECORD) {
+                d->done = true;
+                break;
+            }
+            d->have = 0;
+        }
+
+        int n = (end - p < d->need - d->have) ? end - p : d->need - d->have;
+        memcpy(d->rec + d->have, p, n);
+        d->have += n;
+        p += n;
+        if (d->have < d->need)
+            break;
+
+        if (!d->header && d->need == HEADER_FIXED) {
+            // now we know how long the rest of the header is
+            d->need += 3 * d->rec[HEADER_FIXED-1];
+            if (d->need > HEADER_FIXED)
+                continue;
+        }
+        if (!d->header)
+            header(d, d->rec, d->need);
+        else
+            record(d, d->rec, d->need);
+        d->need = 0;
+    }
+}
+
+/* Sums up what's been decoded (ignoring a truncated last record). Returns 0,
+ * or -1 if it isn't an activity file. */
+int
+ttbin_decode_finish(struct ttbin_decoder *d, uint32_t fileno, struct ttbin_summary *sum)
+{
+    if (!d->header)
+        return -1;
+    fold_gps(d);
+    fold_hr(d);
+
+    *sum = (struct ttbin_summary){
+        .fileno = fileno,
+        .start = d->start,
+        .duration = d->last - d->first,
+        .moving = d->moving,
+        .distance = d->distance,
+        .calories = d->calories,
+        .activity = d->activity,
+        .hr_avg = d->hr_n ? (d->hr_sum + d->hr_n/2) / d->hr_n : 0,
+        .hr_max = d->hr_max,
+    };
+    return 0;
+}
+
+/****************************************************************************/
+/* The index */
+
+static const struct column {
+    size_t field;               // of the array in SUMMARIES
+    int size;
+} columns[] = {
+    { offsetof(SUMMARIES, fileno), 4 },
+    { offsetof(SUMMARIES, start), 4 },
+    { offsetof(SUMMARIES, duration), 4 },
+    { offsetof(SUMMARIES, moving), 4 },
+    { offsetof(SUMMARIES, distance), 4 },
+    { offsetof(SUMMARIES, calories), 2 },
+    { offsetof(SUMMARIES, activity), 1 },
+    { offsetof(SUMMARIES, hr_avg), 1 },
+    { offsetof(SUMMARIES, hr_max), 1 },
+};
+#define N_COLUMNS (int)(sizeof columns / sizeof *columns)
+
+static inline void **
+column(const SUMMARIES *s, int c)
+{
+    return (void **)((char *)s + columns[c].field);
+}
+
+/* Between the file's little-endian and the host's order; the same both ways */
+static void
+swap_column(void *col, int size, int n)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+    uint8_t *p = col;
+    for (int ii=0; ii<n; ii++, p += size)
+        for (int jj=0; jj<size/2; jj++) {
+            uint8_t t = p[jj];
+            p[jj] = p[size-1-jj];
+            p[size-1-jj] = t;
+        }
+#endif
+}
+
+static int
+grow(SUMMARIES *s, int max)
+{
+    for (int c=0; c<N_COLUMNS; c++) {
+        void *col = realloc(*column(s, c), max * columns[c].size);
+        if (!col)
+            return -1;
+        *column(s, c) = col;
+    }
+    s->max = max;
+    return 0;
+}
+
+/* Loads the summaries in the activity store dir, or starts with none if
+ * there aren't any yet. Returns NULL if they can't be read. */
+SUMMARIES *
+summaries_load(const char *dir)
+{
+    SUMMARIES *s = calloc(1, sizeof *s);
+    char magic[sizeof SUMMARY_MAGIC - 1];
+    uint32_t rows;
+    FILE *f = NULL;
+
+    if (!s || asprintf(&s->path, "%s/%s", dir, SUMMARY_FILE) < 0)
+        goto fail;
+    if (!(f = fopen(s->path, "re"))) {
+        if (errno == ENOENT && grow(s, 64) == 0)
+            return s;
+        fprintf(stderr, "Could not open %s: %s (%d)\n", s->path, strerror(errno), errno);
+        goto fail;
+    }
+
+    if (fread(magic, sizeof magic, 1, f) != 1 || memcmp(magic, SUMMARY_MAGIC, sizeof magic)
+        || fread(&rows, sizeof rows, 1, f) != 1) {
+        fprintf(stderr, "%s is not an activity summary file.\n", s->path);
+        goto fail;
+    }
+    rows = btohl(rows);
+    if (grow(s, rows > 64 ? rows : 64) < 0)
+        goto fail;
+    for (int c=0; c<N_COLUMNS; c++) {
+        if (fread(*column(s, c), columns[c].size, rows, f) != rows) {
+            fprintf(stderr, "%s is truncated.\n", s->path);
+            goto fail;
+        }
+        swap_column(*column(s, c), columns[c].size, rows);
+    }
+    s->n = rows;
+    fclose(f);
+    return s;
+
+fail:
+    if (f)
+        fclose(f);
+    summaries_free(s);
+    return NULL;
+}
+
+void
+summaries_free(SUMMARIES *s)
+{
+    if (s) {
+        for (int c=0; c<N_COLUMNS; c++)
+            free(*column(s, c));
+        free(s->path);
+        free(s);
+    }
+}
+
+/* Adds an activity, or replaces it if it's the same one downloaded again.
+ * Returns 0, or -1 if out of memory. */
+int
+summaries_add(SUMMARIES *s, const struct ttbin_summary *sum)
+{
+    int ii;
+
+    for (ii=0; ii<s->n; ii++)
+        if (s->start[ii] == sum->start && s->fileno[ii] == sum->fileno)
+            break;
+    if (ii == s->max && grow(s, 2*s->max) < 0)
+        return -1;
+    if (ii == s->n)
+        s->n++;
+
+    s->fileno[ii] = sum->fileno;
+    s->start[ii] = sum->start;
+    s->duration[ii] = sum->duration;
+    s->moving[ii] = sum->moving;
+    s->distance[ii] = sum->distance;
+    s->calories[ii] = sum->calories;
+    s->activity[ii] = sum->activity;
+    s->hr_avg[ii] = sum->hr_avg;
+    s->hr_max[ii] = sum->hr_max;
+    return 0;
+}
+
+/* Rewrites the file under a temporary name, flushes it and renames it into
+ * place; the caller should flush the directory. */
+int
+summaries_save(SUMMARIES *s)
+{
+    char *tmp = NULL;
+    uint32_t rows = htobl(s->n);
+    FILE *f = NULL;
+    int res = -1;
+
+    // .activities.summary.part, like the store's own temporary files
+    char *slash = strrchr(s->path, '/');
+    if (asprintf(&tmp, "%.*s.%s.part", (int)(slash+1 - s->path), s->path, slash+1) < 0)
+        return -1;
+    if (!(f = fopen(tmp, "we")))
+        goto fail;
+
+    if (fwrite(SUMMARY_MAGIC, sizeof SUMMARY_MAGIC - 1, 1, f) != 1 || fwrite(&rows, sizeof rows, 1, f) != 1)
+        goto fail;
+    for (int c=0; c<N_COLUMNS; c++) {
+        swap_column(*column(s, c), columns[c].size, s->n);
+        size_t w = fwrite(*column(s, c), columns[c].size, s->n, f);
+        swap_column(*column(s, c), columns[c].size, s->n);
+        if (w != (size_t)s->n)
+            goto fail;
+    }
+    if (fflush(f) != 0 || fdatasync(fileno(f)) < 0)
+        goto fail;
+    res = fclose(f);
+    f = NULL;
+    if (res == 0)
+        res = rename(tmp, s->path);
+
+fail:
+    if (res < 0) {
+        fprintf(stderr, "Could not save %s: %s (%d)\n", tmp, strerror(errno), errno);
+        if (f)
+            fclose(f);
+        unlink(tmp);
+    }
+    free(tmp);
+    return res;
+}
+
+int
+parse_period(const char *str)
+{
+    if (!strcmp(str, "week"))
+        return PERIOD_WEEK;
+    else if (!strcmp(str, "month"))
+        return PERIOD_MONTH;
+    else if (!strcmp(str, "year"))
+        return PERIOD_YEAR;
+    return -1;
+}
+
+struct total {
+    int n;
+    double distance;
+    uint64_t duration, moving, calories;
+    uint64_t hr_sum, hr_secs;   // for an average weighted by duration
+};
+
+static void
+print_total(FILE *f, const char *label, const struct total *t)
+{
+    char pace[32] = "-";
+    double spk = (t->distance >= 1) ? t->moving / (t->distance / 1000) + 0.5 : 0;
+    if (spk >= 1 && spk < 100*60) {
+        // anything slower than 99:59 /km is bad data, from an index on disk
+        int secs = spk;
+        snprintf(pace, sizeof pace, "%d:%02d /km", secs/60, secs%60);
+    }
+    fprintf(f, "%-10s %10d %9.2f km %4llu:%02llu:%02llu %4llu:%02llu:%02llu %10s %6llu %7llu\n", label,
+            t->n, t->distance / 1000,
+            (unsigned long long)t->duration/3600, (unsigned long long)t->duration/60%60, (unsigned long long)t->duration%60,
+            (unsigned long long)t->moving/3600, (unsigned long long)t->moving/60%60, (unsigned long long)t->moving%60,
+            pace, (unsigned long long)(t->hr_secs ? t->hr_sum / t->hr_secs : 0), (unsigned long long)t->calories);
+}
+
+/* Prints the totals for each week (starting on Monday), month or year with
+ * any activities in it, and overall. Returns 0, or -1 if out of memory. */
+int
+summaries_totals(const SUMMARIES *s, int period, FILE *f)
+{
+    static const char *heading[] = { [PERIOD_WEEK] = "Week of", [PERIOD_MONTH] = "Month", [PERIOD_YEAR] = "Year" };
+    int32_t *key = malloc((s->n ? s->n : 1) * sizeof *key);
+    int32_t lo = INT32_MAX, hi = INT32_MIN;
+    struct total *t = NULL, all = { 0 };
+    struct tm tm;
+
+    if (!key)
+        return -1;
+
+    // start times are local already, so gmtime gives the local calendar
+    if (period == PERIOD_WEEK)
+        for (int ii=0; ii<s->n; ii++)
+            key[ii] = (s->start[ii] / 86400 + 3) / 7; // 1970-01-01 was a Thursday
+    else
+        for (int ii=0; ii<s->n; ii++) {
+            time_t when = s->start[ii];
+            gmtime_r(&when, &tm);
+            key[ii] = (period == PERIOD_MONTH) ? tm.tm_year*12 + tm.tm_mon : tm.tm_year;
+        }
+    for (int ii=0; ii<s->n; ii++) {
+        lo = key[ii] < lo ? key[ii] : lo;
+        hi = key[ii] > hi ? key[ii] : hi;
+    }
+
+    if (s->n && !(t = calloc(hi - lo + 1, sizeof *t))) {
+        free(key);
+        return -1;
+    }
+    for (int ii=0; ii<s->n; ii++) {
+        struct total *b = &t[key[ii] - lo];
+        b->n++;
+        b->distance += s->distance[ii];
+        b->duration += s->duration[ii];
+        b->moving += s->moving[ii];
+        b->calories += s->calories[ii];
+        if (s->hr_avg[ii]) {
+            b->hr_sum += (uint64_t)s->hr_avg[ii] * s->duration[ii];
+            b->hr_secs += s->duration[ii];
+        }
+    }
+
+    fprintf(f, "%-10s %10s %12s %10s %10s %10s %6s %7s\n", heading[period],
+            "Activities", "Distance", "Time", "Moving", "Pace", "Avg HR", "Calories");
+    for (int32_t k=lo; s->n && k<=hi; k++) {
+        struct total *b = &t[k - lo];
+        char label[16];
+
+        if (!b->n)
+            continue;
+        if (period == PERIOD_WEEK) {
+            time_t monday = ((time_t)k*7 - 3) * 86400;
+            gmtime_r(&monday, &tm);
+            strftime(label, sizeof label, "%Y-%m-%d", &tm);
+        } else if (period == PERIOD_MONTH)
+            snprintf(label, sizeof label, "%d-%02d", 1900 + k/12, k%12 + 1);
+        else
+            snprintf(label, sizeof label, "%d", 1900 + k);
+        print_total(f, label, b);
+
+        all.n += b->n;
+        all.distance += b->distance;
+        all.duration += b->duration;
+        all.moving += b->moving;
+        all.calories += b->calories;
+        all.hr_sum += b->hr_sum;
+        all.hr_secs += b->hr_secs;
+    }
+    print_total(f, "Total", &all);
+
+    free(t);
+    free(key);
+    return 0;
+}
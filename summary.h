@@ -0,0 +1,92 @@
+#ifndef __SUMMARY_H__
+#define __SUMMARY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Activity summaries (distance, time, heart rate...), worked out once as each
+ * activity file is saved, so that nothing needs to read the .ttbin files
+ * again to answer questions like "how far did I run each week?".
+ *
+ * The decoder is fed the file in chunks, as the store writes it. GPS and
+ * heart rate samples are collected into a column for each field, which are
+ * folded into the running totals every TTBIN_BLOCK samples, in simple loops
+ * that the compiler can vectorize.
+ *
+ * The summaries go into one file in the activity store, SUMMARY_FILE, which
+ * is columnar too:
+ *   "TTBLUES1", uint32_t rows, then each column in turn (rows values each,
+ *   in the order of struct ttbin_summary)
+ * (little-endian), so that a query only has to go through the columns it
+ * needs. It's small enough to be rewritten whole at each checkpoint.
+ */
+
+#define SUMMARY_FILE "activities.summary"
+#define SUMMARY_MAGIC "TTBLUES1"
+
+#define TTBIN_BLOCK 256         // samples of each kind, between folds
+#define TTBIN_MAX_RECORD 1024   // the header, with a length for every kind of record
+
+struct ttbin_summary {
+    uint32_t fileno;
+    uint32_t start;             // local time, as seconds since 1970
+    uint32_t duration;          // seconds, from the first sample to the last
+    uint32_t moving;            // seconds spent moving, going by the GPS
+    float distance;             // metres
+    uint16_t calories;
+    uint8_t activity;           // as in the watch's status records: 0 running, 1 cycling, 2 swimming...
+    uint8_t hr_avg, hr_max;     // bpm, or 0 without a heart rate sensor
+};
+
+struct ttbin_decoder {
+    uint16_t length[256];       // of each kind of record, including the tag; 0 if unknown
+    uint8_t rec[TTBIN_MAX_RECORD];
+    int have, need;             // bytes of the current record
+    bool header, done;
+
+    uint32_t start;
+    int32_t utc_offset;
+    uint8_t activity;
+
+    // samples since the last fold
+    int n_gps, n_hr;
+    uint32_t gps_dt[TTBIN_BLOCK];       // seconds since the fix before
+    uint32_t gps_speed[TTBIN_BLOCK];    // cm/s
+    uint8_t hr[TTBIN_BLOCK];
+    uint32_t gps_last;                  // time of the last fix (UTC)
+
+    // totals of the samples folded so far
+    uint32_t first, last, moving;
+    float distance;
+    uint16_t calories;
+    uint64_t hr_sum;
+    uint32_t hr_n;
+    uint8_t hr_max;
+};
+
+void ttbin_decode_init(struct ttbin_decoder *d);
+void ttbin_decode(struct ttbin_decoder *d, const void *buf, size_t len);
+int ttbin_decode_finish(struct ttbin_decoder *d, uint32_t fileno, struct ttbin_summary *sum);
+
+typedef struct summaries {
+    char *path;
+    int n, max;
+    // one array per column, in the order of the file
+    uint32_t *fileno, *start, *duration, *moving;
+    float *distance;
+    uint16_t *calories;
+    uint8_t *activity, *hr_avg, *hr_max;
+} SUMMARIES;
+
+enum { PERIOD_WEEK, PERIOD_MONTH, PERIOD_YEAR };
+
+SUMMARIES *summaries_load(const char *dir);
+void summaries_free(SUMMARIES *s);
+int summaries_add(SUMMARIES *s, const struct ttbin_summary *sum);
+int summaries_save(SUMMARIES *s);
+int summaries_totals(const SUMMARIES *s, int period, FILE *f);
+int parse_period(const char *str);
+
+#endif /* __SUMMARY_H__ */
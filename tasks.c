@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "tasks.h"
+
+#define TASK_AGE_BONUS 5        // priority gained per session spent waiting
+#define TASK_EWMA 0.3           // weight of the newest measurement
+
+enum { DIR_NONE, DIR_RX, DIR_TX };
+
+static const struct task_kind_info {
+    const char *name;
+    int prio, dir;
+    double fixed_secs;          // until measured
+    long bytes;
+} kinds[TASK_KINDS] = {
+    // deletes are cheap, and free space on the watch (and don't re-download what we have)
+    [TASK_DELETE]   = { "delete",     90, DIR_NONE, 0.2 },
+    [TASK_LIST]     = { "list",       80, DIR_NONE, 0.3 },
+    [TASK_ACTIVITY] = { "activity",   70, DIR_RX,   0.3, 60000 },
+    [TASK_TIME]     = { "time",       60, DIR_NONE, 0.2 },
+    [TASK_RM]       = { "rm",         50, DIR_NONE, 0.2 },
+    [TASK_UPLOAD]   = { "upload",     50, DIR_TX,   0.5 },
+    [TASK_GET]      = { "get",        50, DIR_RX,   0.5, 60000 },
+    [TASK_LS]       = { "ls",         50, DIR_NONE, 3.0 },
+    [TASK_SETTINGS] = { "settings",   40, DIR_NONE, 2.0 },
+    [TASK_TRACKING] = { "tracking",   30, DIR_RX,   1.0, 4096 },
+    // QuickFix data is only good for a few days, and the watch can always find satellites without it
+    [TASK_GPS]      = { "gps",        20, DIR_TX,   2.0, 30000 },
+    [TASK_HOSTNAME] = { "hostname",   10, DIR_TX,   0.2 },
+};
+
+const char *
+task_name(int kind)
+{
+    return kind >= 0 && kind < TASK_KINDS ? kinds[kind].name : "?";
+}
+
+void
+tasks_init(TASKS *s, double budget)
+{
+    memset(s, 0, sizeof *s);
+    s->budget = budget;
+    for (int k=0; k<TASK_KINDS; k++) {
+        s->fixed_secs[k] = kinds[k].fixed_secs;
+        s->kind_bytes[k] = kinds[k].bytes;
+    }
+    // about what a v1 watch manages without a shorter connection interval
+    s->rx_rate = s->tx_rate = 500;
+    gettimeofday(&s->start, NULL);
+}
+
+void
+tasks_free(TASKS *s)
+{
+    free(s->q);
+    s->q = NULL;
+    s->n = s->max = 0;
+}
+
+static int
+find(const TASKS *s, int kind, uint32_t fileno)
+{
+    for (int ii=0; ii<s->n; ii++)
+        if (s->q[ii].kind == kind && s->q[ii].fileno == fileno)
+            return ii;
+    return -1;
+}
+
+bool
+tasks_queued(const TASKS *s, int kind, uint32_t fileno)
+{
+    return find(s, kind, fileno) >= 0;
+}
+
+/* Queues a task, unless the same one is already waiting. Returns 1 if
+ * queued, 0 if already there, -1 on failure. */
+int
+tasks_add(TASKS *s, int kind, uint32_t fileno, long bytes)
+{
+    if (find(s, kind, fileno) >= 0)
+        return 0;
+    if (s->n == s->max) {
+        int max = s->max ? 2*s->max : 16;
+        struct task *q = realloc(s->q, max * sizeof *q);
+        if (!q)
+            return -1;
+        s->q = q;
+        s->max = max;
+    }
+    s->q[s->n++] = (struct task){ .kind = kind, .fileno = fileno, .bytes = bytes };
+    return 1;
+}
+
+static void
+remove_at(TASKS *s, int ii)
+{
+    memmove(&s->q[ii], &s->q[ii+1], (s->n - ii - 1) * sizeof *s->q);
+    s->n--;
+}
+
+void
+tasks_drop(TASKS *s, int kind)
+{
+    for (int ii=0; ii<s->n; )
+        if (s->q[ii].kind == kind)
+            remove_at(s, ii);
+        else
+            ii++;
+}
+
+double
+tasks_estimate(const TASKS *s, const struct task *t)
+{
+    const struct task_kind_info *k = &kinds[t->kind];
+    double secs = s->fixed_secs[t->kind];
+    double bytes = t->bytes ? t->bytes : s->kind_bytes[t->kind];
+
+    if (k->dir == DIR_RX)
+        secs += bytes / s->rx_rate;
+    else if (k->dir == DIR_TX)
+        secs += bytes / s->tx_rate;
+    return secs;
+}
+
+/* Seconds left in this session's budget (which may be negative), or a day if unlimited */
+double
+tasks_left(const TASKS *s)
+{
+    return s->budget > 0 ? s->budget - elapsed_secs(&s->start) : 86400;
+}
+
+/* Starts the budget for a new session, which should be right after connecting */
+void
+tasks_begin(TASKS *s)
+{
+    gettimeofday(&s->start, NULL);
+    s->ran = 0;
+}
+
+static inline int
+priority(const struct task *t)
+{
+    return kinds[t->kind].prio + TASK_AGE_BONUS * t->age;
+}
+
+/* Picks the next task to run: the highest priority one whose estimated cost
+ * fits in the time left (earliest queued first, among equals), but always
+ * the top one at the start of a session, so that a task which is bigger
+ * than the whole budget still gets done. The task stays queued until
+ * tasks_done, so a task which fails is carried over like one that didn't
+ * get to run. Returns 1 with the task in *t, or 0 if there's nothing (more)
+ * to do in this session. */
+int
+tasks_next(TASKS *s, struct task *t)
+{
+    double left = tasks_left(s);
+    int best = -1;
+
+    for (int ii=0; ii<s->n; ii++) {
+        if (best >= 0 && priority(&s->q[ii]) <= priority(&s->q[best]))
+            continue;
+        if (s->ran > 0 && tasks_estimate(s, &s->q[ii]) > left)
+            continue;
+        best = ii;
+    }
+    if (best < 0)
+        return 0;
+    *t = s->q[best];
+    return 1;
+}
+
+static inline double
+ewma(double avg, double sample)
+{
+    return avg + TASK_EWMA * (sample - avg);
+}
+
+/* Takes a finished task off the queue, learning from how many bytes it moved
+ * and how long it took */
+void
+tasks_done(TASKS *s, const struct task *t, long bytes, double secs)
+{
+    int ii = find(s, t->kind, t->fileno);
+    if (ii >= 0)
+        remove_at(s, ii);
+    s->ran++;
+
+    const struct task_kind_info *k = &kinds[t->kind];
+    if (k->dir != DIR_NONE && !t->bytes)
+        s->kind_bytes[t->kind] = ewma(s->kind_bytes[t->kind], bytes);
+
+    if (k->dir != DIR_NONE && bytes >= TASK_MIN_BYTES) {
+        // whatever took longer than the usual overhead was the transfer
+        double xfer = secs - s->fixed_secs[t->kind];
+        if (xfer < secs/2)
+            xfer = secs/2;
+        double *rate = (k->dir == DIR_RX) ? &s->rx_rate : &s->tx_rate;
+        *rate = ewma(*rate, bytes / xfer);
+    } else
+        s->fixed_secs[t->kind] = ewma(s->fixed_secs[t->kind], secs);
+}
+
+/* Ends a session: whatever is still queued waits for the next one, with a
+ * higher priority. Returns the number of tasks carried over. */
+int
+tasks_end(TASKS *s, bool verbose)
+{
+    if (verbose && s->n) {
+        fprintf(stderr, "Carrying over %d task(s) to the next session:", s->n);
+        for (int ii=0; ii<s->n; ii++) {
+            if (s->q[ii].fileno)
+                fprintf(stderr, " %s 0x%08x", task_name(s->q[ii].kind), s->q[ii].fileno);
+            else
+                fprintf(stderr, " %s", task_name(s->q[ii].kind));
+        }
+        fputc('\n', stderr);
+    }
+    for (int ii=0; ii<s->n; ii++)
+        s->q[ii].age++;
+    return s->n;
+}
@@ -0,0 +1,71 @@
+#ifndef __TASKS_H__
+#define __TASKS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+/**
+ * Per-session task scheduler: everything a session does with the watch is
+ * queued as a task with a priority and an estimated cost, and run highest
+ * priority first while the estimate still fits in what's left of the
+ * session's time budget (counted from the connection). Tasks which don't
+ * get to run are carried over to the next session, where each session
+ * they've waited adds to their priority, so nothing waits forever.
+ *
+ * The cost of a task is its fixed overhead plus the bytes it's expected to
+ * move (its own size, where known, otherwise what tasks of its kind have
+ * moved recently) at the throughput measured so far in that direction.
+ */
+
+enum task_kind {
+    TASK_DELETE,        // an activity which is safely in the store
+    TASK_LIST,          // list the activities on the watch, queueing a TASK_ACTIVITY for each
+    TASK_ACTIVITY,
+    TASK_TIME,
+    TASK_RM,            // --rm
+    TASK_UPLOAD,        // --upload
+    TASK_GET,           // --get
+    TASK_LS,            // --ls
+    TASK_SETTINGS,      // --setting, and the time zone where the clock can't be set directly
+    TASK_TRACKING,
+    TASK_GPS,
+    TASK_HOSTNAME,
+    TASK_KINDS
+};
+
+#define TASK_MIN_BYTES 4096     // smaller transfers only tell us about the fixed overhead
+
+struct task {
+    int kind;
+    uint32_t fileno;            // activity, or --get/--rm file ID
+    long bytes;                 // expected size, or 0 if unknown
+    int age;                    // sessions it's been carried over
+};
+
+typedef struct tasks {
+    struct task *q;
+    int n, max;
+    double budget;              // seconds per session, or 0 for no limit
+    struct timeval start;
+    int ran;                    // tasks completed this session
+    // moving averages of what's been measured
+    double fixed_secs[TASK_KINDS]; // overhead of each kind of task
+    double kind_bytes[TASK_KINDS]; // and how much it moves
+    double rx_rate, tx_rate;    // from and to the watch, in bytes/s
+} TASKS;
+
+void tasks_init(TASKS *s, double budget);
+void tasks_free(TASKS *s);
+int tasks_add(TASKS *s, int kind, uint32_t fileno, long bytes);
+bool tasks_queued(const TASKS *s, int kind, uint32_t fileno);
+void tasks_drop(TASKS *s, int kind);
+void tasks_begin(TASKS *s);
+int tasks_next(TASKS *s, struct task *t);
+void tasks_done(TASKS *s, const struct task *t, long bytes, double secs);
+int tasks_end(TASKS *s, bool verbose);
+double tasks_estimate(const TASKS *s, const struct task *t);
+double tasks_left(const TASKS *s);
+const char *task_name(int kind);
+
+#endif /* __TASKS_H__ */
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "tracking.h"
+#include "ttblue.h"
+
+// what's already in the log for each bucket, kept in the device cache
+struct tracking_idx { uint16_t sub; uint32_t length; uint64_t hash; } __attribute__((packed));
+
+static int
+cmp_u16(const void *a, const void *b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static struct tracking_idx *
+find_idx(struct tracking_idx *idx, int n, uint16_t sub)
+{
+    for (int ii=0; ii<n; ii++)
+        if (idx[ii].sub == sub)
+            return &idx[ii];
+    return NULL;
+}
+
+static int
+append_rec(int fd, uint32_t fileno, uint32_t offset, const uint8_t *buf, uint32_t length)
+{
+    struct tracking_rec rec = { htobl(fileno), htobl(offset), htobl(length) };
+    struct iovec iov[2] = { { &rec, sizeof rec }, { (void *)buf, length } };
+    ssize_t want = sizeof rec + length;
+
+    // O_APPEND makes this one write, so a crash can only leave a truncated last record
+    return (writev(fd, iov, 2) == want) ? 0 : -1;
+}
+
+/* Appends new tracking data to the log; returns the number of bytes added, or -1 */
+long
+tracking_sync(TTDEV *ttd, DEVCACHE *cache, const char *store_dir, int debug)
+{
+    uint16_t *list = NULL;
+    uint8_t *cached = NULL;
+    struct tracking_idx *old = NULL, *idx = NULL;
+    int n_old = 0, fd = -1;
+    long added = 0;
+    char *path = NULL;
+
+    int n_files = tt_list_sub_files(ttd, TTBLUE_FILE_STEP_BUCKET, &list);
+    if (n_files < 0) {
+        fprintf(stderr, "Could not list tracking files on watch!\n");
+        return -1;
+    }
+    qsort(list, n_files, sizeof *list, cmp_u16);
+
+    int clen;
+    if (cache && (clen = devcache_get(cache, TTBLUE_FILE_STEP_BUCKET, &cached)) > 0) {
+        old = (struct tracking_idx *)cached;
+        n_old = clen / sizeof *old;
+    }
+    if (!(idx = calloc(n_files + 1, sizeof *idx)))
+        goto fail;
+
+    if (asprintf(&path, "%s/%s", store_dir, TRACKING_LOG) < 0) {
+        path = NULL;
+        goto fail;
+    }
+    if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "Could not open %s: %s (%d)\n", path, strerror(errno), errno);
+        goto fail;
+    }
+
+    for (int ii=0; ii<n_files; ii++) {
+        uint32_t fileno = TTBLUE_FILE_STEP_BUCKET + list[ii];
+        struct tracking_idx *o = find_idx(old, n_old, list[ii]);
+        // the newest bucket may still be growing, and so may the one
+        // which was newest last time, until the watch moved on from it
+        bool growing = (ii == n_files-1) || (o && o == &old[n_old-1]);
+
+        idx[ii] = o ? *o : (struct tracking_idx){ .sub = list[ii] };
+        if (o && !growing)
+            continue; // finished bucket, which we already have
+
+        uint8_t *fbuf;
+        int length;
+        if (debug > 1)
+            fprintf(stderr, "  Reading tracking file 0x%08x ...\n", fileno);
+        if ((length = tt_read_file(ttd, fileno, debug>1, &fbuf)) < 0) {
+            fprintf(stderr, "Could not read tracking file 0x%08x from watch!\n", fileno);
+            goto fail;
+        }
+
+        // normally the bucket has only grown; if not, store all of it again
+        uint32_t from = 0;
+        if (o && length >= o->length && fnv1a64(fbuf, o->length) == o->hash)
+            from = o->length;
+
+        if ((uint32_t)length > from) {
+            if (append_rec(fd, fileno, from, fbuf + from, length - from) < 0) {
+                fprintf(stderr, "Could not append to %s: %s (%d)\n", path, strerror(errno), errno);
+                tt_free(ttd, fbuf);
+                goto fail;
+            }
+            added += length - from;
+        }
+        idx[ii].length = length;
+        idx[ii].hash = fnv1a64(fbuf, length);
+        tt_free(ttd, fbuf);
+    }
+
+    // the log must be on disk before the index says so
+    if (fdatasync(fd) < 0 || close(fd) < 0) {
+        fd = -1;
+        fprintf(stderr, "Could not flush %s: %s (%d)\n", path, strerror(errno), errno);
+        goto fail;
+    }
+    fd = -1;
+    if (cache)
+        devcache_put(cache, TTBLUE_FILE_STEP_BUCKET, (uint8_t *)idx, n_files * sizeof *idx);
+
+    if (debug)
+        fprintf(stderr, "  Added %ld bytes of tracking data from %d bucket(s) to %s\n", added, n_files, path);
+    tt_free(ttd, list);
+    free(cached);
+    free(idx);
+    free(path);
+    return added;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    tt_free(ttd, list);
+    free(cached);
+    free(idx);
+    free(path);
+    return -1;
+}
@@ -0,0 +1,30 @@
+#ifndef __TRACKING_H__
+#define __TRACKING_H__
+
+#include <stdint.h>
+
+#include "ttops.h"
+#include "devcache.h"
+
+/**
+ * Incremental sync of all-day tracking data (steps, sleep...), which the
+ * watch keeps as sub-files of TTBLUE_FILE_STEP_BUCKET. Only the newest
+ * bucket is still growing, so the older ones are read once; the newest is
+ * re-read each time, but only what was added to it since is stored.
+ *
+ * Everything goes into one append-only log in the activity store,
+ * tracking.log, as records of
+ *   { uint32_t fileno, offset, length; uint8_t data[length]; }
+ * (little-endian), which can be replayed in order to rebuild each bucket
+ * file. Replaying is idempotent, so records repeated after an interrupted
+ * sync do no harm.
+ * The per-device cache remembers how much of each bucket is already there.
+ */
+
+#define TRACKING_LOG "tracking.log"
+
+struct tracking_rec { uint32_t fileno, offset, length; } __attribute__((packed));
+
+long tracking_sync(TTDEV *ttd, DEVCACHE *cache, const char *store_dir, int debug);
+
+#endif /* __TRACKING_H__ */
@@ -11,18 +11,17 @@
 #include <stdio.h>
 #include <time.h>
 #include <ctype.h>
+#include <fcntl.h>
 
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
-#include <bluetooth/l2cap.h>
-
-#include <curl/curl.h>
 
 #include <popt.h>
 
@@ -30,19 +29,17 @@
 #include "ttops.h"
 #include "util.h"
 #include "ttblue.h"
-
-const char *PLEASE_SETCAP_ME =
-    "**********************************************************\n"
-    "NOTE: This program lacks the permissions necessary for\n"
-    "  manipulating the raw Bluetooth HCI socket, which\n"
-    "  is required for scanning and for setting the minimum\n"
-    "  connection inverval to speed up data transfer.\n\n"
-    "  To fix this, run it as root or, better yet, set the\n"
-    "  following capabilities on the ttblue executable:\n\n"
-    "    # sudo setcap 'cap_net_raw,cap_net_admin+eip' ttblue\n\n"
-    "  For gory details, see the BlueZ mailing list:\n"
-    "    http://thread.gmane.org/gmane.linux.bluez.kernel/63778\n"
-    "**********************************************************\n";
+#include "daemon.h"
+#include "store.h"
+#include "pace.h"
+#include "hcilink.h"
+#include "manifest.h"
+#include "notify.h"
+#include "replay.h"
+#include "sim.h"
+#include "tasks.h"
+#include "session.h"
+#include "btlink.h"
 
 const char *PAIRING_MODE_PROMPT =
     "****************************************************************\n"
@@ -50,10 +47,6 @@ const char *PAIRING_MODE_PROMPT =
     "****************************************************************\n"
     "Press Enter to continue: ";
 
-const char *PAIRING_CODE_PROMPT =
-    "\n**************************************************\n"
-    "Enter 6-digit pairing code shown on device: ";
-
 #define GQF_GPS_URL "https://gpsquickfix.services.tomtom.com/fitness/sifgps.f2p3enc.ee?timestamp=%ld"
 #define GQF_GLONASS_URL "https://gpsquickfix.services.tomtom.com/fitness/sifglo.f2p3enc.ee?timestamp=%ld"
 // Found an alternate source for the ephemeris file: https://github.com/felixge/node-ar-drone/issues/74#issuecomment-25722745
@@ -61,237 +54,43 @@ const char *PAIRING_CODE_PROMPT =
 // accept 3-day version
 #define GQF_GPS_ALT_URL "https://download.parrot.com/ephemerides/packedDifference.f2p3enc.ee?timestamp=%ld"
 
-/**
- * taken from bluez/tools/btgatt-client.c
- *
- */
-
-#define ATT_CID 4
-static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
-                                int sec, int verbose)
-{
-    int sock;
-    struct sockaddr_l2 srcaddr, dstaddr;
-    struct bt_security btsec;
-
-    if (verbose) {
-        char srcaddr_str[18], dstaddr_str[18];
-
-        ba2str(src, srcaddr_str);
-        ba2str(dst, dstaddr_str);
-
-        fprintf(stderr, "Opening L2CAP LE connection on ATT "
-                        "channel:\n\t src: %s\n\tdest: %s (%s)\n",
-                srcaddr_str, dstaddr_str, addr_type_name(dst_type));
-    }
-
-    sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-    if (sock < 0) {
-        fprintf(stderr, "Failed to create L2CAP socket: %s (%d)\n", strerror(errno), errno);
-        return -1;
-    }
-
-    /* Set up source address */
-    memset(&srcaddr, 0, sizeof(srcaddr));
-    srcaddr.l2_family = AF_BLUETOOTH;
-    srcaddr.l2_cid = htobs(ATT_CID);
-    srcaddr.l2_bdaddr_type = 0;
-    bacpy(&srcaddr.l2_bdaddr, src);
-
-    if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
-        fprintf(stderr, "Failed to bind L2CAP socket: %s (%d)\n", strerror(errno), errno);
-        close(sock);
-        return -1;
-    }
-
-    /* Set the security level */
-    memset(&btsec, 0, sizeof(btsec));
-    btsec.level = sec;
-    if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
-                            sizeof(btsec)) != 0) {
-        fprintf(stderr, "Failed to set L2CAP security level: %s (%d)\n", strerror(errno), errno);
-        close(sock);
-        return -1;
-    }
-
-    /* Set up destination address */
-    memset(&dstaddr, 0, sizeof(dstaddr));
-    dstaddr.l2_family = AF_BLUETOOTH;
-    dstaddr.l2_cid = htobs(ATT_CID);
-    dstaddr.l2_bdaddr_type = dst_type;
-    bacpy(&dstaddr.l2_bdaddr, dst);
-
-    if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
-        close(sock);
-        return -2;
-    }
-
-    return sock;
-}
-
-/**
- * based on bluez/tools/hcitool.c
- *
- * If dst is set to all zeros (BDADDRY_ANY), then it returns the
- * first TomTom device address seen, otherwise it waits for the
- * exact matching address.
- *
- */
-
-static void
-nullhandler(int signal) {}
-
 static int
-hci_tt_scan(int dd, bdaddr_t *dst, uint8_t *dst_type, int verbose)
+parse_fileid(const char *s, uint32_t *fileno)
 {
-    unsigned char buf[HCI_MAX_EVENT_SIZE];
-    struct hci_filter nf, of;
-    int len;
-    socklen_t olen = sizeof(of);
-    char addr_str[18];
-    le_advertising_info *info;
-
-    hci_le_set_scan_enable(dd, 0, 0, 10000); // disable in case already enabled
-    if (hci_le_set_scan_parameters(dd, /* passive */ 0x00, htobs(0x10), htobs(0x10), LE_PUBLIC_ADDRESS, 0x00, 10000) < 0) {
-        fprintf(stderr, "Failed to set BLE scan parameters: %s (%d)\n", strerror(errno), errno);
+    char *end;
+    unsigned long val = strtoul(s, &end, 0);
+    if (*end || end == s || (val>>24))
         return -1;
-    }
-    if (hci_le_set_scan_enable(dd, 0x01, /* include dupes */ 0x00, 10000) < 0) {
-        fprintf(stderr, "Failed to enable BLE scan: %s (%d)\n", strerror(errno), errno);
-        return -1;
-    }
-
-    // save HCI filter and set it to capture all LE events
-    if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0)
-        return -1;
-
-    hci_filter_clear(&nf);
-    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
-
-    if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
-        return -1;
-
-    struct sigaction sa = { .sa_handler = nullhandler };
-    sigaction(SIGINT, &sa, NULL);
-
-    for (;;) {
-        if ((len = read(dd, buf, sizeof(buf))) < 0) {
-            if (errno == EAGAIN)
-                continue;
-            else
-                goto done;
-        }
-
-        evt_le_meta_event *meta = (void *)(buf + HCI_EVENT_HDR_SIZE + 1);
-        if (meta->subevent == EVT_LE_ADVERTISING_REPORT) {
-            info = (void *)(meta->data + 1);
-            ba2str(&info->bdaddr, addr_str);
-            if (!strncmp(addr_str, "E4:04:39", 8)) {
-                fprintf(stderr, "Saw a TomTom device (%s)    \r", addr_str);
-                if (!bacmp(dst, BDADDR_ANY))
-                    goto gotcha;
-            } else if (verbose)
-                fprintf(stderr, "Saw a non-TomTom device (%s)\r", addr_str);
-            if (!bacmp(dst, &info->bdaddr))
-                goto gotcha;
-        }
-    }
-
-gotcha:
-    /**
-     * confusion alert: Bluez defines these constants as
-     * BDADDR_LE_RANDOM=0x02 and BDADDR_LE_PUBLIC=0x01,
-     * ... but in the le_advertising_info wire packets:
-     * 0 means _PUBLIC and non-0 means _RANDOM
-     * (see bluez/emulator/bthost.c
-     *
-     */
-    *dst_type = (info->bdaddr_type==0 ? BDADDR_LE_PUBLIC : BDADDR_LE_RANDOM);
-    bacpy(dst, &info->bdaddr);
-
-done:
-    fputc('\n', stderr);
-    signal(SIGINT, NULL);
-    if (setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of)) < 0)
-        return -1;
-    if (hci_le_set_scan_enable(dd, 0x00, 1, 10000) < 0)
-        return -1;
-    if (len < 0)
-        return -1;
-
+    *fileno = val;
     return 0;
 }
 
-time_t
-read_gqf_status(TTDEV *ttd, int debug)
-{
-    time_t last_update = 0;
-    uint8_t *fbuf;
-    int length;
-    if ((length=tt_read_file(ttd, TTBLUE_FILE_GPS_STATUS, debug, &fbuf)) < 0) {
-        fprintf(stderr, "WARNING: Could not read GPS status file 0x%08x from watch.\n", TTBLUE_FILE_GPS_STATUS);
-        last_update = -1;
-    } else {
-#ifdef DUMP_0x00020001
-        save_buf_to_file(make_tt_filename(TTBLUE_FILE_GPS_STATUS, "bin"), "wxb", fbuf, length, 2, true);
-#endif
-        if (length > 6 && (fbuf[0x02] | fbuf[0x03] | fbuf[0x04] | fbuf[0x05]) != 0) {
-            struct tm tmp = { .tm_mday = fbuf[0x05], .tm_mon = fbuf[0x04]-1, .tm_year = (((int)fbuf[0x02])<<8) + fbuf[0x03] - 1900 };
-            last_update = timegm(&tmp);
-        }
-        free(fbuf);
-    }
-    return last_update;
-}
-
-const char *
-make_tt_filename(uint32_t fileno, char *ext)
-{
-    char filetime[16];
-    static char filename[32];
-    time_t t = time(NULL);
-    struct tm *tmp = localtime(&t);
-    strftime(filetime, sizeof filetime, "%Y%m%d_%H%M%S", tmp);
-    sprintf(filename, "%08x_%s.%s", fileno, filetime, ext);
-    return filename;
-}
-
-static int
-save_buf_to_file(const char *filename, const char *mode, const void *fbuf, int length, int indent, int verbose)
-{
-    char istr[indent+1];
-    memset(istr, ' ', indent);
-    istr[indent] = 0;
-    FILE *f;
-
-    if ((f = fopen(filename, mode)) == NULL) {
-        fprintf(stderr, "%sCould not open %s: %s (%d)\n", istr, filename, strerror(errno), errno);
-        return -1;
-    } else if (fwrite(fbuf, length, 1, f) != 1) {
-        fclose(f);
-        fprintf(stderr, "%sCould not save to %s: %s (%d)\n", istr, filename, strerror(errno), errno);
-        return -2;
-    } else {
-        fclose(f);
-        if (verbose)
-            fprintf(stderr, "%sSaved %d bytes to %s\n", istr, length, filename);
-        return 0;
-    }
-}
-
 /****************************************************************************/
 
 int debug=1;
-int get_activities=0, set_time=0, update_gps=0, version=0, daemonize=0, new_pair=1;
-int sleep_success=3600, sleep_fail=10;
-char dev_code[6];
+int get_activities=0, set_time=0, update_gps=0, version=0, daemonize=0, new_pair=1, get_tracking=0;
+int sleep_success=3600, sleep_fail=10, sync_batch=8, realtime=0, time_budget=0;
+int time_cmd=0;
 char *read_code;
 char *activity_store=".", *dev_address=NULL, *interface=NULL, *postproc=NULL, *gqf_url=GQF_GPS_URL;
+char *ctl_path=NULL, *upload_id=NULL, *io_backend="batched", *cache_dir=NULL, *notify_path=NULL;
+char *capture_path=NULL, *replay_path=NULL;
+char *archive_path=NULL, *archive_dict=NULL, *extract_name=NULL, *totals=NULL;
+int archive_ls=0;
+int replay_fast=0;
+int simulate=0;
+struct sim_params sim = SIM_DEFAULTS;
+int n_settings=0, force_write=0;
+struct setting_req *settings=NULL;
+int list_all=0, n_get=0, n_rm=0;
+uint32_t *get_ids=NULL, *rm_ids=NULL;
+const char *upload_path=NULL;
+uint32_t upload_fileno;
 
 struct poptOption options[] = {
     { "auto", 'a', POPT_ARG_NONE, NULL, 0, "Same as --get-activities --update-gps --set-time --version" },
     { "get-activities", 0, POPT_ARG_NONE, &get_activities, 1, "Downloads and deletes .ttbin activity files from the watch" },
+    { "tracking", 0, POPT_ARG_NONE, &get_tracking, 30, "Copy new all-day tracking data (steps, sleep...) from the watch into the activity store" },
     { "set-time", 0, POPT_ARG_NONE, &set_time, 2, "Set time zone on the watch to match this computer" },
     { "activity-store", 's', POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT, &activity_store, 3, "Location to store .ttbin activity files", "PATH" },
     { "post", 'p', POPT_ARG_STRING, &postproc, 4, "Command to run (with .ttbin file as argument) for every activity file", "CMD" },
@@ -308,6 +107,31 @@ struct poptOption options[] = {
     { "wait-success", 'w', POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT, &sleep_success, 15, "Wait time after successful connection to watch", "SECONDS" },
     { "wait-fail", 'W', POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT, &sleep_fail, 16, "Wait time after failed connection to watch", "SECONDS" },
 //    { "no-config", 'C', POPT_ARG_NONE, &config, 17, "Do not load or save settings from ~/.ttblue config file" },
+    { "sync-batch", 0, POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT, &sync_batch, 19, "Flush activity files to disk (and delete them from the watch) in batches of this many", "N" },
+    { "upload", 0, POPT_ARG_STRING, &upload_id, 20, "Replace file FILEID on the watch with the contents of PATH", "FILEID PATH" },
+    { "ls", 0, POPT_ARG_NONE, &list_all, 21, "List the sub-files of all known file IDs on the watch" },
+    { "get", 0, POPT_ARG_STRING, NULL, 22, "Copy file FILEID from the watch into the activity store; for a parent ID like 0x00b10000, copy all its sub-files; 'all' copies everything (may be repeated)", "FILEID" },
+    { "rm", 0, POPT_ARG_STRING, NULL, 23, "Delete file FILEID from the watch (may be repeated)", "FILEID" },
+    { "time-budget", 0, POPT_ARG_INT, &time_budget, 37, "Spend at most this long on each session with the watch: the most important tasks go first, and the rest wait for the next session", "SECONDS" },
+    { "io", 0, POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT, &io_backend, 24, "How to receive from the watch: 'blocking' (one syscall per packet) or 'batched' (recvmmsg)", "BACKEND" },
+    { "realtime", 0, POPT_ARG_NONE, &realtime, 25, "Use realtime scheduling and locked memory for precise packet pacing (needs CAP_SYS_NICE and CAP_IPC_LOCK)" },
+    { "setting", 0, POPT_ARG_STRING, NULL, 26, "Show setting ID from the watch's manifest, or change it to VALUE; ID is a number or a name like utc_offset (may be repeated)", "ID[=VALUE]" },
+    { "time-cmd", 0, POPT_ARG_NONE, &time_cmd, 43, "With --set-time, try setting the clock with one command first (experimental; falls back to the settings manifest)" },
+    { "force-write", 0, POPT_ARG_NONE, &force_write, 28, "Rewrite small files (like the PHONE menu name) even if the watch should already have them" },
+    { "cache-dir", 0, POPT_ARG_STRING, &cache_dir, 27, "Where to remember what's on each watch (default: ~/.cache/ttblue)", "PATH" },
+    { "notify-fifo", 0, POPT_ARG_STRING, &notify_path, 29, "Named pipe from which each line is sent to the watch as a notification; keeps the connection open between syncs (daemon only)", "PATH" },
+    { "capture", 0, POPT_ARG_STRING, &capture_path, 31, "Record every ATT packet to and from the watch, with timing, to FILE (one session after another in daemon mode)", "FILE" },
+    { "archive", 0, POPT_ARG_STRING, &archive_path, 38, "Compress activity files into the archive FILE (relative to the activity store), rather than saving them separately", "FILE" },
+    { "archive-dict", 0, POPT_ARG_STRING, &archive_dict, 39, "zstd dictionary for the --archive, e.g. from 'zstd --train *.ttbin'", "FILE" },
+    { "archive-ls", 0, POPT_ARG_NONE, &archive_ls, 40, "List the files in the --archive, and exit" },
+    { "extract", 0, POPT_ARG_STRING, &extract_name, 41, "Write file NAME from the --archive to standard output, and exit", "NAME" },
+    { "totals", 0, POPT_ARG_STRING, &totals, 42, "Show the distance, time, pace and heart rate of the activities saved in the activity store for each PERIOD (week, month or year), and exit", "PERIOD" },
+    { "replay", 0, POPT_ARG_STRING, &replay_path, 32, "Instead of connecting to a watch, play back the sessions recorded in FILE and compare timings", "FILE" },
+    { "replay-fast", 0, POPT_ARG_NONE, &replay_fast, 33, "Play back recorded sessions as fast as possible, rather than with the watch's original timing, and compare blocking with batched receives" },
+    { "simulate", 0, POPT_ARG_INT, &simulate, 34, "Instead of connecting to a watch, sync N simulated watches at once, and report throughput, time to sync, CPU and memory use", "N" },
+    { "soak", 0, POPT_ARG_INT, &sim.cycles, 36, "Soak test: sync the simulated watches (one, unless --simulate) CYCLES times each, with failures at every stage, and report how resource use drifts", "CYCLES" },
+    { "sim", 0, POPT_ARG_STRING, NULL, 35, "Set a parameter of the simulated watches: version (1, 2, or 0 for both), backlog (activity files), size (bytes each), advert (interval in ms), rate (link speed in bytes/s, 0 for unlimited), failure (% of sessions, which run into trouble at a random stage, from the scan on) (may be repeated)", "NAME=VALUE" },
+    { "control", 0, POPT_ARG_STRING, &ctl_path, 18, "Unix socket on which the daemon accepts JSON control requests (sync, status, metrics, schedule)", "PATH" },
     POPT_AUTOHELP
     POPT_TABLEEND
 };
@@ -316,12 +140,8 @@ struct poptOption options[] = {
 
 int main(int argc, const char **argv)
 {
-    int devid, dd, fd;
-    bdaddr_t src_addr, dst_addr = {0};
-    uint8_t dst_bdaddr_type = 0; /* suppress gcc 4.8.x warning; not actual a valid value */
-    int needs_reboot = false, success = false;
-    int write_delay;
-    TTDEV *ttd;
+    struct hci_link hl = { .ops = &hci_bluez, .dd = -1 };
+    STORE *store = NULL;
 
     // parse args
     int ch;
@@ -334,6 +154,56 @@ int main(int argc, const char **argv)
         case 0 : get_activities = update_gps = set_time = version = true; break;
         case 5 : update_gps++; break;
         case 6 : gqf_url = GQF_GLONASS_URL; break;
+        case 20: upload_path = poptGetArg(optCon); break;
+        case 26: {
+            const char *arg = poptGetOptArg(optCon);
+            int64_t value;
+            settings = realloc(settings, (n_settings+1) * sizeof(struct setting_req));
+            struct setting_req *r = &settings[n_settings++];
+            int res = manifest_parse_setting(arg, &r->id, &value);
+            if (res < 0) {
+                fprintf(stderr, "Not a valid setting: %s\n\n", arg);
+                poptPrintUsage(optCon, stderr, 0);
+                return 2;
+            }
+            r->set = res;
+            r->value = (uint32_t)value;
+            free((void *)arg);
+            break;
+        }
+        case 35: {
+            const char *arg = poptGetOptArg(optCon);
+            if (sim_parse_param(&sim, arg) < 0) {
+                fprintf(stderr, "Not a valid simulation parameter: %s\n\n", arg);
+                poptPrintUsage(optCon, stderr, 0);
+                return 2;
+            }
+            free((void *)arg);
+            break;
+        }
+        case 22:
+        case 23: {
+            const char *arg = poptGetOptArg(optCon);
+            uint32_t **ids = (ch==22) ? &get_ids : &rm_ids;
+            int *n = (ch==22) ? &n_get : &n_rm;
+
+            if (ch==22 && !strcmp(arg, "all")) {
+                for (const struct tt_file_kind *k = known_files; k->name; k++) {
+                    *ids = realloc(*ids, (*n+1) * sizeof(uint32_t));
+                    (*ids)[(*n)++] = k->fileno;
+                }
+            } else {
+                *ids = realloc(*ids, (*n+1) * sizeof(uint32_t));
+                if (parse_fileid(arg, &(*ids)[*n]) < 0) {
+                    fprintf(stderr, "Not a valid file ID: %s\n\n", arg);
+                    poptPrintUsage(optCon, stderr, 0);
+                    return 2;
+                }
+                (*n)++;
+            }
+            free((void *)arg);
+            break;
+        }
         }
     }
     if (ch<-1) {
@@ -343,18 +213,21 @@ int main(int argc, const char **argv)
         poptPrintUsage(optCon, stderr, 0);
         return 2;
     }
-    if (dev_address != NULL && str2ba(dev_address, &dst_addr) < 0) {
+    if (dev_address != NULL && str2ba(dev_address, &hl.dst) < 0) {
         fprintf(stderr, "Could not understand Bluetooth device address: %s\n"
                         "It should be a TomTom MAC address like E4:04:39:__:__:__\n\n", dev_address);
         poptPrintUsage(optCon, stderr, 0);
         return 2;
     }
-    if (interface != NULL && (devid = hci_devid(interface)) < 0) {
-        fprintf(stderr, "Invalid Bluetooth interface: %s\n\n", interface);
-        poptPrintUsage(optCon, stderr, 0);
-        return 2;
-    } else if ((devid = hci_get_route(NULL)) < 0)
-        devid = 0;
+    if (interface != NULL) {
+        if ((hl.devid = hci_devid(interface)) < 0) {
+            fprintf(stderr, "Invalid Bluetooth interface: %s\n\n", interface);
+            poptPrintUsage(optCon, stderr, 0);
+            return 2;
+        }
+    } else if ((hl.devid = hci_get_route(NULL)) < 0)
+        hl.devid = 0;
+    hl.debug = debug;
 
     if (daemonize && (new_pair || !dev_address)) {
         fprintf(stderr,
@@ -364,385 +237,201 @@ int main(int argc, const char **argv)
         poptPrintUsage(optCon, stderr, 0);
         return 2;
     }
-
-    // get hostname
-    char hostname[32];
-    gethostname(hostname, sizeof hostname);
-
-    if (read_code != NULL) {
-        strcpy(dev_code, read_code);
+    if (upload_id) {
+        if (parse_fileid(upload_id, &upload_fileno) < 0 || !upload_path) {
+            fprintf(stderr, "Upload needs a file ID (like 0x00010100) and a path.\n\n");
+            poptPrintUsage(optCon, stderr, 0);
+            return 2;
+        }
     }
-
-    // prompt user to put device in pairing mode
-    if (new_pair) {
-        fputs(PAIRING_MODE_PROMPT, stderr);
-        getchar();
-        fputs("\n", stderr);
+    if (strcmp(io_backend, "blocking") && strcmp(io_backend, "batched")) {
+        fprintf(stderr, "Unknown I/O backend: %s\n\n", io_backend);
+        poptPrintUsage(optCon, stderr, 0);
+        return 2;
     }
-
-    for (bool first=true; first || daemonize; ) {
-        if (!first) {
-            term_title("ttblue: Sleeping");
-            isleep(success ? sleep_success : sleep_fail, success || (debug>1));
-        }
-        term_title("ttblue: Connecting...");
-
-        // setup HCI and L2CAP sockets
-        dd = hci_open_dev(devid);
-        if (dd < 0) {
-            fprintf(stderr, "Can't open hci%d: %s (%d)\n", devid, strerror(errno), errno);
-            goto pre_fatal;
-        }
-
-        // check for BLE support (see hciconfig.c cmd_features from Bluez)
-        if (first) {
-            uint8_t features[8];
-            if (hci_read_local_ext_features(dd, 0, NULL, features, 1000) < 0) {
-                fprintf(stderr, "Could not read hci%d features: %s (%d)", devid, strerror(errno), errno);
-                goto pre_fatal;
-            } else if ((features[4] & LMP_LE) == 0 || (features[6] & LMP_LE_BREDR) == 0) {
-                fprintf(stderr, "Bluetooth interface hci%d doesn't support 4.0 (Bluetooth LE+BR/EDR)", devid);
-                goto pre_fatal;
-            }
-        }
-
-        // get host Bluetooth address
-        if (hci_devba(devid, &src_addr) < 0) {
-            fprintf(stderr, "Can't get hci%d info: %s (%d)\n", devid, strerror(errno), errno);
-            goto pre_fatal;
-        }
-
-        // scan for TomTom devices
-        if (dev_address)
-            fprintf(stderr, "Scanning for TomTom BLE device %s...\n", dev_address);
-        else
-            fprintf(stderr, "Scanning for TomTom BLE devices...\n");
-
-        if (hci_tt_scan(dd, &dst_addr, &dst_bdaddr_type, debug) < 0) {
-            if (errno==EPERM)
-                fputs(PLEASE_SETCAP_ME, stderr);
-            else
-                fprintf(stderr, "BLE scan failed: %s (%d)\n", strerror(errno), errno);
-            goto pre_fatal;
-        }
-
-        // create L2CAP socket connected to watch
-        fd = l2cap_le_att_connect(&src_addr, &dst_addr, dst_bdaddr_type, BT_SECURITY_MEDIUM, debug>1);
-        if (fd < 0) {
-            if (errno!=ENOTCONN || debug>1)
-                fprintf(stderr, "Failed to connect: %s (%d)\n", strerror(errno), errno);
-            goto fail_connect;
-        }
-
-        // initialize device
-        ttd = tt_device_init(dst_bdaddr_type==BDADDR_LE_RANDOM ? 1 : 2, fd);
-        if (!ttd)
-            goto fatal;
-
-        // we need the hci_handle too
-        struct l2cap_conninfo l2cci;
-        socklen_t sl = sizeof l2cci;
-        int result = getsockopt(fd, SOL_L2CAP, L2CAP_CONNINFO, &l2cci, &sl);
-        if (result < 0) {
-            perror("getsockopt");
-            goto fail;
-        }
-
-        time_t now = time(NULL);
-        fprintf(stderr, "Connected to v%d device at %.24s.\n", ttd->protocol_version, ctime(&now));
-
-        if (ttd->h->ppcp != 0) {
-            // request minimum connection interval
-            do {
-                result = hci_le_conn_update(dd, htobs(l2cci.hci_handle),
-                                            0x0006 /* min_interval */,
-                                            0x0006 /* max_interval */,
-                                            0 /* latency */,
-                                            200 /* supervision_timeout */,
-                                            2000);
-            } while (errno==ETIMEDOUT);
-            if (result < 0) {
-                if (errno==EPERM && first) {
-                    fputs(PLEASE_SETCAP_ME, stderr);
-                    write_delay = 0; // we couldn't speed up the connection, so no write_delay
-                } else {
-                    perror("hci_le_conn_update");
-                    goto fail;
-                }
-            } else {
-                // we successfully decreased the connection interval, but the device can't
-                // actually handle packets being written to it this quickly, so we
-                // figure out the maximum safe speed at which we can send packets to the device from
-                // the Preferred Peripheral Connection Parameters
-                struct { uint16_t min_interval, max_interval, slave_latency, timeout_mult; } __attribute__((packed)) ppcp;
-                if (att_read(ttd->fd, ttd->h->ppcp, &ppcp) < 0) {
-                    fprintf(stderr, "Could not read device PPCP (handle 0x%04x): %s (%d)", ttd->h->ppcp, strerror(errno), errno);
-                    if (first) goto fatal; else goto fail;
-                } else {
-                    ppcp.min_interval = btohs(ppcp.min_interval);
-                    ppcp.max_interval = btohs(ppcp.max_interval);
-                    ppcp.slave_latency = btohs(ppcp.slave_latency);
-                    ppcp.timeout_mult = btohs(ppcp.timeout_mult);
-                    write_delay = 1250 * ppcp.min_interval; // (microseconds)
-                    if (debug > 1) {
-                        fprintf(stderr, "Throttling file write to 1 packet every %d microseconds.\n", write_delay);
-                        fprintf(stderr, "min_interval=%d, max_interval=%d, slave_latency=%d, timeout_mult=%d\n", ppcp.max_interval, ppcp.min_interval, ppcp.slave_latency, ppcp.timeout_mult);
-                    }
-                }
+    if (!cache_dir) {
+        if (getenv("XDG_CACHE_HOME") && asprintf(&cache_dir, "%s/ttblue", getenv("XDG_CACHE_HOME")) < 0)
+            cache_dir = NULL;
+        else if (!cache_dir && getenv("HOME") && asprintf(&cache_dir, "%s/.cache/ttblue", getenv("HOME")) < 0)
+            cache_dir = NULL;
+    }
+    if ((ctl_path || notify_path) && !daemonize) {
+        fprintf(stderr, "Control socket and notifications can only be used in daemon mode.\n\n");
+        poptPrintUsage(optCon, stderr, 0);
+        return 2;
+    }
+    if (archive_path && postproc) {
+        fprintf(stderr, "Postprocessing needs separate files, so it can't be used with --archive.\n\n");
+        poptPrintUsage(optCon, stderr, 0);
+        return 2;
+    }
+    if ((archive_ls || extract_name) && !archive_path) {
+        fprintf(stderr, "Which --archive?\n\n");
+        poptPrintUsage(optCon, stderr, 0);
+        return 2;
+    } else if (archive_ls || extract_name) {
+        char *path = NULL;
+        ARCHIVE *a;
+        int ii = -1, length = -1;
+        uint8_t *buf;
+
+        if (archive_path[0] != '/' && asprintf(&path, "%s/%s", activity_store, archive_path) < 0)
+            return 1;
+        a = archive_open(path ? path : archive_path, archive_dict, false);
+        free(path);
+        if (!a)
+            return 1;
+        if (archive_ls)
+            archive_list(a, stdout);
+        if (extract_name) {
+            if ((ii = archive_find(a, extract_name)) < 0)
+                fprintf(stderr, "No %s in %s.\n", extract_name, a->path);
+            else if ((length = archive_read(a, ii, &buf)) >= 0) {
+                fwrite(buf, 1, length, stdout);
+                free(buf);
             }
-        } else {
-            // With no attempt to speed up the connection, we shouldn't need any write_delay
-            write_delay = 0;
-        }
-
-        // check that it's actually a TomTom device with compatible firmware version
-        struct ble_dev_info *info = tt_check_device_version(ttd, first);
-        if (!info) {
-            if (first) goto fatal; else goto fail;
-        }
-
-        // show device identifiers if --version
-        if (version && first) {
-            for (struct ble_dev_info *p = info; p->handle; p++)
-                fprintf(stderr, "  %-10.10s: %s\n", p->name, p->buf);
-        }
-
-        // prompt for pairing code
-        if (new_pair) {
-            fputs(PAIRING_CODE_PROMPT, stderr);
-            fgets(dev_code, 7, stdin);
-        }
-
-        // authorize with the device
-        if (tt_authorize(ttd, dev_code, new_pair) < 0) {
-            fprintf(stderr, "Device didn't accept pairing code %s.\n", dev_code);
-            if (first) goto fatal; else goto fail;
-        }
-
-        term_title("ttblue: Connected");
-
-        // set timeout to 20 seconds (delete and write operations can be slow)
-        struct timeval to = {.tv_sec=20, .tv_usec=0};
-        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
-
-        // transfer files
-        uint8_t *fbuf;
-        FILE *f;
-        int length;
-
-        fprintf(stderr, "Setting PHONE menu to '%s'.\n", hostname);
-        tt_delete_file(ttd, TTBLUE_FILE_HOSTNAME1);
-        tt_write_file(ttd, TTBLUE_FILE_HOSTNAME1, false, (uint8_t*)hostname, strlen(hostname), write_delay);
-        tt_delete_file(ttd, TTBLUE_FILE_HOSTNAME2); // Write name to two files as V1 and V2 devices seem to use different files
-        tt_write_file(ttd, TTBLUE_FILE_HOSTNAME2, false, (uint8_t*)hostname, strlen(hostname), write_delay);
-
-#ifdef DUMP_0x000f20000
-        fprintf(stderr, "Reading preference file 0x%08x from watch...\n", TTBLUE_FILE_PREFERENCES_XML);
-        if ((length=tt_read_file(ttd, TTBLUE_FILE_PREFERENCES_XML, debug, &fbuf)) < 0) {
-            fprintf(stderr, "WARNING: Could not read preferences file 0x%08x from watch.\n", TTBLUE_FILE_PREFERENCES_XML);
-        } else {
-            save_buf_to_file(make_tt_filename(TTBLUE_FILE_PREFERENCES_XML, "xml"), "wxb", fbuf, length, 2, true);
-            free(fbuf);
         }
-#endif
-
-        if (set_time) {
-            fprintf(stderr, "Checking watch settings manifest file 0x%08x...\n", TTBLUE_FILE_MANIFEST1);
-            if ((length = tt_read_file(ttd, TTBLUE_FILE_MANIFEST1, debug, &fbuf)) < 0) {
-                fprintf(stderr, "WARNING: Could not read settings manifest file 0x%08x from watch!\n", TTBLUE_FILE_MANIFEST1);
-            } else {
-                // based on: https://github.com/ryanbinns/ttwatch/tree/master/manifest
-                // the position of the UTC-offset in the manifest is 169 in all known firmware versions, so lazily hard-coded here for now
-                int32_t *watch_timezone = NULL;
-                for (int16_t *index = (int16_t*)(fbuf+4); index < (int16_t*)(fbuf+length); index += 3) {
-                    if (btohl(*index) == 169) {
-                        watch_timezone = (int32_t*)(index + 1);
-                        break;
-                    }
-                }
-                if (!watch_timezone) {
-                    fprintf(stderr, "WARNING: Could not find watch timezone setting!\n");
-                } else {
-                    time_t t = time(NULL);
-                    struct tm *lt = localtime(&t);
-
-                    if (btohl(*watch_timezone) != lt->tm_gmtoff) {
-                        fprintf(stderr, "  Changing timezone from UTC%+d to UTC%+ld.\n", btohl(*watch_timezone), lt->tm_gmtoff);
-                        *watch_timezone = htobl(lt->tm_gmtoff);
-                        tt_delete_file(ttd, TTBLUE_FILE_MANIFEST1);
-                        tt_write_file(ttd, TTBLUE_FILE_MANIFEST1, false, fbuf, length, write_delay);
-                        needs_reboot = true;
-                    }
-                }
-                free(fbuf);
-            }
+        archive_close(a);
+        return (extract_name && length < 0) ? 1 : 0;
+    }
+    if (totals) {
+        SUMMARIES *sums;
+        int period = parse_period(totals);
+
+        if (period < 0) {
+            fprintf(stderr, "Totals are by week, month or year.\n\n");
+            poptPrintUsage(optCon, stderr, 0);
+            return 2;
         }
+        if (!(sums = summaries_load(activity_store)))
+            return 1;
+        int res = summaries_totals(sums, period, stdout);
+        summaries_free(sums);
+        return res < 0 ? 1 : 0;
+    }
+    if (replay_path) {
+        int failed = replay_run(replay_path, !replay_fast, !strcmp(io_backend, "batched"), debug);
+        return failed ? 1 : 0;
+    }
+    if (simulate > 0 || sim.cycles > 0) {
+        sim.watches = simulate > 0 ? simulate : 1;
+        sim.postproc = postproc;
+        sim.archive = archive_path != NULL;
+        sim.archive_dict = archive_dict;
+        sim.batch = sync_batch;
+        sim.batched = !strcmp(io_backend, "batched");
+        int unfinished = sim_run(&sim, activity_store, debug);
+        return unfinished ? 1 : 0;
+    }
 
-        if (get_activities) {
-            uint16_t *list;
-            int n_files = tt_list_sub_files(ttd, TTBLUE_FILE_TTBIN_DATA, &list);
-
-            if (n_files < 0) {
-                fprintf(stderr, "Could not list activity files on watch!\n");
-                goto fail;
-            }
-            fprintf(stderr, "Found %d activity files on watch.\n", n_files);
-            for (int ii=0; ii<n_files; ii++) {
-                uint32_t fileno = TTBLUE_FILE_TTBIN_DATA + list[ii];
-
-                fprintf(stderr, "  Reading activity file 0x%08X ...\n", fileno);
-                term_title("ttblue: Transferring activity %d/%d", ii+1, n_files);
-                if ((length = tt_read_file(ttd, fileno, debug, &fbuf)) < 0) {
-                    fprintf(stderr, "Could not read activity file 0x%08X from watch!\n", fileno);
-                    goto fail;
-                } else {
-                    char filename[strlen(activity_store) + strlen("/12345678_20150101_010101.ttbin") + 1];
-                    sprintf(filename, "%s/%s", activity_store, make_tt_filename(fileno, "ttbin"));
-
-                    int result = save_buf_to_file(filename, "wxb", fbuf, length, 4, true);
-                    free(fbuf);
-                    if (result < 0)
-                        goto fail;
-                    else {
-                        if (postproc) {
-                            fprintf(stderr, "    Postprocessing with %s ...\n", postproc);
-                            fflush(stderr);
+    FILE *capture = NULL;
+    if (capture_path && (capture = fopen(capture_path, "we")) == NULL) {
+        fprintf(stderr, "Could not open %s: %s (%d)\n", capture_path, strerror(errno), errno);
+        return 1;
+    }
 
-                            switch (fork()) {
-                            case 0:
-                                dup2(1, 2); // redirect stdout to stderr
-                                execlp(postproc, postproc, filename, NULL);
-                                exit(1); // if exec fails?
-                            case -1:
-                                fprintf(stderr, "Could not fork: %s (%d)\n", strerror(errno), errno);
-                                goto fatal;
-                            }
-                        }
-                        fprintf(stderr, "    Deleting activity file 0x%08X ...\n", fileno);
-                        tt_delete_file(ttd, fileno);
-                    }
-                }
-            }
+    struct daemon_state ds = { .ctl_fd = -1, .epoll_fd = -1, .timer_fd = -1, .sig_fd = -1, .scan_fd = -1,
+                               .notify_fd = -1, .link_fd = -1,
+                               .device = dev_address, .state = "starting", .started = time(NULL),
+                               .sleep_success = &sleep_success, .sleep_fail = &sleep_fail };
+    struct notify_queue nq = { .fd = -1 };
+    if (ctl_path && daemon_ctl_open(&ds, ctl_path) < 0)
+        return 1;
+    if (notify_path) {
+        if (notify_open(&nq, notify_path) < 0) {
+            daemon_done(&ds);
+            return 1;
         }
+        ds.notify_fd = nq.fd;
+    }
+    if (daemonize && daemon_init(&ds) < 0) {
+        daemon_done(&ds);
+        return 1;
+    }
 
-        if (update_gps) {
-            fputs("Updating QuickFixGPS...\n", stderr);
-            term_title("ttblue: Updating QuickFixGPS");
+    if ((get_activities || n_get) && (store = store_open(activity_store, sync_batch)) == NULL) {
+        daemon_done(&ds);
+        return 1;
+    }
+    if (store && archive_path && store_archive(store, archive_path, archive_dict) < 0) {
+        store_close(store);
+        daemon_done(&ds);
+        return 1;
+    }
 
-            time_t last_gqf_update = read_gqf_status(ttd, debug-1);
-            if (update_gps <= 1 && time(NULL) - last_gqf_update < 24*3600) {
-                fprintf(stderr, "  No GPS update needed, last was less than %ld hours ago\n", (time(NULL) - last_gqf_update)/3600);
-            } else {
-                if (last_gqf_update != -1 && last_gqf_update != 0)
-                    fprintf(stderr, "  Last GPS update was at %.24s.\n", ctime(&last_gqf_update));
-                else
-                    fprintf(stderr, "  Last GPS update unknown.\n");
+    // one-off requests stay queued until they're done, even in daemon mode
+    TASKS tasks;
+    tasks_init(&tasks, time_budget);
+    if (list_all)
+        tasks_add(&tasks, TASK_LS, 0, 0);
+    for (int ii=0; ii<n_get; ii++)
+        tasks_add(&tasks, TASK_GET, get_ids[ii], 0);
+    for (int ii=0; ii<n_rm; ii++)
+        tasks_add(&tasks, TASK_RM, rm_ids[ii], 0);
+    if (upload_path) {
+        struct stat st;
+        tasks_add(&tasks, TASK_UPLOAD, upload_fileno, stat(upload_path, &st) == 0 ? st.st_size : 0);
+    }
 
-                CURLcode res;
-                char curlerr[CURL_ERROR_SIZE];
-                CURL *curl = curl_easy_init();
-                if (!curl) {
-                    fputs("Could not start curl\n", stderr);
-                    goto fail;
-                } else {
-                    char url[128];
-                    sprintf(url, gqf_url, (long)time(NULL));
-                    fprintf(stderr, "  Downloading %s\n", url);
+    // after starting the store thread, which shouldn't compete with us
+    if (realtime)
+        pace_realtime();
 
-                    f = tmpfile();
-                    curl_easy_setopt(curl, CURLOPT_URL, url);
-                    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
-                    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-                    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curlerr);
-                    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10); // connection phase
-                    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);        // transfer phase
-                    res = curl_easy_perform(curl);
-                    curl_easy_cleanup(curl);
-                    if (res != 0) {
-                        fprintf(stderr, "WARNING: Download failed: %s\n", curlerr);
-                    } else {
-                        length = ftell(f);
-                        fprintf(stderr, "  Sending update to watch (%d bytes)...\n", length);
-                        fseek (f, 0, SEEK_SET);
-                        fbuf = malloc(length);
-                        if (fread (fbuf, 1, length, f) < length) {
-                            fclose(f);
-                            free(fbuf);
-                            fputs("Could not read QuickFixGPS update.\n", stderr);
-                            goto fail;
-                        } else {
-                            fclose (f);
-                            tt_delete_file(ttd, TTBLUE_FILE_GPSQUICKFIX_DATA);
-                            result = tt_write_file(ttd, TTBLUE_FILE_GPSQUICKFIX_DATA, debug, fbuf, length, write_delay);
-                            free(fbuf);
-                            if (result < 0) {
-                                fputs("Failed to send QuickFixGPS update to watch.\n", stderr);
-                                goto fail;
-                            } else {
-                                // official TomTom Android app seems to only issue this
-                                // "magic" update command when the GPS is brand new or
-                                // after a factory reset, or with 3x --update-gps
-                                att_wrreq(ttd->fd, ttd->h->cmd_status, BARRAY(MSG_UPDATE_EPHEMERIS, 0x01, 0x00, 0x01), 4);
+    // get hostname
+    char hostname[32];
+    gethostname(hostname, sizeof hostname);
 
-                                time_t last_gqf_update = read_gqf_status(ttd, debug-1);
-                                if (last_gqf_update != -1 && last_gqf_update != 0)
-                                    fprintf(stderr, "  Last GPS update is now %.24s.\n", ctime(&last_gqf_update));
-                                else
-                                    fprintf(stderr, "  Could not re-read GPS update time.\n");
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    struct session_opts opts = {
+        .debug = debug, .daemonize = daemonize, .new_pair = new_pair, .version = version,
+        .force_write = force_write, .batched = !strcmp(io_backend, "batched"),
+        .get_activities = get_activities, .get_tracking = get_tracking, .set_time = set_time, .time_cmd = time_cmd,
+        .update_gps = update_gps, .dev_address = dev_address, .hostname = hostname,
+        .activity_store = activity_store, .gqf_url = gqf_url, .postproc = postproc, .cache_dir = cache_dir,
+        .upload_path = upload_path, .capture_path = capture_path, .settings = settings, .n_settings = n_settings
+    };
+    struct session_link link;
+    hci_session_link(&hl, &link);
+    struct session s;
+    session_init(&s, &opts, &link, &ds, &tasks, store, &nq);
+    s.capture = capture;
 
-#ifdef DUMP_0x00020005
-        if (debug > 1) {
-            uint32_t fileno = 0x00020005;
-            fprintf(stderr, "Reading file 0x%08x from watch...\n", fileno);
-            if ((length=tt_read_file(ttd, fileno, debug, &fbuf)) < 0) {
-                fprintf(stderr, "Could not read file 0x%08x from watch.\n", fileno);
-            } else {
-                save_buf_to_file(make_tt_filename(fileno, "bin"), "wxb", fbuf, length, 2, true);
-                free(fbuf);
-            }
-        }
-#endif
+    if (read_code != NULL) {
+        strcpy(s.dev_code, read_code);
+    }
 
-        success = true;
-        if(needs_reboot) {
-            fprintf(stderr, "Rebooting watch...\n");
-            fprintf(stderr, "WARNING: this may not work with some devices\n");
-            tt_reboot(ttd);
-        }
-        first = false;
-        needs_reboot = false;
-        tt_device_done(ttd);
-        close(fd);
-        hci_close_dev(dd);
-        continue;
-    fail:
-        tt_device_done(ttd);
-    fail_connect:
-        close(fd);
-        hci_close_dev(dd);
-        success = false;
-        fprintf(stderr, "Communication with watch failed...\n");
+    // prompt user to put device in pairing mode
+    if (new_pair) {
+        fputs(PAIRING_MODE_PROMPT, stderr);
+        getchar();
+        fputs("\n", stderr);
+    }
 
-        // wait for any child processes to finish
-        int child_status;
-        pid_t child_pid;
-        while ((child_pid = wait(&child_status)) >= 0)
-            if (child_status != 0)
-                fprintf(stderr, "WARNING: postprocess failed (pid %d, status %d)\n", child_pid, child_status);
+    while (s.first || daemonize) {
+        if (session_run(&s) == SESSION_FATAL)
+            goto fatal;
     }
 
+    hci_link_reset(&hl);
+    daemon_reap(&ds, true); // let postprocessing finish
+    tasks_free(&tasks);
+    if (store && store->archive && debug > 1)
+        archive_report(store->archive, stderr, "");
+    store_close(store);
+    notify_close(&nq);
+    daemon_done(&ds);
+    if (capture)
+        fclose(capture);
     return 0;
 
 fatal:
-    close(fd);
-pre_fatal:
-    hci_close_dev(dd);
+    hci_link_reset(&hl);
+    daemon_reap(&ds, true);
+    tasks_free(&tasks);
+    store_close(store);
+    notify_close(&nq);
+    daemon_done(&ds);
+    if (capture)
+        fclose(capture);
     fprintf(stderr, "Fatal error, exiting.\n");
     return 1;
 }
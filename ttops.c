@@ -7,7 +7,11 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
 
@@ -15,13 +19,15 @@
 #include "ttops.h"
 #include "version.h"
 #include "ttblue.h"
+#include "pace.h"
 
 /****************************************************************************/
 
-struct tt_handles v1_handles = { .ppcp=0x0b, .passcode=0x32, .magic=0x35, .cmd_status=0x25, .length=0x28, .transfer=0x2b, .check=0x2e };
-struct tt_handles v2_handles = { .ppcp=0,    .passcode=0x82, .magic=0x85, .cmd_status=0x72, .length=0x75, .transfer=0x78, .check=0x7b };
+static const struct tt_handles v1_handles = { .ppcp=0x0b, .passcode=0x32, .magic=0x35, .cmd_status=0x25, .length=0x28, .transfer=0x2b, .check=0x2e };
+static const struct tt_handles v2_handles = { .ppcp=0,    .passcode=0x82, .magic=0x85, .cmd_status=0x72, .length=0x75, .transfer=0x78, .check=0x7b };
 
-struct ble_dev_info v1_info[] = {
+// templates only: each device gets its own copy, which tt_check_device_version fills in
+static const struct ble_dev_info v1_info[] = {
     { 0x001e, "maker" },
     { 0x0016, "serial" },
     { 0x0003, "user_name" },
@@ -31,7 +37,7 @@ struct ble_dev_info v1_info[] = {
     { 0 }
 };
 
-struct ble_dev_info v2_info[] = {
+static const struct ble_dev_info v2_info[] = {
     // from @drkingpo's btsnoop_hci.log: these are all the same as the v1 identifiers (+ 0x30)
     { 0x004e, "maker" },
     { 0x0046, "serial" },
@@ -44,8 +50,8 @@ struct ble_dev_info v2_info[] = {
 };
 
 #define EXPECTED_MAKER "TomTom Fitness"
-const char *tested_models_v1[] = {"1001","1002","1003","1004",NULL};
-const char *tested_models_v2[] = {"2005","2006","2008","2012",NULL};
+static const char *const tested_models_v1[] = {"1001","1002","1003","1004",NULL};
+static const char *const tested_models_v2[] = {"2005","2006","2008","2012",NULL};
 
 const char *FIRMWARE_TOO_OLD =
     "Firmware v%s is too old; at least v%s is required\n"
@@ -65,51 +71,121 @@ const char *MODEL_UNTESTED =
     "WARNING: Model number %s has not been tested with ttblue\n"
     "  Please email dlenski@gmail.com and let me know if it works or not\n";
 
+static void *
+libc_malloc(size_t size, void *arg)
+{
+    return malloc(size);
+}
+
+static void
+libc_free(void *ptr, void *arg)
+{
+    free(ptr);
+}
+
+/* The attribute handles of each protocol version, and where the device
+ * information is; NULL for an unknown version. */
+const struct tt_handles *
+tt_protocol_handles(int protocol_version, const struct ble_dev_info **info)
+{
+    switch (protocol_version) {
+    case 1:
+        *info = v1_info;
+        return &v1_handles;
+    case 2:
+        *info = v2_info;
+        return &v2_handles;
+    default:
+        return NULL;
+    }
+}
+
+/* Everything about one watch lives here, so separate devices can be driven
+ * from separate threads at the same time. */
 TTDEV *
-tt_device_init(int protocol_version, int fd) {
-    TTDEV *d = malloc(sizeof(struct ttdev));
+tt_device_new(int protocol_version, int fd, const struct tt_alloc *alloc) {
+    static const struct tt_alloc libc_alloc = { libc_malloc, libc_free, NULL };
+    const struct ble_dev_info *info;
+    const struct tt_handles *h = tt_protocol_handles(protocol_version, &info);
+
+    if (!h)
+        return NULL;
+    if (!alloc)
+        alloc = &libc_alloc;
+    TTDEV *d = alloc->malloc(sizeof(struct ttdev), alloc->arg);
     if (!d)
         return NULL;
+    memset(d, 0, sizeof *d);
 
-    d->fd = fd;
+    att_sock_init(&d->att, fd);
     d->protocol_version = protocol_version;
+    d->h = h;
+    d->alloc = *alloc;
 
     switch (protocol_version) {
     case 1:
-        d->h = &v1_handles;
-        d->info = v1_info;
         d->oldest_tested_firmware = VERSION_TUPLE(1,8,34);
         d->newest_tested_firmware = VERSION_TUPLE(1,8,52);
         d->tested_models = tested_models_v1;
         break;
     case 2:
-        d->h = &v2_handles;
-        d->info = v2_info;
         d->oldest_tested_firmware = VERSION_TUPLE(1,1,19);
         d->newest_tested_firmware = VERSION_TUPLE(1,7,64);
         // @drkingpo confirmed v1.2.0 works now (see issue #5)
         // @Grimler91 tested 1.7.62 and 1.7.64.
         d->tested_models = tested_models_v2;
         break;
-    default:
-        return NULL;
     };
+
+    for (int ii=0; ii<TT_MAX_INFO-1 && info[ii].handle; ii++)
+        d->info[ii] = info[ii];
     return d;
 }
 
+TTDEV *
+tt_device_init(int protocol_version, int fd) {
+    return tt_device_new(protocol_version, fd, NULL);
+}
+
+/* Also drops the connection's receive queue and trace, but leaves the socket
+ * open for the caller to close */
 bool
 tt_device_done(TTDEV *d) {
-    free(d);
+    if (d) {
+        att_sock_done(&d->att);
+        d->alloc.free(d, d->alloc.arg);
+    }
     return true;
 }
 
+void
+tt_set_progress(TTDEV *d, tt_progress_fn progress, void *arg)
+{
+    d->progress = progress;
+    d->progress_arg = arg;
+}
+
+/* The socket underneath, e.g. for its timeouts; calls on the device still block */
+int
+tt_device_fd(TTDEV *d)
+{
+    return d->att.fd;
+}
+
+void
+tt_free(TTDEV *d, void *ptr)
+{
+    if (ptr)
+        d->alloc.free(ptr, d->alloc.arg);
+}
+
 struct ble_dev_info *
 tt_check_device_version(TTDEV *d, bool warning)
 {
     struct ble_dev_info *info = d->info;
 
     for (struct ble_dev_info *p = info; p->handle; p++) {
-        p->len = att_read(d->fd, p->handle, p->buf);
+        p->len = att_read(&d->att, p->handle, p->buf);
         if (p->len < 0) {
             fprintf(stderr, "Could not read device information (handle 0x%04x, %s): %s (%d)\n", p->handle, p->name, strerror(errno), errno);
             return NULL;
@@ -134,7 +210,8 @@ tt_check_device_version(TTDEV *d, bool warning)
     }
 
     if (compare_versions(&fw_ver, &d->oldest_tested_firmware) < 0) {
-        fprintf(stderr, FIRMWARE_TOO_OLD, info[5].buf, str_version(&d->oldest_tested_firmware,'.'),
+        char oldest[VERSION_STR_MAX];
+        fprintf(stderr, FIRMWARE_TOO_OLD, info[5].buf, str_version(&d->oldest_tested_firmware, '.', oldest, sizeof oldest),
                 d->protocol_version==1 ? FIRMWARE_NOTES_v1 : FIRMWARE_NOTES_v2);
         return NULL;
     }
@@ -143,7 +220,7 @@ tt_check_device_version(TTDEV *d, bool warning)
         if (compare_versions(&fw_ver, &d->newest_tested_firmware) > 0)
             fprintf(stderr, FIRMWARE_UNTESTED, info[5].buf);
 
-        const char **m;
+        const char *const *m;
         for (m=d->tested_models; *m; m++) {
             if (!strcmp(*m, info[4].buf))
                 break;
@@ -167,25 +244,25 @@ tt_authorize(TTDEV *d, char code[6], bool new_code)
 
     switch (d->protocol_version) {
     case 1:
-        att_wrreq(d->fd, 0x0033, &auth_one, sizeof auth_one);
-        att_wrreq(d->fd, 0x0026, &auth_one, sizeof auth_one);
-        att_wrreq(d->fd, 0x002f, &auth_one, sizeof auth_one);
-        att_wrreq(d->fd, 0x0029, &auth_one, sizeof auth_one);
-        att_wrreq(d->fd, 0x002c, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x0033, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x0026, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x002f, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x0029, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x002c, &auth_one, sizeof auth_one);
         break;
     case 2:
-        att_wrreq(d->fd, 0x0083, &auth_one, sizeof auth_one); // (v1 + 0x50)
-        att_wrreq(d->fd, 0x0088, &auth_one, sizeof auth_one);
-        att_wrreq(d->fd, 0x0073, &auth_one, sizeof auth_one); // (v1 + 0x4d)
-        att_wrreq(d->fd, 0x007c, &auth_one, sizeof auth_one); // (v1 + 0x4d)
-        att_wrreq(d->fd, 0x0076, &auth_one, sizeof auth_one); // (v1 + 0x4d)
-        att_wrreq(d->fd, 0x0079, &auth_one, sizeof auth_one); // (v1 + 0x4d)
+        att_wrreq(&d->att, 0x0083, &auth_one, sizeof auth_one); // (v1 + 0x50)
+        att_wrreq(&d->att, 0x0088, &auth_one, sizeof auth_one);
+        att_wrreq(&d->att, 0x0073, &auth_one, sizeof auth_one); // (v1 + 0x4d)
+        att_wrreq(&d->att, 0x007c, &auth_one, sizeof auth_one); // (v1 + 0x4d)
+        att_wrreq(&d->att, 0x0076, &auth_one, sizeof auth_one); // (v1 + 0x4d)
+        att_wrreq(&d->att, 0x0079, &auth_one, sizeof auth_one); // (v1 + 0x4d)
         break;
     default:
         return -2;
     }
-    att_wrreq(d->fd, d->h->magic, magic_bytes, 8);
-    att_wrreq(d->fd, d->h->passcode, &bcode, sizeof bcode);
+    att_wrreq(&d->att, d->h->magic, magic_bytes, 8);
+    att_wrreq(&d->att, d->h->passcode, &bcode, sizeof bcode);
     return EXPECT_uint8(d, d->h->passcode, 1);
 }
 
@@ -196,12 +273,82 @@ tt_reboot(TTDEV *d)
     // v2 version tested by @Grimler91; v1 version tested by @dlenski on TomTom Runner v1
     uint32_t bork = htobl(d->protocol_version == 2 ? MSG_RESET_DEVICE : 0);
     for (int ii=1; ii<=1000; ii++) {
-        if (att_wrreq(d->fd, d->h->cmd_status, &bork, sizeof bork) < 0)
+        if (att_wrreq(&d->att, d->h->cmd_status, &bork, sizeof bork) < 0)
             return ii;
     }
     return -1;
 }
 
+/* After giving up on an answer from the watch: swallows one which is only
+ * late, so that it isn't taken for the answer to the next command. The
+ * socket's receive timeout should already be short. */
+static void
+drain_status(TTDEV *d)
+{
+    uint8_t buf[BT_ATT_DEFAULT_LE_MTU];
+    uint16_t handle;
+
+    for (int ii=0; ii<4 && att_read_not(&d->att, &handle, buf) >= 0; ii++)
+        ;
+}
+
+/* Sets the clock and UTC offset with a single MSG_SET_TIME command. The
+ * payload's format is a guess, not yet confirmed on real firmware, so
+ * anything but a clean exchange counts as unsupported. Returns 0 on success,
+ * or 1 if the watch declined or got it wrong (the caller should fall back to
+ * editing the settings manifest, and not ask again). */
+int
+tt_set_time(TTDEV *d, time_t utc, int32_t utc_offset)
+{
+    uint8_t cmd[] = {MSG_SET_TIME, 0, 0, 0};
+    struct { uint32_t utc; int32_t offset; } __attribute__((packed)) t = { htobl(utc), htobl(utc_offset) };
+    uint32_t status = 0;
+    int result;
+
+    // firmware which doesn't know the command may not answer at all, so don't wait long
+    struct timeval oldto, to = {.tv_sec=2, .tv_usec=0};
+    socklen_t sl = sizeof oldto;
+    getsockopt(d->att.fd, SOL_SOCKET, SO_RCVTIMEO, &oldto, &sl);
+    setsockopt(d->att.fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
+
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
+    result = EXPECT_ANY_uint32(d, d->h->cmd_status, &status);
+    if (result == 0 && status == 1) {
+        if ((result = att_write(&d->att, d->h->transfer, &t, sizeof t)) >= 0)
+            result = EXPECT_ANY_uint32(d, d->h->cmd_status, &status);
+        if (result == 0 && status != 0)
+            result = -1;
+    } else if (result == 0)
+        result = -1;
+    if (result < 0)
+        drain_status(d);
+
+    setsockopt(d->att.fd, SOL_SOCKET, SO_RCVTIMEO, &oldto, sizeof oldto);
+    return result < 0 ? 1 : 0;
+}
+
+/* Shows a text message, like a phone notification: the text goes into the
+ * notification file, and MSG_UIPROD makes the watch display it. Returns 0
+ * once the watch has acknowledged it. */
+int
+tt_notify(TTDEV *d, const char *text, uint32_t write_delay)
+{
+    uint32_t fileno = TTBLUE_FILE_NOTIFICATION;
+    int length = strlen(text);
+
+    tt_delete_file(d, fileno); // in case a write doesn't truncate
+    if (tt_write_file(d, fileno, false, (const uint8_t *)text, length, write_delay) != length)
+        return -1;
+
+    uint8_t cmd[] = {MSG_UIPROD, (fileno>>16)&0xff, fileno&0xff, (fileno>>8)&0xff};
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
+    if (EXPECT_uint32(d, d->h->cmd_status, 1) < 0)
+        return -1;
+    if (EXPECT_uint32(d, d->h->cmd_status, 0) < 0)
+        return -1;
+    return 0;
+}
+
 int
 tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
 {
@@ -210,7 +357,7 @@ tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
         return -EINVAL;
 
     uint8_t cmd[] = {MSG_READ, (fileno>>16)&0xff, fileno&0xff, (fileno>>8)&0xff};
-    att_wrreq(d->fd, d->h->cmd_status, cmd, sizeof cmd);
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
     if (EXPECT_uint32(d, d->h->cmd_status, 1) < 0)
         goto prealloc_fail;
 
@@ -218,7 +365,9 @@ tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
     if (flen < 0)
         goto prealloc_fail;
 
-    uint8_t *optr = *buf = malloc(flen + BT_ATT_DEFAULT_LE_MTU);
+    uint8_t *optr = *buf = d->alloc.malloc(flen + BT_ATT_DEFAULT_LE_MTU, d->alloc.arg);
+    if (!optr)
+        goto prealloc_fail;
     const uint8_t *end = optr+flen;
     const uint8_t *checkpoint;
     int counter = 0;
@@ -226,8 +375,7 @@ tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
     time_t startat=time(NULL);
     struct timeval now;
     while (optr < end) {
-        // checkpoint occurs every (256*20-2) data bytes and at EOF
-        checkpoint = optr + (256*20-2);
+        checkpoint = optr + TT_BLOCK_LEN;
         if (checkpoint>end)
             checkpoint = end;
 
@@ -256,7 +404,9 @@ tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
         }
 
         uint32_t c = htobl(++counter);
-        att_write(d->fd, d->h->check, &c, sizeof c);
+        att_write(&d->att, d->h->check, &c, sizeof c);
+        if (d->progress)
+            d->progress(d->progress_arg, fileno, optr-*buf, flen);
         if (debug) {
             time_t current = time(NULL);
             int rate = current-startat ? (optr-*buf)/(current-startat) : 9999;
@@ -277,87 +427,112 @@ tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf)
     return optr-*buf;
 
 fail:
-    free(*buf);
     fprintf(stderr, "File read failed at byte position %d of %d\n", (int)(optr-*buf), flen);
     perror("fail");
+    tt_free(d, *buf);
+    *buf = NULL;
 prealloc_fail:
     return -1;
 }
 
+/* Splits a block plus its CRC trailer into 20-byte write commands pointing straight into the source buffer */
+static int
+block_packets(struct att_pkt *pkts, const uint8_t *data, int dlen, const uint16_t *crc)
+{
+    const uint8_t *c = (const void *)crc;
+    int n = 0;
+    for (int off = 0; off < dlen+2; off += 20, n++) {
+        int plen = (dlen+2-off < 20) ? dlen+2-off : 20;
+        int from_data = (off >= dlen) ? 0 : (dlen-off < plen) ? dlen-off : plen;
+        struct att_pkt *p = &pkts[n];
+
+        p->iovcnt = 0;
+        if (from_data)
+            p->iov[p->iovcnt++] = (struct iovec){ (void *)(data+off), from_data };
+        if (plen > from_data)
+            p->iov[p->iovcnt++] = (struct iovec){ (void *)(c + off+from_data-dlen), plen-from_data };
+    }
+    return n;
+}
+
+static void
+debug_pkt(const struct att_pkt *p, int pos)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    fprintf(stderr, "%010ld.%06ld: %04x: ", now.tv_sec, now.tv_usec, pos);
+    for (int ii=0; ii<p->iovcnt; ii++)
+        hexlify(stderr, p->iov[ii].iov_base, p->iov[ii].iov_len, ii==p->iovcnt-1);
+}
+
 int
 tt_write_file(TTDEV *d, uint32_t fileno, int debug, const uint8_t *buf, uint32_t length, uint32_t write_delay)
 {
     if (fileno>>24)
         return -EINVAL;
 
+    // precompute the CRC of every block, so the send loop below only has to
+    // emit packets and never holds up the radio with computation
+    int nblocks = (length + TT_BLOCK_LEN-1) / TT_BLOCK_LEN;
+    uint16_t *crcs = malloc(nblocks * sizeof(uint16_t) + 1);
+    if (!crcs)
+        return -1;
+    for (int ii=0; ii<nblocks; ii++) {
+        uint32_t blen = (ii<nblocks-1) ? TT_BLOCK_LEN : length - ii*TT_BLOCK_LEN;
+        crcs[ii] = htobs(crc16(buf + ii*TT_BLOCK_LEN, blen, 0xffff));
+    }
+
     uint8_t cmd[] = {MSG_WRITE, (fileno>>16)&0xff, fileno&0xff, (fileno>>8)&0xff};
-    att_wrreq(d->fd, d->h->cmd_status, cmd, sizeof cmd);
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
     if (EXPECT_uint32(d, d->h->cmd_status, 1) < 0)
-       return -1;
+        goto fail_prewrite;
 
     uint32_t flen = htobl(length);
-    att_write(d->fd, d->h->length, &flen, sizeof flen);
+    att_write(&d->att, d->h->length, &flen, sizeof flen);
 
     const uint8_t *iptr = buf;
     const uint8_t *end = iptr+length;
     const uint8_t *checkpoint;
-    uint8_t temp[22];
+    struct att_pkt pkts[(TT_BLOCK_LEN+2+19)/20];
     int counter = 0;
 
     time_t startat = time(NULL);
-    struct timeval now, lastpkt = { -1, -1 }; //yes, that's a fake/invalid time-of-day
+    struct pacer pacer;
+    pace_init(&pacer, write_delay);
     while (iptr < end) {
-        // checkpoint occurs every (256*20-2) data bytes and at EOF
-        checkpoint = iptr + (256*20-2);
+        checkpoint = iptr + TT_BLOCK_LEN;
         if (checkpoint>end)
             checkpoint = end;
 
         // checkpoint is followed by 2 bytes for CRC16_modbus
-        uint32_t check = 0xffff;
-        while (iptr < checkpoint) {
-            int wlen;
-            uint8_t *out;
-
-            if (iptr+20 < checkpoint) {
-                wlen = 20;
-                out = (void*)iptr;
-                check = crc16(iptr, wlen, check); // update CRC with data bytes
-            } else {
-                wlen = checkpoint-iptr;
-                out = temp;
-                check = crc16(iptr, wlen, check); // update CRC with data bytes
-
-                uint16_t c = btohs(check);
-                memcpy( mempcpy(out, iptr, wlen),
-                        &c, sizeof c); // output is data bytes + CRC16
-                wlen += 2;
-            }
+        int npkts = block_packets(pkts, iptr, checkpoint-iptr, &crcs[counter]);
 
-            if (att_write(d->fd, d->h->transfer, out, (wlen<20) ? wlen : 20) < 0)
+        if (!write_delay) {
+            // nothing to pace: hand the whole block to the kernel at once
+            if (att_write_batch(&d->att, d->h->transfer, pkts, npkts) < npkts)
                 goto fail_write;
-            if (wlen>20)
-                if (att_write(d->fd, d->h->transfer, out+20, wlen-20) < 0)
-                    goto fail_write;
-
-            iptr += wlen;
-
+            if (debug>2)
+                for (int ii=0; ii<npkts; ii++)
+                    debug_pkt(&pkts[ii], iptr-buf + 20*(ii+1));
+        } else {
             // wait between packets, because the devices don't like having them spit out
             // at max speed with min connection interval
-            gettimeofday(&now, NULL);
+            pace_restart(&pacer);
+            for (int ii=0; ii<npkts; ii++) {
+                pace_wait(&pacer);
+                if (att_writev(&d->att, d->h->transfer, pkts[ii].iov, pkts[ii].iovcnt) < 0)
+                    goto fail_write;
 
-            if (debug>2) {
-                fprintf(stderr, "%010ld.%06ld: %04x: ", now.tv_sec, now.tv_usec, (int)(iptr-buf));
-                hexlify(stderr, out, wlen, true);
+                if (debug>2)
+                    debug_pkt(&pkts[ii], iptr-buf + 20*(ii+1));
             }
-
-            useconds_t elapsed_usec = ((now.tv_sec-lastpkt.tv_sec)*1000000 + now.tv_usec-lastpkt.tv_usec);
-            if (elapsed_usec < write_delay) usleep(write_delay - elapsed_usec);
-            memcpy(&lastpkt, &now, sizeof now);
         }
         iptr = checkpoint; // trim CRC bytes from input position
 
         if (EXPECT_uint32(d, d->h->check, ++counter) < 0) // didn't get expected counter
             goto fail_write;
+        if (d->progress)
+            d->progress(d->progress_arg, fileno, iptr-buf, length);
         if (debug) {
             time_t current = time(NULL);
             int rate = current-startat ? (iptr-buf)/(current-startat) : 9999;
@@ -368,6 +543,10 @@ tt_write_file(TTDEV *d, uint32_t fileno, int debug, const uint8_t *buf, uint32_t
             fflush(stdout);
         }
     }
+    free(crcs);
+    pace_done(&pacer);
+    if (debug>1)
+        pace_report(&pacer, stderr, "");
 
     uint32_t status;
     if (EXPECT_ANY_uint32(d, d->h->cmd_status, &status) < 0)
@@ -380,9 +559,34 @@ tt_write_file(TTDEV *d, uint32_t fileno, int debug, const uint8_t *buf, uint32_t
 fail_write:
     fprintf(stderr, "File write failed at byte position %d of %d\n", (int)(iptr-buf), length);
     perror("fail");
+    pace_done(&pacer);
+fail_prewrite:
+    free(crcs);
     return -1;
 }
 
+// Like tt_write_file, but sends the contents of an open file, mapped rather than copied into memory
+int
+tt_write_file_fd(TTDEV *d, uint32_t fileno, int debug, int fd, uint32_t write_delay)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    else if (st.st_size > UINT32_MAX)
+        return -EFBIG;
+    else if (st.st_size == 0)
+        return tt_write_file(d, fileno, debug, NULL, 0, write_delay);
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int result = tt_write_file(d, fileno, debug, map, st.st_size, write_delay);
+    munmap(map, st.st_size);
+    return result;
+}
+
 int
 tt_delete_file(TTDEV *d, uint32_t fileno)
 {
@@ -390,7 +594,7 @@ tt_delete_file(TTDEV *d, uint32_t fileno)
         return -EINVAL;
 
     uint8_t cmd[] = {MSG_DELETE, (fileno>>16)&0xff, fileno&0xff, (fileno>>8)&0xff};
-    att_wrreq(d->fd, d->h->cmd_status, cmd, sizeof cmd);
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
     if (EXPECT_uint32(d, d->h->cmd_status, 1) < 0)
         return -1;
 
@@ -399,8 +603,10 @@ tt_delete_file(TTDEV *d, uint32_t fileno)
     union { uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; uint32_t out; } r;
     int rlen;
     for (;;) {
-        rlen = att_read_not(d->fd, &handle, r.buf);
-        if (handle==d->h->cmd_status && rlen==4 && r.out==0)
+        rlen = att_read_not(&d->att, &handle, r.buf);
+        if (rlen < 0)
+            return -1;
+        else if (handle==d->h->cmd_status && rlen==4 && r.out==0)
             return 0;
         else if (handle!=d->h->transfer)
             return -1;
@@ -415,7 +621,7 @@ tt_list_sub_files(TTDEV *d, uint32_t fileno, uint16_t **outlist)
         return -EINVAL;
 
     uint8_t cmd[] = {MSG_LIST_FILES, (fileno>>16)&0xff, fileno&0xff, (fileno>>8)&0xff};
-    att_wrreq(d->fd, d->h->cmd_status, cmd, sizeof cmd);
+    att_wrreq(&d->att, d->h->cmd_status, cmd, sizeof cmd);
     if (EXPECT_uint32(d, d->h->cmd_status, 1) < 0)
         return -1;
 
@@ -425,7 +631,9 @@ tt_list_sub_files(TTDEV *d, uint32_t fileno, uint16_t **outlist)
     if (rlen<2)
         return -1;
     int n_files = btohs(r.vals[0]);
-    uint16_t *list = *outlist = calloc(sizeof(uint16_t), n_files);
+    uint16_t *list = *outlist = d->alloc.malloc(sizeof(uint16_t) * (n_files+1), d->alloc.arg);
+    if (!list)
+        return -1;
     void *optr = mempcpy(list, r.vals+1, rlen-2);
 
     // read rest of packets (if we have a long file list?)
@@ -445,6 +653,7 @@ tt_list_sub_files(TTDEV *d, uint32_t fileno, uint16_t **outlist)
     return n_files;
 
 fail:
-    free(list);
+    tt_free(d, list);
+    *outlist = NULL;
     return -1;
 }
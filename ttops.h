@@ -4,6 +4,9 @@
 #include "version.h"
 #include "bbatt.h"
 
+// checkpoint occurs every (256*20-2) data bytes and at EOF
+#define TT_BLOCK_LEN (256*20-2)
+
 struct tt_handles { uint16_t ppcp, passcode, magic, cmd_status, length, transfer, check; };
 
 struct ble_dev_info {
@@ -13,34 +16,59 @@ struct ble_dev_info {
     int len;
 };
 
+#define TT_MAX_INFO 8
+
+/* Where the buffers returned by tt_read_file and tt_list_sub_files come from;
+ * NULL means the C library's malloc/free. Release them with tt_free. */
+struct tt_alloc {
+    void *(*malloc)(size_t size, void *arg);
+    void (*free)(void *ptr, void *arg);
+    void *arg;
+};
+
+/* Called after each checkpoint of a file transfer, on the thread doing it */
+typedef void (*tt_progress_fn)(void *arg, uint32_t fileno, uint32_t done, uint32_t total);
+
 typedef struct ttdev {
-    int fd;
+    struct att_sock att;        // the connection, which the caller opens and closes
     int protocol_version;
-    struct tt_handles *h;
-    struct ble_dev_info *info; // stuff from UUID=180a (Device Information)
+    const struct tt_handles *h;
+    struct ble_dev_info info[TT_MAX_INFO]; // stuff from UUID=180a (Device Information)
 
     struct version_tuple oldest_tested_firmware, newest_tested_firmware;
-    const char **tested_models;
+    const char *const *tested_models;
     struct tt_files *files;
+
+    struct tt_alloc alloc;
+    tt_progress_fn progress;
+    void *progress_arg;
 } TTDEV;
 
 #include "util.h"
 
+const struct tt_handles *tt_protocol_handles(int protocol_version, const struct ble_dev_info **info);
+TTDEV *tt_device_new(int protocol_version, int fd, const struct tt_alloc *alloc);
 TTDEV *tt_device_init(int protocol_version, int fd);
 bool tt_device_done(TTDEV *d);
+void tt_set_progress(TTDEV *d, tt_progress_fn progress, void *arg);
+int tt_device_fd(TTDEV *d);
+void tt_free(TTDEV *d, void *ptr);
 struct ble_dev_info *tt_check_device_version(TTDEV *d, bool warning);
 int tt_authorize(TTDEV *d, char code[6], bool new_code);
 int tt_read_file(TTDEV *d, uint32_t fileno, int debug, uint8_t **buf);
 int tt_write_file(TTDEV *d, uint32_t fileno, int debug, const uint8_t *buf, uint32_t length, uint32_t write_delay);
+int tt_write_file_fd(TTDEV *d, uint32_t fileno, int debug, int fd, uint32_t write_delay);
 int tt_delete_file(TTDEV *d, uint32_t fileno);
 int tt_list_sub_files(TTDEV *d, uint32_t fileno, uint16_t **outlist);
 int tt_reboot(TTDEV *d);
+int tt_set_time(TTDEV *d, time_t utc, int32_t utc_offset);
+int tt_notify(TTDEV *d, const char *text, uint32_t write_delay);
 
 static inline int
 EXPECT_BYTES(TTDEV *d, uint8_t *buf)
 {
     uint16_t handle;
-    int length = att_read_not(d->fd, &handle, buf);
+    int length = att_read_not(&d->att, &handle, buf);
     if (length < 0)
         return length;
     else if (handle != d->h->transfer) {
@@ -56,7 +84,7 @@ EXPECT_LENGTH(TTDEV *d)
 {
     union { uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; uint32_t out; } r;
     uint16_t handle;
-    int length = att_read_not(d->fd, &handle, r.buf);
+    int length = att_read_not(&d->att, &handle, r.buf);
     if (length < 0)
         return length;
     else if ((handle != d->h->length) || (length != 4)) {
@@ -72,7 +100,7 @@ EXPECT_ANY_uint32(TTDEV *d, uint16_t handle, uint32_t *val)
 {
     union { uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; uint32_t out; } r;
     uint16_t h;
-    int length = att_read_not(d->fd, &h, r.buf);
+    int length = att_read_not(&d->att, &h, r.buf);
     if (length < 0)
         return length;
     else if ((h != handle) || (length != 4)) {
@@ -90,7 +118,7 @@ EXPECT_uint32(TTDEV *d, uint16_t handle, uint32_t val)
 {
     union { uint8_t buf[BT_ATT_DEFAULT_LE_MTU]; uint32_t out; } r;
     uint16_t h;
-    int length = att_read_not(d->fd, &h, r.buf);
+    int length = att_read_not(&d->att, &h, r.buf);
     if (length < 0)
         return length;
     else if ((h != handle) || (length != 4) || (btohl(r.out)!=val)) {
@@ -106,7 +134,7 @@ EXPECT_uint8(TTDEV *d, uint16_t handle, uint8_t val)
 {
     uint8_t buf[BT_ATT_DEFAULT_LE_MTU];
     uint16_t h;
-    int length = att_read_not(d->fd, &h, buf);
+    int length = att_read_not(&d->att, &h, buf);
     if (length < 0)
         return length;
     else if ((h != handle) || (length != 1) || (*buf!=val)) {
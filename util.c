@@ -3,8 +3,8 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <signal.h>
 #include <time.h>
+#include <sys/time.h>
 
 __attribute__ ((format (printf, 1, 2)))
 void
@@ -23,47 +23,35 @@ term_title(const char *fmt, ...)
 
 /****************************************************************************/
 
-// This is a weird workaround for the non-realtime-awareness of sleep(3):
-// http://stackoverflow.com/questions/32152276/real-time-aware-sleep-call
-
-static void
-nullhandler(int signal) {}
-
-int
-isleep(int seconds, int verbose)
+double
+elapsed_secs(const struct timeval *since)
 {
-    if (verbose) {
-        fprintf(stderr, "Sleeping for %d seconds...", seconds);
-        fflush(stderr);
-    }
-    signal(SIGALRM, nullhandler);
-
-    int res=0, elapsed=0;
-    for (time_t t=time(NULL); (elapsed<seconds) && (res<=0); elapsed=time(NULL)-t)
-        res = sleep((seconds-elapsed > 30) ? 30 : seconds-elapsed);
-
-    signal(SIGALRM, SIG_IGN);
-    if (verbose)
-        fputs(res ? " woken by signal!\n\n" : "\n", stderr);
-    return (res>0);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec)/1e6;
 }
 
+// CRC16_modbus (reflected polynomial 0xA001), one table lookup per byte
+static const uint16_t crc16_table[256] = {
+#define R(c) (((c)&1) ? ((c)>>1)^0xA001 : (c)>>1)
+#define T(b) R(R(R(R(R(R(R(R((uint32_t)(b)))))))))
+#define T4(b) T(b), T(b+1), T(b+2), T(b+3)
+#define T16(b) T4(b), T4(b+4), T4(b+8), T4(b+12)
+#define T64(b) T16(b), T16(b+16), T16(b+32), T16(b+48)
+    T64(0), T64(64), T64(128), T64(192)
+#undef T64
+#undef T16
+#undef T4
+#undef T
+#undef R
+};
+
 uint32_t
 crc16(const uint8_t *buf, size_t len, uint32_t start)
 {
     uint32_t crc = start;		        // should be 0xFFFF first time
-    for (size_t pos = 0; pos < len; pos++) {
-        crc ^= (uint32_t)buf[pos];          // XOR byte into least sig. byte of crc
-
-        for (int i = 8; i != 0; i--) {  // Loop over each bit
-            if ((crc & 0x0001) != 0) {  // If the LSB is set
-                crc >>= 1;              // Shift right and XOR 0xA001
-                crc ^= 0xA001;
-            }
-            else                        // Else LSB is not set
-                crc >>= 1;              // Just shift right
-        }
-    }
+    while (len--)
+        crc = (crc >> 8) ^ crc16_table[(crc ^ *buf++) & 0xff];
     return crc;
 }
 
@@ -6,7 +6,8 @@
 __attribute__ ((format (printf, 1, 2)))
 void term_title(const char *fmt, ...);
 
-int isleep(int seconds, int verbose);
+struct timeval;
+double elapsed_secs(const struct timeval *since);
 
 uint32_t crc16(const uint8_t *buf, size_t len, uint32_t start);
 void hexlify(FILE *where, const uint8_t *buf, size_t len, bool newl);
@@ -15,12 +15,15 @@ parse_version(const char *s, struct version_tuple *v, char *seps) {
 }
 
 const char *
-str_version(struct version_tuple *v, char sep) {
-    static char buf[100]; //FIXME
-    char *s = buf;
-    for (int ii=0; ii<v->len; ii++)
-        s += sprintf(s, "%d%c", v->tuple[ii], sep);
-    s[-1] = '\0';
+str_version(struct version_tuple *v, char sep, char *buf, size_t len) {
+    size_t off = 0;
+    buf[0] = '\0';
+    for (int ii=0; ii<v->len && off<len; ii++) {
+        if (ii)
+            off += snprintf(buf+off, len-off, "%c", sep);
+        if (off<len)
+            off += snprintf(buf+off, len-off, "%d", v->tuple[ii]);
+    }
     return buf;
 }
 
@@ -48,18 +51,19 @@ int main(int argc, char **argv) {
     const char *vs = "1.8.37";
 
     struct version_tuple version = {0};
+    char buf[VERSION_STR_MAX];
     parse_version(vs, &version, ".");
     
-    printf("%s cmp %s = %d\n", vs, str_version(&older,'.'), compare_versions(&version, &older));
-    printf("%s cmp %s = %d\n", vs, str_version(&newer,'.'), compare_versions(&version, &newer));
+    printf("%s cmp %s = %d\n", vs, str_version(&older,'.',buf,sizeof buf), compare_versions(&version, &older));
+    printf("%s cmp %s = %d\n", vs, str_version(&newer,'.',buf,sizeof buf), compare_versions(&version, &newer));
     printf("%s cmp %s = %d\n", old_s, new_s, compare_versions(&older, &newer));
     printf("%s cmp %s = %d\n", new_s, old_s, compare_versions(&newer, &older));
 
     vs = "1.8.46.0";
     parse_version(vs, &version, ".");
     
-    printf("%s cmp %s = %d\n", vs, str_version(&older,'.'), compare_versions(&version, &older));
-    printf("%s cmp %s = %d\n", vs, str_version(&newer,'.'), compare_versions(&version, &newer));
+    printf("%s cmp %s = %d\n", vs, str_version(&older,'.',buf,sizeof buf), compare_versions(&version, &older));
+    printf("%s cmp %s = %d\n", vs, str_version(&newer,'.',buf,sizeof buf), compare_versions(&version, &newer));
     return 0;
 }
 #endif
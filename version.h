@@ -1,11 +1,14 @@
 #ifndef __VERSION_H__
 #define __VERSION_H__
 
+#include <stddef.h>
+
 #define VERSION_TUPLE(...) ((struct version_tuple){ .len=(sizeof((int[]){__VA_ARGS__})/sizeof(int)), .tuple={__VA_ARGS__} })
 struct version_tuple { int len; int tuple[4]; };
+#define VERSION_STR_MAX 48 /* enough for 4 ints and their separators */
 
 int parse_version(const char *s, struct version_tuple *v, char *seps);
 int compare_versions(struct version_tuple *v1, struct version_tuple *v2);
-const char *str_version(struct version_tuple *v, char sep);
+const char *str_version(struct version_tuple *v, char sep, char *buf, size_t len);
 
 #endif /* #ifndef __VERSION_H__ */
@@ -0,0 +1,131 @@
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xxh64.h"
+
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// little-endian loads, whatever the host
+static inline uint64_t
+read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1]<<8 | (uint64_t)p[2]<<16 | (uint64_t)p[3]<<24
+        | (uint64_t)p[4]<<32 | (uint64_t)p[5]<<40 | (uint64_t)p[6]<<48 | (uint64_t)p[7]<<56;
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * P2, 31) * P1;
+}
+
+static inline uint64_t
+merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ round64(0, v)) * P1 + P4;
+}
+
+void
+xxh64_init(struct xxh64 *h, uint64_t seed)
+{
+    memset(h, 0, sizeof *h);
+    h->seed = seed;
+    h->v[0] = seed + P1 + P2;
+    h->v[1] = seed + P2;
+    h->v[2] = seed;
+    h->v[3] = seed - P1;
+}
+
+/* The four lanes are independent, so that the compiler can keep them all in flight at once */
+static const uint8_t *
+stripes(uint64_t v[4], const uint8_t *p, const uint8_t *end)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    for (; p + 32 <= end; p += 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p+8));
+        v2 = round64(v2, read64(p+16));
+        v3 = round64(v3, read64(p+24));
+    }
+    v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+    return p;
+}
+
+void
+xxh64_update(struct xxh64 *h, const void *data, size_t len)
+{
+    const uint8_t *p = data, *end = p + len;
+
+    h->total += len;
+    if (h->n + len < 32) {
+        memcpy(h->buf + h->n, p, len);
+        h->n += len;
+        return;
+    }
+    if (h->n) {
+        memcpy(h->buf + h->n, p, 32 - h->n);
+        p += 32 - h->n;
+        stripes(h->v, h->buf, h->buf + 32);
+        h->n = 0;
+    }
+    p = stripes(h->v, p, end);
+    h->n = end - p;
+    memcpy(h->buf, p, h->n);
+}
+
+uint64_t
+xxh64_digest(const struct xxh64 *h)
+{
+    const uint8_t *p = h->buf, *end = p + h->n;
+    uint64_t acc;
+
+    if (h->total >= 32) {
+        acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+        for (int ii=0; ii<4; ii++)
+            acc = merge(acc, h->v[ii]);
+    } else
+        acc = h->seed + P5;
+    acc += h->total;
+
+    for (; p + 8 <= end; p += 8)
+        acc = rotl(acc ^ round64(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        acc = rotl(acc ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        acc = rotl(acc ^ (*p * P5), 11) * P1;
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed)
+{
+    struct xxh64 h;
+    xxh64_init(&h, seed);
+    xxh64_update(&h, data, len);
+    return xxh64_digest(&h);
+}
@@ -0,0 +1,26 @@
+#ifndef __XXH64_H__
+#define __XXH64_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * XXH64, the 64-bit xxHash (https://github.com/Cyan4973/xxHash), computed
+ * incrementally so that a file can be fingerprinted as it's written. The
+ * results match xxh64sum, which can check the .xxh64 files next to each
+ * saved activity (xxh64sum -c).
+ */
+
+struct xxh64 {
+    uint64_t v[4];          // one accumulator per lane of each 32-byte stripe
+    uint64_t seed, total;
+    uint8_t buf[32];        // tail of the input which doesn't fill a stripe yet
+    int n;
+};
+
+void xxh64_init(struct xxh64 *h, uint64_t seed);
+void xxh64_update(struct xxh64 *h, const void *data, size_t len);
+uint64_t xxh64_digest(const struct xxh64 *h);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif /* __XXH64_H__ */